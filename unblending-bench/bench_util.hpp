@@ -0,0 +1,138 @@
+#ifndef BENCH_UTIL_HPP
+#define BENCH_UTIL_HPP
+
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <json11.hpp>
+#include <unblending/unblending.hpp>
+#include <sys/resource.h>
+
+namespace benchutil
+{
+    using unblending::LayerInfo;
+    using unblending::BlendMode;
+    using unblending::CompOp;
+    using unblending::Vec3;
+    using unblending::Mat3;
+
+    using Clock = std::chrono::steady_clock;
+
+    inline double get_elapsed_seconds(const Clock::time_point& start)
+    {
+        return std::chrono::duration<double>(Clock::now() - start).count();
+    }
+
+    /// \brief Result of a single benchmark.
+    /// \details When a call processes multiple items (e.g., pixels), items_per_call is used for reporting the
+    /// time per item.
+    struct BenchmarkResult
+    {
+        std::string name;
+        long long   iterations;
+        double      ns_per_call;
+        double      items_per_call;
+
+        json11::Json to_json() const
+        {
+            return json11::Json::object
+            {
+                { "name",        name },
+                { "iterations",  static_cast<double>(iterations) },
+                { "ns_per_call", ns_per_call },
+                { "ns_per_item", ns_per_call / items_per_call }
+            };
+        }
+    };
+
+    /// \brief Run the function repeatedly, doubling the number of iterations until the run takes at least min_time seconds.
+    template <typename Callable>
+    BenchmarkResult run_benchmark(const std::string& name, Callable function, const double min_time, const double items_per_call = 1.0)
+    {
+        // Warm up
+        function();
+
+        long long iterations = 1;
+        while (true)
+        {
+            const auto   start   = Clock::now();
+            for (long long i = 0; i < iterations; ++ i) { function(); }
+            const double elapsed = get_elapsed_seconds(start);
+
+            if (elapsed >= min_time)
+            {
+                const BenchmarkResult result{ name, iterations, 1e+09 * elapsed / static_cast<double>(iterations), items_per_call };
+                std::cout << std::left << std::setw(64) << result.name << std::right << std::setw(16) << std::fixed << std::setprecision(1) << result.ns_per_call << " ns/call";
+                if (items_per_call != 1.0) { std::cout << std::setw(12) << result.ns_per_call / items_per_call << " ns/item"; }
+                std::cout << std::endl;
+                return result;
+            }
+
+            iterations *= 2;
+        }
+    }
+
+    /// \brief Generate layer infos with random Gaussian color models. The bottom layer is always "Normal".
+    inline std::vector<LayerInfo> generate_random_layer_infos(const int                     num_layers,
+                                                              const std::vector<BlendMode>& modes,
+                                                              const unsigned                seed)
+    {
+        std::mt19937 engine(seed);
+        std::uniform_real_distribution<double> color_distribution(0.1, 0.9);
+        std::uniform_real_distribution<double> variance_distribution(0.01, 0.1);
+
+        std::vector<LayerInfo> layer_infos;
+        for (int index = 0; index < num_layers; ++ index)
+        {
+            const Vec3      mu(color_distribution(engine), color_distribution(engine), color_distribution(engine));
+            const double    variance = variance_distribution(engine);
+            const BlendMode mode     = (index == 0) ? BlendMode::Normal : modes[(index - 1) % modes.size()];
+
+            layer_infos.push_back(LayerInfo{ CompOp::SourceOver(), mode, std::make_shared<unblending::GaussianColorModel>(mu, Mat3::Identity() / variance) });
+        }
+        return layer_infos;
+    }
+
+    /// \brief Get the peak resident set size (in megabytes).
+    /// \details On Linux, this is the high-water mark since the last call of reset_peak_rss (VmHWM). Otherwise,
+    /// it is the peak of the whole process (ru_maxrss).
+    inline double get_peak_rss_in_mb()
+    {
+        std::ifstream status_file("/proc/self/status");
+        std::string   line;
+        while (std::getline(status_file, line))
+        {
+            if (line.compare(0, 6, "VmHWM:") == 0) { return std::stod(line.substr(6)) / 1024.0; }
+        }
+
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+        return static_cast<double>(usage.ru_maxrss) / (1024.0 * 1024.0);
+#else
+        return static_cast<double>(usage.ru_maxrss) / 1024.0;
+#endif
+    }
+
+    /// \brief Reset the peak resident set size to the current one so that the peak of each stage can be measured.
+    /// \return False if this is not supported (i.e., the peak is accumulated over the whole process).
+    inline bool reset_peak_rss()
+    {
+        std::ofstream clear_refs_file("/proc/self/clear_refs");
+        if (!clear_refs_file) { return false; }
+        clear_refs_file << "5";
+        return static_cast<bool>(clear_refs_file.flush());
+    }
+
+    inline void write_json(const json11::Json& json, const std::string& file_path)
+    {
+        std::ofstream writing_file(file_path);
+        writing_file << json.dump();
+    }
+}
+
+#endif // BENCH_UTIL_HPP
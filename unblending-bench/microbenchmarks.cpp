@@ -0,0 +1,225 @@
+#include <string>
+#include <vector>
+#include <random>
+#include <thread>
+#include <iostream>
+#include <functional>
+#include <unblending/unblending.hpp>
+#include <unblending/equations.hpp>
+#include <unblending/optimization.hpp>
+#include <unblending/linear_unmixing.hpp>
+#include <cxxopts.hpp>
+#include "bench_util.hpp"
+
+using namespace unblending;
+using benchutil::BenchmarkResult;
+using benchutil::run_benchmark;
+
+namespace
+{
+    // Prevents the compiler from removing the benchmarked calls
+    volatile double sink;
+
+    const std::vector<int> layer_counts = { 2, 4, 8 };
+
+    // Blend modes that are cycled through when a benchmark is not specific to a blend mode
+    const std::vector<BlendMode> mixed_modes = { BlendMode::Multiply, BlendMode::Screen, BlendMode::Overlay, BlendMode::SoftLight };
+
+    struct RandomPixel
+    {
+        VecX alphas;
+        VecX colors;
+    };
+
+    RandomPixel generate_random_pixel(int num_layers, unsigned seed)
+    {
+        std::mt19937 engine(seed);
+        std::uniform_real_distribution<double> distribution(0.0, 1.0);
+
+        RandomPixel pixel{ VecX(num_layers), VecX(num_layers * 3) };
+        for (int i = 0; i < num_layers; ++ i) { pixel.alphas(i) = (i == 0) ? 1.0 : distribution(engine); }
+        for (int i = 0; i < num_layers * 3; ++ i) { pixel.colors(i) = distribution(engine); }
+        return pixel;
+    }
+
+    std::vector<ColorImage> generate_random_layers(int num_layers, int width, int height, unsigned seed)
+    {
+        std::vector<ColorImage> layers;
+        for (int index = 0; index < num_layers; ++ index)
+        {
+            ColorImage layer(width, height);
+            for (int y = 0; y < height; ++ y) for (int x = 0; x < width; ++ x)
+            {
+                const RandomPixel pixel = generate_random_pixel(2, seed + index * width * height + y * width + x);
+                layer.set_rgba(x, y, pixel.colors.segment<3>(0), (index == 0) ? 1.0 : pixel.alphas(1));
+            }
+            layers.push_back(layer);
+        }
+        return layers;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    cxxopts::Options options("unblending-bench", " - Microbenchmarks of the kernels in the ``unblending'' library.");
+
+    options.add_options()("j,json", "Path to the output JSON file", cxxopts::value<std::string>());
+    options.add_options()("f,filter", "Run only benchmarks whose names contain this string", cxxopts::value<std::string>()->default_value(""));
+    options.add_options()("t,min-time", "Minimum duration (seconds) of each benchmark", cxxopts::value<double>()->default_value("0.2"));
+    options.add_options()("l,layer-infos-path", "Path to the layer infos (json) used for the solver benchmarks (default: random layers)", cxxopts::value<std::string>());
+    options.add_options()("h,help", "Print help");
+
+    const auto parse_result = options.parse(argc, argv);
+
+    if (parse_result.count("help"))
+    {
+        std::cout << options.help() << std::endl;
+        exit(0);
+    }
+
+    const std::string filter   = parse_result["filter"].as<std::string>();
+    const double      min_time = parse_result["min-time"].as<double>();
+
+    std::vector<BenchmarkResult> results;
+
+    auto run = [&](const std::string& name, const std::function<void()>& function, double items_per_call)
+    {
+        if (name.find(filter) == std::string::npos) { return; }
+        results.push_back(run_benchmark(name, function, min_time, items_per_call));
+    };
+
+    // Per-pixel composite_layers
+    for (const BlendMode mode : get_blend_mode_list())
+    {
+        for (const int num_layers : layer_counts)
+        {
+            const RandomPixel            pixel = generate_random_pixel(num_layers, 0);
+            const std::vector<CompOp>    comp_ops(num_layers, CompOp::SourceOver());
+            const std::vector<BlendMode> modes(num_layers, mode);
+
+            run("composite_layers/pixel/" + retrieve_name(mode) + "/" + std::to_string(num_layers), [&]()
+            {
+                sink = composite_layers(pixel.alphas, pixel.colors, comp_ops, modes)(0);
+            }, 1.0);
+        }
+    }
+
+    // Image-level composite_layers (single thread; reported per pixel)
+    constexpr int image_size = 256;
+    for (const BlendMode mode : get_blend_mode_list())
+    {
+        for (const int num_layers : layer_counts)
+        {
+            const std::vector<ColorImage> layers = generate_random_layers(num_layers, image_size, image_size, 0);
+            const std::vector<CompOp>     comp_ops(num_layers, CompOp::SourceOver());
+            const std::vector<BlendMode>  modes(num_layers, mode);
+
+            run("composite_layers/image/" + retrieve_name(mode) + "/" + std::to_string(num_layers), [&]()
+            {
+                sink = composite_layers(layers, comp_ops, modes, 1).get_r().get_pixel(0, 0);
+            }, image_size * image_size);
+        }
+    }
+
+    // calculate_derivative_of_constraint_vector
+    for (const bool use_target_alphas : { false, true })
+    {
+        for (const int num_layers : layer_counts)
+        {
+            const RandomPixel            pixel = generate_random_pixel(num_layers, 1);
+            const std::vector<CompOp>    comp_ops(num_layers, CompOp::SourceOver());
+            const std::vector<BlendMode> modes = extract_blend_modes(benchutil::generate_random_layer_infos(num_layers, mixed_modes, 0));
+            const Vec3                   target_color(0.5, 0.5, 0.5);
+
+            run(std::string("calculate_derivative_of_constraint_vector/") + (use_target_alphas ? "refinement/" : "unmixing/") + std::to_string(num_layers), [&]()
+            {
+                sink = calculate_derivative_of_constraint_vector(pixel.alphas, pixel.colors, target_color, comp_ops, modes, use_target_alphas, pixel.alphas)(0, 0);
+            }, 1.0);
+        }
+    }
+
+    // objective_function
+    for (const int num_layers : layer_counts)
+    {
+        const RandomPixel pixel = generate_random_pixel(num_layers, 2);
+        const auto layer_infos  = benchutil::generate_random_layer_infos(num_layers, mixed_modes, 0);
+
+        OptimizationParameterSet set;
+        set.models            = extract_color_models(layer_infos);
+        set.comp_ops          = extract_comp_ops(layer_infos);
+        set.modes             = extract_blend_modes(layer_infos);
+        set.lambda            = VecX::Constant(4, 0.1);
+        set.rho               = 100.0;
+        set.target_color      = Vec3(0.5, 0.5, 0.5);
+        set.sigma             = 10.0;
+        set.use_sparcity      = false;
+        set.use_minimum_alpha = true;
+        set.use_target_alphas = false;
+
+        std::vector<double> x(num_layers * 4);
+        std::vector<double> grad(num_layers * 4);
+        Eigen::Map<VecX>(&x[0], num_layers)              = pixel.alphas;
+        Eigen::Map<VecX>(&x[num_layers], num_layers * 3) = pixel.colors;
+
+        run("objective_function/" + std::to_string(num_layers), [&]()
+        {
+            sink = objective_function(x, grad, &set);
+        }, 1.0);
+    }
+
+    // Full per-pixel solves for representative colors
+    {
+        const std::vector<LayerInfo> layer_infos = parse_result.count("layer-infos-path") ? import_layer_infos(parse_result["layer-infos-path"].as<std::string>()) : benchutil::generate_random_layer_infos(4, mixed_modes, 0);
+
+        const auto models   = extract_color_models(layer_infos);
+        const auto comp_ops = extract_comp_ops(layer_infos);
+        const auto modes    = extract_blend_modes(layer_infos);
+
+        std::vector<std::pair<std::string, Vec3>> colors =
+        {
+            { "black", Vec3(0.05, 0.05, 0.05) },
+            { "white", Vec3(0.95, 0.95, 0.95) },
+            { "gray",  Vec3(0.50, 0.50, 0.50) },
+            { "red",   Vec3(0.90, 0.10, 0.10) },
+            { "green", Vec3(0.10, 0.90, 0.10) },
+            { "blue",  Vec3(0.10, 0.10, 0.90) },
+        };
+        for (int index = 0; index < static_cast<int>(models.size()); ++ index)
+        {
+            colors.push_back({ "model-" + std::to_string(index), models[index]->get_representative_color() });
+        }
+
+        const LinearUnmixingSolver linear_solver(models);
+
+        for (const auto& color : colors)
+        {
+            run("solve_per_pixel_optimization/" + color.first, [&]()
+            {
+                sink = solve_per_pixel_optimization(color.second, models, comp_ops, modes)(0);
+            }, 1.0);
+        }
+        for (const auto& color : colors)
+        {
+            run("LinearUnmixingSolver::solve/" + color.first, [&]()
+            {
+                sink = linear_solver.solve(color.second)(0);
+            }, 1.0);
+        }
+    }
+
+    if (parse_result.count("json"))
+    {
+        std::vector<json11::Json> results_json;
+        for (const BenchmarkResult& result : results) { results_json.push_back(result.to_json()); }
+
+        const json11::Json json = json11::Json::object
+        {
+            { "benchmarks", results_json },
+            { "hardware_concurrency", static_cast<int>(std::thread::hardware_concurrency()) },
+            { "date", get_current_time_in_string() }
+        };
+        benchutil::write_json(json, parse_result["json"].as<std::string>());
+    }
+
+    return 0;
+}
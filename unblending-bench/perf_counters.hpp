@@ -0,0 +1,144 @@
+#ifndef PERF_COUNTERS_HPP
+#define PERF_COUNTERS_HPP
+
+#include <cstdint>
+#include <json11.hpp>
+
+#ifdef __linux__
+#include <cstring>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+namespace benchutil
+{
+    /// \brief Values of the hardware performance counters.
+    struct PerfCounterValues
+    {
+        double cycles        = 0.0;
+        double instructions  = 0.0;
+        double llc_misses    = 0.0;
+        double branch_misses = 0.0;
+
+        PerfCounterValues operator-(const PerfCounterValues& other) const
+        {
+            PerfCounterValues result;
+            result.cycles        = cycles - other.cycles;
+            result.instructions  = instructions - other.instructions;
+            result.llc_misses    = llc_misses - other.llc_misses;
+            result.branch_misses = branch_misses - other.branch_misses;
+            return result;
+        }
+
+        PerfCounterValues& operator+=(const PerfCounterValues& other)
+        {
+            cycles        += other.cycles;
+            instructions  += other.instructions;
+            llc_misses    += other.llc_misses;
+            branch_misses += other.branch_misses;
+            return *this;
+        }
+
+        /// \details Low instructions per cycle with many last-level cache misses per kilo-instruction indicates
+        /// a memory-bound stage; high instructions per cycle indicates a compute-bound one.
+        json11::Json to_json() const
+        {
+            return json11::Json::object
+            {
+                { "cycles",                          cycles },
+                { "instructions",                    instructions },
+                { "llc_misses",                      llc_misses },
+                { "branch_misses",                   branch_misses },
+                { "instructions_per_cycle",          (cycles > 0.0) ? instructions / cycles : 0.0 },
+                { "llc_misses_per_kilo_instruction", (instructions > 0.0) ? 1000.0 * llc_misses / instructions : 0.0 }
+            };
+        }
+    };
+
+    /// \brief Hardware performance counters of this process (cycles, instructions, last-level cache misses, and
+    /// branch misses) via perf_event_open.
+    /// \details The counters are inherited by the threads that are created after the construction, and the counts
+    /// of a thread are added when it finishes; as the worker threads of parallel-util are joined at the end of each
+    /// parallel loop, the difference of two readings covers all the threads of a stage. Only user-space events are
+    /// counted so that a restrictive perf_event_paranoid setting is less likely to prohibit them. This is available
+    /// only on Linux.
+    class PerfCounters
+    {
+    public:
+        PerfCounters()
+        {
+#ifdef __linux__
+            const std::uint64_t configs[num_counters] =
+            {
+                PERF_COUNT_HW_CPU_CYCLES,
+                PERF_COUNT_HW_INSTRUCTIONS,
+                PERF_COUNT_HW_CACHE_MISSES,
+                PERF_COUNT_HW_BRANCH_MISSES
+            };
+
+            for (int i = 0; i < num_counters; ++ i)
+            {
+                perf_event_attr attr;
+                std::memset(&attr, 0, sizeof(attr));
+                attr.size           = sizeof(attr);
+                attr.type           = PERF_TYPE_HARDWARE;
+                attr.config         = configs[i];
+                attr.inherit        = 1;
+                attr.exclude_kernel = 1;
+                attr.exclude_hv     = 1;
+                attr.read_format    = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+                file_descriptors_[i] = static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, - 1, - 1, 0));
+            }
+#endif
+        }
+
+        ~PerfCounters()
+        {
+#ifdef __linux__
+            for (int i = 0; i < num_counters; ++ i) { if (file_descriptors_[i] >= 0) { close(file_descriptors_[i]); } }
+#endif
+        }
+
+        PerfCounters(const PerfCounters&)            = delete;
+        PerfCounters& operator=(const PerfCounters&) = delete;
+
+        bool is_available() const
+        {
+            for (int i = 0; i < num_counters; ++ i) { if (file_descriptors_[i] < 0) { return false; } }
+            return true;
+        }
+
+        /// \brief Read the counts accumulated since the construction (scaled when the counters are multiplexed).
+        PerfCounterValues read() const
+        {
+            double values[num_counters] = { 0.0, 0.0, 0.0, 0.0 };
+#ifdef __linux__
+            for (int i = 0; i < num_counters; ++ i)
+            {
+                if (file_descriptors_[i] < 0) { continue; }
+
+                std::uint64_t buffer[3] = { 0, 0, 0 }; // value, time enabled, time running
+                if (::read(file_descriptors_[i], buffer, sizeof(buffer)) != sizeof(buffer)) { continue; }
+
+                values[i] = (buffer[2] > 0 && buffer[2] < buffer[1]) ? static_cast<double>(buffer[0]) * static_cast<double>(buffer[1]) / static_cast<double>(buffer[2]) : static_cast<double>(buffer[0]);
+            }
+#endif
+
+            PerfCounterValues result;
+            result.cycles        = values[0];
+            result.instructions  = values[1];
+            result.llc_misses    = values[2];
+            result.branch_misses = values[3];
+            return result;
+        }
+
+    private:
+        static constexpr int num_counters = 4;
+
+        int file_descriptors_[num_counters] = { - 1, - 1, - 1, - 1 };
+    };
+}
+
+#endif // PERF_COUNTERS_HPP
@@ -0,0 +1,400 @@
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <unblending/unblending.hpp>
+#include <unblending/instrumentation.hpp>
+#include <cxxopts.hpp>
+#include "bench_util.hpp"
+#include "perf_counters.hpp"
+
+using namespace unblending;
+using json11::Json;
+using benchutil::PerfCounters;
+using benchutil::PerfCounterValues;
+
+namespace
+{
+    // The stages in the order of the pipeline (the same as the CLI)
+    const std::vector<std::string> stage_names = { "decode", "resize", "unmixing", "refinement", "recomposition", "export" };
+
+    // A section reported by the library inside a stage (e.g., the guided filters in the refinement)
+    struct SectionResult
+    {
+        int               count         = 0;
+        double            seconds       = 0.0;
+        double            peak_image_mb = 0.0;
+        PerfCounterValues counters;
+    };
+
+    struct StageResult
+    {
+        double seconds       = 0.0;
+        double peak_rss_mb   = 0.0;
+        double peak_image_mb = 0.0;
+        int    num_pixels    = 0;
+
+        bool              has_counters = false;
+        PerfCounterValues counters;
+
+        std::map<std::string, SectionResult> sections;
+
+        Json to_json() const
+        {
+            Json::object json
+            {
+                { "seconds",           seconds },
+                { "pixels_per_second", (seconds > 0.0) ? num_pixels / seconds : 0.0 },
+                { "peak_rss_mb",       peak_rss_mb },
+                { "peak_image_mb",     peak_image_mb }
+            };
+            if (has_counters) { json["counters"] = counters.to_json(); }
+            if (!sections.empty())
+            {
+                Json::object sections_json;
+                for (const auto& section : sections)
+                {
+                    Json::object section_json { { "count", section.second.count }, { "seconds", section.second.seconds }, { "peak_image_mb", section.second.peak_image_mb } };
+                    if (has_counters) { section_json["counters"] = section.second.counters.to_json(); }
+                    sections_json[section.first] = section_json;
+                }
+                json["sections"] = sections_json;
+            }
+            return json;
+        }
+    };
+
+    Json to_json(const OptimizationStatistics& statistics)
+    {
+        return Json::object
+        {
+            { "num_pixels",             statistics.num_pixels },
+            { "num_skipped_pixels",     statistics.num_skipped_pixels },
+            { "num_iterations",         static_cast<double>(statistics.num_iterations) },
+            { "num_evaluations",        static_cast<double>(statistics.num_evaluations) },
+            { "mean_iterations",        statistics.get_mean_iterations() },
+            { "max_iterations",         statistics.max_iterations },
+            { "num_unconverged_pixels", statistics.num_unconverged_pixels }
+        };
+    }
+
+    std::vector<std::string> split(const std::string& text, const char delimiter)
+    {
+        std::vector<std::string> items;
+        std::stringstream stream(text);
+        std::string item;
+        while (std::getline(stream, item, delimiter)) { if (!item.empty()) { items.push_back(item); } }
+        return items;
+    }
+
+    // Runs stages and measures their wall time, peak memory usage, and (optionally) hardware performance counters,
+    // as well as those of the sections reported by the library via the stage observers
+    class StageMeter
+    {
+    public:
+        StageMeter(const PerfCounters* counters) : counters_(counters)
+        {
+            set_stage_begin_observer([this](const std::string&) { snapshots_.push_back(read_counters()); });
+            set_stage_observer([this](const std::string& name, double seconds)
+            {
+                SectionResult& section = sections_[name];
+                section.count    += 1;
+                section.seconds  += seconds;
+                section.counters += read_counters() - snapshots_.back();
+                snapshots_.pop_back();
+            });
+            set_stage_memory_observer([this](const std::string& name, std::size_t peak_bytes)
+            {
+                SectionResult& section = sections_[name];
+                section.peak_image_mb = std::max(section.peak_image_mb, to_megabytes(peak_bytes));
+            });
+        }
+
+        ~StageMeter()
+        {
+            set_stage_observer(nullptr);
+            set_stage_begin_observer(nullptr);
+            set_stage_memory_observer(nullptr);
+        }
+
+        template <typename Callable>
+        StageResult measure(Callable function, const int num_pixels)
+        {
+            sections_.clear();
+            benchutil::reset_peak_rss();
+            reset_peak_image_memory_usage();
+
+            const PerfCounterValues counters = read_counters();
+            const auto              start    = benchutil::Clock::now();
+            function();
+
+            StageResult result;
+            result.seconds       = benchutil::get_elapsed_seconds(start);
+            result.peak_rss_mb   = benchutil::get_peak_rss_in_mb();
+            result.peak_image_mb = to_megabytes(get_peak_image_memory_usage());
+            result.num_pixels    = num_pixels;
+            result.has_counters  = counters_ != nullptr;
+            result.counters      = read_counters() - counters;
+            result.sections      = sections_;
+            return result;
+        }
+
+    private:
+        static double to_megabytes(std::size_t bytes) { return static_cast<double>(bytes) / (1024.0 * 1024.0); }
+
+        PerfCounterValues read_counters() const { return (counters_ != nullptr) ? counters_->read() : PerfCounterValues(); }
+
+        const PerfCounters* counters_;
+
+        std::vector<PerfCounterValues>       snapshots_;
+        std::map<std::string, SectionResult> sections_;
+    };
+
+    struct Regression
+    {
+        std::string case_name;
+        std::string metric;
+        double      baseline;
+        double      current;
+
+        Json to_json() const
+        {
+            return Json::object { { "case", case_name }, { "metric", metric }, { "baseline", baseline }, { "current", current } };
+        }
+    };
+
+    // Compare the current results with the baseline results case by case. A stage is regarded as regressed when it
+    // gets slower by more than the relative threshold and the absolute minimum difference (to ignore timer noise).
+    // The solver iteration counts are deterministic, so any increase beyond the threshold is reported as well.
+    std::vector<Regression> compare_with_baseline(const Json& current, const Json& baseline, const double threshold, const double min_seconds)
+    {
+        std::map<std::string, Json> baseline_cases;
+        for (const Json& case_json : baseline["cases"].array_items()) { baseline_cases[case_json["name"].string_value()] = case_json; }
+
+        std::vector<Regression> regressions;
+
+        std::cout << std::endl << "Comparison with the baseline:" << std::endl;
+        for (const Json& case_json : current["cases"].array_items())
+        {
+            const std::string name = case_json["name"].string_value();
+
+            const auto iter = baseline_cases.find(name);
+            if (iter == baseline_cases.end())
+            {
+                std::cout << "  " << name << ": not found in the baseline" << std::endl;
+                continue;
+            }
+            const Json& baseline_case = iter->second;
+
+            for (const std::string& stage_name : stage_names)
+            {
+                const double baseline_seconds = baseline_case["stages"][stage_name]["seconds"].number_value();
+                const double current_seconds  = case_json["stages"][stage_name]["seconds"].number_value();
+                const bool   is_regressed     = current_seconds > baseline_seconds * (1.0 + threshold) && current_seconds - baseline_seconds > min_seconds;
+
+                std::cout << "  " << std::left << std::setw(24) << name << std::setw(16) << stage_name << std::right << std::fixed << std::setprecision(4);
+                std::cout << std::setw(12) << baseline_seconds << " s -> " << std::setw(10) << current_seconds << " s";
+                if (baseline_seconds > 0.0) { std::cout << " (" << std::showpos << std::setprecision(1) << 100.0 * (current_seconds / baseline_seconds - 1.0) << "%)" << std::noshowpos; }
+                std::cout << (is_regressed ? "  REGRESSION" : "") << std::endl;
+
+                if (is_regressed) { regressions.push_back(Regression{ name, stage_name + ".seconds", baseline_seconds, current_seconds }); }
+            }
+
+            for (const std::string stage_name : { "unmixing", "refinement" })
+            {
+                const double baseline_iterations = baseline_case["solver"][stage_name]["mean_iterations"].number_value();
+                const double current_iterations  = case_json["solver"][stage_name]["mean_iterations"].number_value();
+
+                if (baseline_iterations > 0.0 && current_iterations > baseline_iterations * (1.0 + threshold))
+                {
+                    std::cout << "  " << std::left << std::setw(24) << name << std::setw(16) << stage_name << std::right << "mean iterations " << baseline_iterations << " -> " << current_iterations << "  REGRESSION" << std::endl;
+                    regressions.push_back(Regression{ name, stage_name + ".mean_iterations", baseline_iterations, current_iterations });
+                }
+            }
+        }
+
+        return regressions;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    cxxopts::Options options("unblending-pipeline-bench", " - End-to-end benchmark of the ``unblending'' pipeline on the example images.");
+
+    options.add_options()("d,examples-dir", "Path to the directory containing the examples", cxxopts::value<std::string>()->default_value("./examples"));
+    options.add_options()("i,images", "Comma-separated names of the examples", cxxopts::value<std::string>()->default_value("cezanne,electron,magic"));
+    options.add_options()("w,widths", "Comma-separated target widths (pixels)", cxxopts::value<std::string>()->default_value("40,80,160"));
+    options.add_options()("n,repetitions", "Number of repetitions of each case (the fastest run of each stage is reported)", cxxopts::value<int>()->default_value("1"));
+    options.add_options()("c,concurrency", "Target concurrency (default: hardware concurrency)", cxxopts::value<int>()->default_value("0"));
+    options.add_options()("o,outdir", "Path to the directory for the exported layers", cxxopts::value<std::string>()->default_value("./pipeline-bench-out"));
+    options.add_options()("j,json", "Path to the output JSON file", cxxopts::value<std::string>()->default_value("pipeline-benchmark.json"));
+    options.add_options()("b,baseline", "Path to a baseline JSON file (written by this program) to compare with", cxxopts::value<std::string>());
+    options.add_options()("t,threshold", "Relative slowdown regarded as a regression", cxxopts::value<double>()->default_value("0.1"));
+    options.add_options()("m,memory-budget", "Memory budget (MB) of the refinement (default: unlimited)", cxxopts::value<double>());
+    options.add_options()("p,perf-counters", "Measure hardware performance counters (cycles, instructions, LLC misses, and branch misses) of each stage and section (Linux only)");
+    options.add_options()("min-seconds", "Minimum absolute slowdown (seconds) regarded as a regression", cxxopts::value<double>()->default_value("0.005"));
+    options.add_options()("h,help", "Print help");
+
+    const auto parse_result = options.parse(argc, argv);
+
+    if (parse_result.count("help"))
+    {
+        std::cout << options.help() << std::endl;
+        exit(0);
+    }
+
+    const std::string examples_directory_path = parse_result["examples-dir"].as<std::string>();
+    const std::string output_directory_path   = parse_result["outdir"].as<std::string>();
+    const int         num_repetitions         = std::max(1, parse_result["repetitions"].as<int>());
+    const int         target_concurrency      = parse_result["concurrency"].as<int>();
+    const std::size_t memory_budget           = parse_result.count("memory-budget") ? static_cast<std::size_t>(parse_result["memory-budget"].as<double>() * 1024.0 * 1024.0) : 0;
+
+    std::vector<int> widths;
+    for (const std::string& width : split(parse_result["widths"].as<std::string>(), ',')) { widths.push_back(std::stoi(width)); }
+
+    if (std::system(("mkdir -p " + output_directory_path).c_str()) < 0) { exit(1); };
+
+    // Open the counters before any worker thread is created so that all the threads inherit them
+    const std::unique_ptr<PerfCounters> counters(parse_result.count("perf-counters") ? new PerfCounters() : nullptr);
+    if (counters != nullptr && !counters->is_available())
+    {
+        std::cerr << "Warning: hardware performance counters are not available (see perf_event_paranoid); they are not measured." << std::endl;
+    }
+
+    StageMeter meter((counters != nullptr && counters->is_available()) ? counters.get() : nullptr);
+
+    // The same setting as the CLI
+    constexpr bool has_opaque_background   = true;
+    constexpr bool force_smooth_background = true;
+
+    std::vector<Json> cases_json;
+    for (const std::string& image_name : split(parse_result["images"].as<std::string>(), ','))
+    {
+        const std::string image_file_path  = examples_directory_path + "/" + image_name + ".png";
+        const std::string layer_infos_path = examples_directory_path + "/" + image_name + ".json";
+
+        const std::vector<LayerInfo> layer_infos = import_layer_infos(layer_infos_path);
+        const std::vector<CompOp>    comp_ops    = extract_comp_ops(layer_infos);
+        const std::vector<BlendMode> modes       = extract_blend_modes(layer_infos);
+
+        for (const int width : widths)
+        {
+            const std::string case_name = image_name + "/" + std::to_string(width);
+
+            std::map<std::string, StageResult> best_results;
+            OptimizationStatistics unmixing_statistics;
+            OptimizationStatistics refinement_statistics;
+            int height = 0;
+
+            for (int repetition = 0; repetition < num_repetitions; ++ repetition)
+            {
+                std::map<std::string, StageResult> results;
+
+                std::shared_ptr<ColorImage> original_image;
+                results["decode"] = meter.measure([&]() { original_image = std::make_shared<ColorImage>(image_file_path); }, 0);
+                results["decode"].num_pixels = original_image->width() * original_image->height();
+
+                std::shared_ptr<ColorImage> image;
+                results["resize"] = meter.measure([&]() { image = std::make_shared<ColorImage>(original_image->get_scaled_image(width)); }, 0);
+
+                const int num_pixels = image->width() * image->height();
+                results["resize"].num_pixels = num_pixels;
+                height = image->height();
+
+                std::vector<ColorImage> layers;
+                results["unmixing"] = meter.measure([&]()
+                {
+                    layers = compute_color_unmixing(*image, layer_infos, has_opaque_background, target_concurrency, false, UnmixingModel::Blending, &unmixing_statistics);
+                }, num_pixels);
+
+                std::vector<ColorImage> refined_layers;
+                results["refinement"] = meter.measure([&]()
+                {
+                    refined_layers = perform_matte_refinement(*image, layers, layer_infos, has_opaque_background, force_smooth_background, target_concurrency, - 1.0, &refinement_statistics, UnmixingModel::Blending, memory_budget);
+                }, num_pixels);
+
+                results["recomposition"] = meter.measure([&]() { composite_layers(refined_layers, comp_ops, modes, target_concurrency); }, num_pixels);
+                results["export"]        = meter.measure([&]() { export_layers(refined_layers, output_directory_path, image_name + "-" + std::to_string(width), true); }, num_pixels);
+
+                for (const std::string& stage_name : stage_names)
+                {
+                    const bool is_first = repetition == 0;
+                    if (is_first || results[stage_name].seconds < best_results[stage_name].seconds) { best_results[stage_name] = results[stage_name]; }
+                }
+            }
+
+            double total_seconds = 0.0;
+            Json::object stages_json;
+            for (const std::string& stage_name : stage_names)
+            {
+                stages_json[stage_name] = best_results[stage_name].to_json();
+                total_seconds += best_results[stage_name].seconds;
+            }
+
+            std::cout << std::left << std::setw(24) << case_name << std::right << std::fixed << std::setprecision(4);
+            for (const std::string& stage_name : stage_names) { std::cout << "  " << stage_name << " " << best_results[stage_name].seconds; }
+            std::cout << "  (mean iterations: " << std::setprecision(2) << unmixing_statistics.get_mean_iterations() << ", " << refinement_statistics.get_mean_iterations() << ")" << std::endl;
+
+            cases_json.push_back(Json::object
+            {
+                { "name",          case_name },
+                { "image",         image_name },
+                { "width",         width },
+                { "height",        height },
+                { "num_layers",    static_cast<int>(layer_infos.size()) },
+                { "total_seconds", total_seconds },
+                { "stages",        stages_json },
+                { "solver",        Json::object { { "unmixing", to_json(unmixing_statistics) }, { "refinement", to_json(refinement_statistics) } } }
+            });
+        }
+    }
+
+    Json::object result_json
+    {
+        { "cases",                cases_json },
+        { "repetitions",          num_repetitions },
+        { "target_concurrency",   target_concurrency },
+        { "hardware_concurrency", static_cast<int>(std::thread::hardware_concurrency()) },
+        { "per_stage_peak_rss",   benchutil::reset_peak_rss() },
+        { "memory_budget_mb",     static_cast<double>(memory_budget) / (1024.0 * 1024.0) },
+        { "perf_counters",        counters != nullptr && counters->is_available() },
+        { "date",                 get_current_time_in_string() }
+    };
+
+    // Compare with the baseline
+    bool has_regression = false;
+    if (parse_result.count("baseline"))
+    {
+        std::ifstream baseline_file(parse_result["baseline"].as<std::string>());
+        const std::string baseline_text((std::istreambuf_iterator<char>(baseline_file)), std::istreambuf_iterator<char>());
+
+        std::string error;
+        const Json baseline_json = Json::parse(baseline_text, error);
+        if (!error.empty())
+        {
+            std::cerr << "Error: failed to parse the baseline (" << error << ")" << std::endl;
+            exit(1);
+        }
+
+        const auto regressions = compare_with_baseline(Json(result_json), baseline_json, parse_result["threshold"].as<double>(), parse_result["min-seconds"].as<double>());
+
+        std::vector<Json> regressions_json;
+        for (const Regression& regression : regressions) { regressions_json.push_back(regression.to_json()); }
+
+        result_json["baseline"]    = parse_result["baseline"].as<std::string>();
+        result_json["regressions"] = regressions_json;
+
+        has_regression = !regressions.empty();
+        std::cout << (has_regression ? std::to_string(regressions.size()) + " regression(s) found" : "No regressions found") << std::endl;
+    }
+
+    benchutil::write_json(Json(result_json), parse_result["json"].as<std::string>());
+
+    return has_regression ? 1 : 0;
+}
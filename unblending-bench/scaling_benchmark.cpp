@@ -0,0 +1,355 @@
+#include <map>
+#include <cmath>
+#include <string>
+#include <queue>
+#include <vector>
+#include <limits>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <unblending/unblending.hpp>
+#include <unblending/optimization.hpp>
+#include <unblending/instrumentation.hpp>
+#include <cxxopts.hpp>
+#include "bench_util.hpp"
+
+using namespace unblending;
+using json11::Json;
+
+namespace
+{
+    const std::vector<std::string> stage_names = { "unmixing", "refinement", "recomposition", "total" };
+
+    // Blend modes that are cycled through for the synthetic layer infos
+    const std::vector<BlendMode> mixed_modes = { BlendMode::Multiply, BlendMode::Screen, BlendMode::Overlay, BlendMode::SoftLight };
+
+    std::vector<int> parse_int_list(const std::string& text)
+    {
+        std::vector<int> values;
+        std::stringstream stream(text);
+        std::string item;
+        while (std::getline(stream, item, ',')) { if (!item.empty()) { values.push_back(std::stoi(item)); } }
+        return values;
+    }
+
+    // 1, 2, 4, ..., and the hardware concurrency
+    std::vector<int> get_default_concurrencies()
+    {
+        const int hardware_concurrency = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+
+        std::vector<int> concurrencies;
+        for (int concurrency = 1; concurrency < hardware_concurrency; concurrency *= 2) { concurrencies.push_back(concurrency); }
+        concurrencies.push_back(hardware_concurrency);
+        return concurrencies;
+    }
+
+    // Makespan of a loop whose items are statically split into contiguous blocks in the same way as
+    // parallelutil::parallel_for (and thus parallel_for_2d, which iterates over the pixels in the row-major order);
+    // this is for reference, since the solver stages schedule tiles dynamically
+    double calculate_static_partition_makespan(const std::vector<double>& costs, const int concurrency)
+    {
+        const int n         = static_cast<int>(costs.size());
+        const int n_threads = std::max(1, std::min(n, concurrency));
+
+        const int n_max_tasks_per_thread = (n / n_threads) + (n % n_threads == 0 ? 0 : 1);
+        const int n_lacking_tasks        = n_max_tasks_per_thread * n_threads - n;
+
+        double makespan = 0.0;
+        for (int thread_index = 0; thread_index < n_threads; ++ thread_index)
+        {
+            const int n_lacking_tasks_so_far = std::max(thread_index - n_threads + n_lacking_tasks, 0);
+            const int inclusive_start_index  = thread_index * n_max_tasks_per_thread - n_lacking_tasks_so_far;
+            const int exclusive_end_index    = inclusive_start_index + n_max_tasks_per_thread - (thread_index - n_threads + n_lacking_tasks >= 0 ? 1 : 0);
+
+            double sum = 0.0;
+            for (int k = inclusive_start_index; k < exclusive_end_index; ++ k) { sum += costs[k]; }
+            makespan = std::max(makespan, sum);
+        }
+        return makespan;
+    }
+
+    // Makespan of the tiled loop of the solver stages, where tiles are taken from a shared queue by the first
+    // idle thread (costs are given in the row-major order of the pixels)
+    double calculate_tile_queue_makespan(const std::vector<double>& costs, const int width, const int height, const int concurrency)
+    {
+        const int num_tiles_x = (width  + solver_tile_size - 1) / solver_tile_size;
+        const int num_tiles_y = (height + solver_tile_size - 1) / solver_tile_size;
+
+        // Finish times of the threads
+        std::priority_queue<double, std::vector<double>, std::greater<double>> finish_times;
+        for (int i = 0; i < std::max(1, std::min(concurrency, num_tiles_x * num_tiles_y)); ++ i) { finish_times.push(0.0); }
+
+        double makespan = 0.0;
+        for (int tile_index = 0; tile_index < num_tiles_x * num_tiles_y; ++ tile_index)
+        {
+            const int x_begin = (tile_index % num_tiles_x) * solver_tile_size;
+            const int y_begin = (tile_index / num_tiles_x) * solver_tile_size;
+
+            double cost = 0.0;
+            for (int y = y_begin; y < std::min(y_begin + solver_tile_size, height); ++ y)
+            {
+                for (int x = x_begin; x < std::min(x_begin + solver_tile_size, width); ++ x) { cost += costs[y * width + x]; }
+            }
+
+            const double finish_time = finish_times.top() + cost;
+            finish_times.pop();
+            finish_times.push(finish_time);
+            makespan = std::max(makespan, finish_time);
+        }
+        return makespan;
+    }
+
+    // Measure the cost of each pixel of the unmixing step by running the per-pixel optimization serially
+    std::vector<double> measure_unmixing_costs(const ColorImage& image, const std::vector<LayerInfo>& layer_infos, const bool has_opaque_background)
+    {
+        const auto models   = extract_color_models(layer_infos);
+        const auto comp_ops = extract_comp_ops(layer_infos);
+        const auto modes    = extract_blend_modes(layer_infos);
+
+        std::vector<double> costs;
+        for (int y = 0; y < image.height(); ++ y) for (int x = 0; x < image.width(); ++ x)
+        {
+            const auto start = benchutil::Clock::now();
+            solve_per_pixel_optimization(image.get_rgb(x, y), models, comp_ops, modes, false, has_opaque_background);
+            costs.push_back(benchutil::get_elapsed_seconds(start));
+        }
+        return costs;
+    }
+
+    struct Row
+    {
+        int         width;
+        int         height;
+        int         num_layers;
+        int         concurrency;
+        std::string stage;
+        double      seconds;
+        double      speedup;
+        double      efficiency;
+        double      serial_fraction;            // NaN if not applicable
+        double      amdahl_speedup;             // NaN if not applicable
+        double      static_partition_speedup;   // NaN if not applicable
+        double      tile_queue_speedup;         // NaN if not applicable
+        double      balanced_partition_speedup; // NaN if not applicable
+
+        std::map<std::string, double> sections;
+
+        double get_ns_per_pixel() const { return 1e+09 * seconds / (static_cast<double>(width) * static_cast<double>(height)); }
+    };
+
+    std::string to_csv_field(const double value)
+    {
+        if (std::isnan(value)) { return ""; }
+        std::ostringstream stream;
+        stream << std::setprecision(8) << value;
+        return stream.str();
+    }
+
+    Json to_json_field(const double value)
+    {
+        return std::isnan(value) ? Json(nullptr) : Json(value);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    cxxopts::Options options("unblending-scaling-bench", " - Thread-scaling and problem-size scaling of the ``unblending'' pipeline.");
+
+    options.add_options()("i,image", "Path to the input image", cxxopts::value<std::string>()->default_value("./examples/magic.png"));
+    options.add_options()("c,concurrencies", "Comma-separated target concurrencies (default: 1, 2, 4, ..., hardware concurrency)", cxxopts::value<std::string>());
+    options.add_options()("w,widths", "Comma-separated target widths (pixels)", cxxopts::value<std::string>()->default_value("32,64,128"));
+    options.add_options()("l,layers", "Comma-separated numbers of synthetic layers", cxxopts::value<std::string>()->default_value("2,4,6"));
+    options.add_options()("s,seed", "Seed of the synthetic layer infos", cxxopts::value<int>()->default_value("0"));
+    options.add_options()("no-partition-analysis", "Skip the serial per-pixel cost measurement used for analyzing the static partitioning");
+    options.add_options()("csv", "Path to the output CSV file", cxxopts::value<std::string>()->default_value("scaling-benchmark.csv"));
+    options.add_options()("j,json", "Path to the output JSON file", cxxopts::value<std::string>()->default_value("scaling-benchmark.json"));
+    options.add_options()("h,help", "Print help");
+
+    const auto parse_result = options.parse(argc, argv);
+
+    if (parse_result.count("help"))
+    {
+        std::cout << options.help() << std::endl;
+        exit(0);
+    }
+
+    std::vector<int> concurrencies = parse_result.count("concurrencies") ? parse_int_list(parse_result["concurrencies"].as<std::string>()) : get_default_concurrencies();
+    std::sort(concurrencies.begin(), concurrencies.end());
+
+    const std::vector<int> widths       = parse_int_list(parse_result["widths"].as<std::string>());
+    const std::vector<int> layer_counts = parse_int_list(parse_result["layers"].as<std::string>());
+    const bool             use_analysis = !parse_result.count("no-partition-analysis");
+    const unsigned         seed         = static_cast<unsigned>(parse_result["seed"].as<int>());
+
+    // The same setting as the CLI
+    constexpr bool has_opaque_background   = true;
+    constexpr bool force_smooth_background = true;
+
+    // Collect the sections of the stages
+    std::map<std::string, double> sections;
+    set_stage_observer([&](const std::string& name, double seconds) { sections[name] += seconds; });
+
+    const ColorImage original_image(parse_result["image"].as<std::string>());
+
+    std::vector<Row> rows;
+    for (const int width : widths)
+    {
+        const ColorImage image  = original_image.get_scaled_image(width);
+        const int        height = image.height();
+
+        for (const int num_layers : layer_counts)
+        {
+            const std::vector<LayerInfo> layer_infos = benchutil::generate_random_layer_infos(num_layers, mixed_modes, seed);
+            const std::vector<CompOp>    comp_ops    = extract_comp_ops(layer_infos);
+            const std::vector<BlendMode> modes       = extract_blend_modes(layer_infos);
+
+            const std::vector<double> unmixing_costs = use_analysis ? measure_unmixing_costs(image, layer_infos, has_opaque_background) : std::vector<double>();
+
+            std::map<std::string, double> base_seconds;
+            double base_serial_fraction = std::numeric_limits<double>::quiet_NaN();
+
+            for (const int concurrency : concurrencies)
+            {
+                sections.clear();
+
+                std::map<std::string, double> seconds;
+
+                auto start = benchutil::Clock::now();
+                const auto layers = compute_color_unmixing(image, layer_infos, has_opaque_background, concurrency);
+                seconds["unmixing"] = benchutil::get_elapsed_seconds(start);
+
+                start = benchutil::Clock::now();
+                const auto refined_layers = perform_matte_refinement(image, layers, layer_infos, has_opaque_background, force_smooth_background, concurrency);
+                seconds["refinement"] = benchutil::get_elapsed_seconds(start);
+
+                start = benchutil::Clock::now();
+                composite_layers(refined_layers, comp_ops, modes, concurrency);
+                seconds["recomposition"] = benchutil::get_elapsed_seconds(start);
+
+                seconds["total"] = seconds["unmixing"] + seconds["refinement"] + seconds["recomposition"];
+
+                // The serial part of the refinement is everything but its parallel loops (the per-pixel
+                // optimization and the box filters inside the guided filters); the rest of the guided filters
+                // (e.g., the per-pixel 3x3 inversions) runs on a single thread
+                const double refinement_parallel_seconds = sections["perform_matte_refinement/per_pixel_optimization"] + sections["apply_box_filter"];
+                const double refinement_serial_fraction  = std::max(0.0, seconds["refinement"] - refinement_parallel_seconds) / seconds["refinement"];
+
+                const bool is_base = concurrency == concurrencies.front();
+                if (is_base)
+                {
+                    base_seconds         = seconds;
+                    base_serial_fraction = refinement_serial_fraction;
+                }
+
+                // Relative concurrency with respect to the base (typically, single-thread) run
+                const double relative_concurrency = static_cast<double>(concurrency) / static_cast<double>(concurrencies.front());
+
+                for (const std::string& stage : stage_names)
+                {
+                    Row row;
+                    row.width                      = width;
+                    row.height                     = height;
+                    row.num_layers                 = num_layers;
+                    row.concurrency                = concurrency;
+                    row.stage                      = stage;
+                    row.seconds                    = seconds[stage];
+                    row.speedup                    = base_seconds[stage] / seconds[stage];
+                    row.efficiency                 = row.speedup / relative_concurrency;
+                    row.serial_fraction            = std::numeric_limits<double>::quiet_NaN();
+                    row.amdahl_speedup             = std::numeric_limits<double>::quiet_NaN();
+                    row.static_partition_speedup   = std::numeric_limits<double>::quiet_NaN();
+                    row.tile_queue_speedup         = std::numeric_limits<double>::quiet_NaN();
+                    row.balanced_partition_speedup = std::numeric_limits<double>::quiet_NaN();
+
+                    if (stage == "refinement")
+                    {
+                        row.serial_fraction = refinement_serial_fraction;
+                        row.amdahl_speedup  = 1.0 / (base_serial_fraction + (1.0 - base_serial_fraction) / relative_concurrency);
+                    }
+                    if (stage == "unmixing" && use_analysis)
+                    {
+                        // Speedups of the per-pixel loop predicted from the measured per-pixel costs
+                        double total_cost = 0.0;
+                        for (const double cost : unmixing_costs) { total_cost += cost; }
+
+                        const double balanced_makespan = total_cost / static_cast<double>(std::min(concurrency, width * height));
+
+                        row.static_partition_speedup   = total_cost / calculate_static_partition_makespan(unmixing_costs, concurrency);
+                        row.tile_queue_speedup         = total_cost / calculate_tile_queue_makespan(unmixing_costs, width, height, concurrency);
+                        row.balanced_partition_speedup = total_cost / balanced_makespan;
+                    }
+
+                    const std::string prefix = (stage == "unmixing") ? "compute_color_unmixing/" : (stage == "refinement") ? "perform_matte_refinement/" : "-";
+                    for (const auto& section : sections)
+                    {
+                        if (section.first.compare(0, prefix.size(), prefix) == 0) { row.sections[section.first.substr(prefix.size())] = section.second; }
+                    }
+                    if (stage == "refinement") { row.sections["box_filters"] = sections["apply_box_filter"]; }
+
+                    rows.push_back(row);
+                }
+
+                std::cout << std::setw(5) << width << "x" << std::left << std::setw(5) << height << std::right << std::setw(3) << num_layers << " layers, " << std::setw(3) << concurrency << " threads:";
+                std::cout << std::fixed << std::setprecision(3);
+                for (const std::string& stage : stage_names) { std::cout << "  " << stage << " " << seconds[stage] << " s (x" << std::setprecision(2) << base_seconds[stage] / seconds[stage] << ")" << std::setprecision(3); }
+                std::cout << std::endl;
+            }
+        }
+    }
+
+    set_stage_observer(nullptr);
+
+    // Export as CSV
+    {
+        std::ofstream csv_file(parse_result["csv"].as<std::string>());
+        csv_file << "width,height,num_layers,concurrency,stage,seconds,ns_per_pixel,speedup,efficiency,serial_fraction,amdahl_speedup,static_partition_speedup,tile_queue_speedup,balanced_partition_speedup" << std::endl;
+        for (const Row& row : rows)
+        {
+            csv_file << row.width << "," << row.height << "," << row.num_layers << "," << row.concurrency << "," << row.stage << ",";
+            csv_file << to_csv_field(row.seconds) << "," << to_csv_field(row.get_ns_per_pixel()) << "," << to_csv_field(row.speedup) << "," << to_csv_field(row.efficiency) << ",";
+            csv_file << to_csv_field(row.serial_fraction) << "," << to_csv_field(row.amdahl_speedup) << ",";
+            csv_file << to_csv_field(row.static_partition_speedup) << "," << to_csv_field(row.tile_queue_speedup) << "," << to_csv_field(row.balanced_partition_speedup) << std::endl;
+        }
+    }
+
+    // Export as JSON
+    {
+        std::vector<Json> rows_json;
+        for (const Row& row : rows)
+        {
+            Json::object sections_json;
+            for (const auto& section : row.sections) { sections_json[section.first] = section.second; }
+
+            rows_json.push_back(Json::object
+            {
+                { "width",                      row.width },
+                { "height",                     row.height },
+                { "num_layers",                 row.num_layers },
+                { "concurrency",                row.concurrency },
+                { "stage",                      row.stage },
+                { "seconds",                    row.seconds },
+                { "ns_per_pixel",               row.get_ns_per_pixel() },
+                { "speedup",                    row.speedup },
+                { "efficiency",                 row.efficiency },
+                { "serial_fraction",            to_json_field(row.serial_fraction) },
+                { "amdahl_speedup",             to_json_field(row.amdahl_speedup) },
+                { "static_partition_speedup",   to_json_field(row.static_partition_speedup) },
+                { "tile_queue_speedup",         to_json_field(row.tile_queue_speedup) },
+                { "balanced_partition_speedup", to_json_field(row.balanced_partition_speedup) },
+                { "sections",                   sections_json }
+            });
+        }
+
+        const Json json = Json::object
+        {
+            { "rows",                 rows_json },
+            { "hardware_concurrency", static_cast<int>(std::thread::hardware_concurrency()) },
+            { "date",                 get_current_time_in_string() }
+        };
+        benchutil::write_json(json, parse_result["json"].as<std::string>());
+    }
+
+    return 0;
+}
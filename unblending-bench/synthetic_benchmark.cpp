@@ -0,0 +1,168 @@
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <iostream>
+#include <iomanip>
+#include <unblending/unblending.hpp>
+#include <unblending/synthetic_data.hpp>
+#include <unblending/reconstruction_report.hpp>
+#include <cxxopts.hpp>
+#include "bench_util.hpp"
+
+using namespace unblending;
+using json11::Json;
+
+namespace
+{
+    Json to_json(const LayerRecoveryError& error)
+    {
+        return Json::object
+        {
+            { "alpha_rmse",        error.alpha_rmse },
+            { "color_rmse",        error.color_rmse },
+            { "layer_alpha_rmses", error.layer_alpha_rmses },
+            { "layer_color_rmses", error.layer_color_rmses }
+        };
+    }
+}
+
+int main(int argc, char** argv)
+{
+    cxxopts::Options options("unblending-synthetic-bench", " - Generates synthetic images with ground-truth layers and measures the layer-recovery error of the ``unblending'' pipeline.");
+
+    options.add_options()("W,width", "Width (pixels) of the synthetic images", cxxopts::value<int>()->default_value("64"));
+    options.add_options()("H,height", "Height (pixels) of the synthetic images", cxxopts::value<int>()->default_value("64"));
+    options.add_options()("n,num-samples", "Number of synthetic images", cxxopts::value<int>()->default_value("3"));
+    options.add_options()("s,seed", "Seed of the first synthetic image (the i-th image uses seed + i)", cxxopts::value<int>()->default_value("0"));
+    options.add_options()("g,generate", "Only generate the dataset (input images, ground-truth layers, and layer infos) into this directory", cxxopts::value<std::string>());
+    options.add_options()("c,concurrency", "Target concurrency (default: hardware concurrency)", cxxopts::value<int>()->default_value("0"));
+    options.add_options()("l,linear", "Use the linear additive model with a specialized fast solver");
+    options.add_options()("active-set", "Solve each pixel with the closest layers first and add layers only when necessary");
+    options.add_options()("skip-tolerance", "Skip the refinement optimization for pixels whose alphas change by at most this value (default: disabled)", cxxopts::value<double>());
+    options.add_options()("j,json", "Path to the output JSON file", cxxopts::value<std::string>()->default_value("synthetic-benchmark.json"));
+    options.add_options()("h,help", "Print help");
+    options.add_options()("layer-infos-path", "Path to the layer infos (json)", cxxopts::value<std::string>());
+
+    options.parse_positional({ "layer-infos-path" });
+    options.positional_help("<layer-infos-path>");
+    options.show_positional_help();
+
+    const auto parse_result = options.parse(argc, argv);
+
+    if (parse_result.count("layer-infos-path") != 1 || parse_result.count("help"))
+    {
+        std::cout << options.help() << std::endl;
+        exit(0);
+    }
+
+    const int    width              = parse_result["width"].as<int>();
+    const int    height             = parse_result["height"].as<int>();
+    const int    num_samples        = parse_result["num-samples"].as<int>();
+    const int    seed               = parse_result["seed"].as<int>();
+    const int    target_concurrency = parse_result["concurrency"].as<int>();
+    const bool   use_active_set     = parse_result.count("active-set");
+    const auto   model              = parse_result.count("linear") ? UnmixingModel::Linear : UnmixingModel::Blending;
+    const double skip_tolerance     = parse_result.count("skip-tolerance") ? parse_result["skip-tolerance"].as<double>() : - 1.0;
+
+    const std::vector<LayerInfo> layer_infos = import_layer_infos(parse_result["layer-infos-path"].as<std::string>());
+
+    // The same setting as the CLI
+    constexpr bool has_opaque_background   = true;
+    constexpr bool force_smooth_background = true;
+
+    // Generation mode
+    if (parse_result.count("generate"))
+    {
+        const std::string output_directory_path = parse_result["generate"].as<std::string>();
+        if (std::system(("mkdir -p " + output_directory_path).c_str()) < 0) { exit(1); };
+
+        for (int sample = 0; sample < num_samples; ++ sample)
+        {
+            const SyntheticData data   = generate_synthetic_data(layer_infos, width, height, seed + sample, has_opaque_background);
+            const std::string   prefix = "sample-" + std::to_string(seed + sample);
+
+            data.image.save(output_directory_path + "/" + prefix + ".png");
+            export_layers(data.layers, output_directory_path, prefix + "-layer", true);
+        }
+        export_layer_infos(layer_infos, output_directory_path);
+
+        return 0;
+    }
+
+    // Benchmark mode
+    const bool is_linear = model == UnmixingModel::Linear;
+    const auto modes     = is_linear ? std::vector<BlendMode>(layer_infos.size(), BlendMode::LinearDodge) : extract_blend_modes(layer_infos);
+    const auto comp_ops  = is_linear ? std::vector<CompOp>(layer_infos.size(), CompOp::Plus()) : extract_comp_ops(layer_infos);
+
+    // The ground truth has to follow the model that is solved
+    std::vector<LayerInfo> ground_truth_layer_infos;
+    for (int index = 0; index < layer_infos.size(); ++ index)
+    {
+        ground_truth_layer_infos.push_back(LayerInfo{ comp_ops[index], modes[index], layer_infos[index].color_model });
+    }
+
+    std::vector<Json> samples_json;
+    double unmixing_seconds_sum   = 0.0;
+    double refinement_seconds_sum = 0.0;
+    double alpha_rmse_sum         = 0.0;
+    double color_rmse_sum         = 0.0;
+
+    for (int sample = 0; sample < num_samples; ++ sample)
+    {
+        const SyntheticData data = generate_synthetic_data(ground_truth_layer_infos, width, height, seed + sample, has_opaque_background && !is_linear);
+
+        auto start = benchutil::Clock::now();
+        const auto layers = compute_color_unmixing(data.image, layer_infos, has_opaque_background, target_concurrency, use_active_set, model);
+        const double unmixing_seconds = benchutil::get_elapsed_seconds(start);
+
+        start = benchutil::Clock::now();
+        const auto refined_layers = perform_matte_refinement(data.image, layers, layer_infos, has_opaque_background, force_smooth_background, target_concurrency, skip_tolerance, nullptr, model);
+        const double refinement_seconds = benchutil::get_elapsed_seconds(start);
+
+        const LayerRecoveryError   unmixing_error   = compute_layer_recovery_error(layers, data.layers);
+        const LayerRecoveryError   refinement_error = compute_layer_recovery_error(refined_layers, data.layers);
+        const ReconstructionReport report           = compute_reconstruction_report(data.image, refined_layers, comp_ops, modes, nullptr, target_concurrency);
+
+        std::cout << "sample " << seed + sample << std::fixed << std::setprecision(4);
+        std::cout << ": unmixing " << unmixing_seconds << " s (alpha RMSE " << unmixing_error.alpha_rmse << ", color RMSE " << unmixing_error.color_rmse << ")";
+        std::cout << ", refinement " << refinement_seconds << " s (alpha RMSE " << refinement_error.alpha_rmse << ", color RMSE " << refinement_error.color_rmse << ")";
+        std::cout << ", reconstruction RMSE " << report.rmse << std::endl;
+
+        samples_json.push_back(Json::object
+        {
+            { "seed",                seed + sample },
+            { "unmixing_seconds",    unmixing_seconds },
+            { "refinement_seconds",  refinement_seconds },
+            { "unmixing_error",      to_json(unmixing_error) },
+            { "refinement_error",    to_json(refinement_error) },
+            { "reconstruction_rmse", report.rmse }
+        });
+
+        unmixing_seconds_sum   += unmixing_seconds;
+        refinement_seconds_sum += refinement_seconds;
+        alpha_rmse_sum         += refinement_error.alpha_rmse;
+        color_rmse_sum         += refinement_error.color_rmse;
+    }
+
+    const double n = static_cast<double>(std::max(num_samples, 1));
+
+    std::cout << "mean: unmixing " << unmixing_seconds_sum / n << " s, refinement " << refinement_seconds_sum / n << " s, alpha RMSE " << alpha_rmse_sum / n << ", color RMSE " << color_rmse_sum / n << std::endl;
+
+    const Json json = Json::object
+    {
+        { "samples",                 samples_json },
+        { "width",                   width },
+        { "height",                  height },
+        { "linear",                  is_linear },
+        { "active_set",              use_active_set },
+        { "skip_tolerance",          skip_tolerance },
+        { "mean_unmixing_seconds",   unmixing_seconds_sum / n },
+        { "mean_refinement_seconds", refinement_seconds_sum / n },
+        { "mean_alpha_rmse",         alpha_rmse_sum / n },
+        { "mean_color_rmse",         color_rmse_sum / n },
+        { "date",                    get_current_time_in_string() }
+    };
+    benchutil::write_json(json, parse_result["json"].as<std::string>());
+
+    return 0;
+}
@@ -2,10 +2,24 @@
 #include <sstream>
 #include <fstream>
 #include <iomanip>
+#include <memory>
+#include <map>
+#include <set>
+#include <algorithm>
+#include <functional>
 #include <cstdlib>
 #include <iostream>
 #include <unblending/unblending.hpp>
 #include <unblending/equations.hpp>
+#include <unblending/reconstruction_report.hpp>
+#include <unblending/tracing.hpp>
+#include <unblending/instrumentation.hpp>
+#include <unblending/streaming.hpp>
+#include <unblending/layer_file.hpp>
+#include <unblending/openraster.hpp>
+#include <unblending/task_graph.hpp>
+#include <unblending/batch.hpp>
+#include <unblending/job_server.hpp>
 #include <cxxopts.hpp>
 
 using namespace unblending;
@@ -16,9 +30,26 @@ int main(int argc, char** argv)
     
     options.add_options()("o,outdir", "Path to the output directory", cxxopts::value<std::string>()->default_value("./out"));
     options.add_options()("w,width", "Target width (pixels) of the output image (default: original resolution)", cxxopts::value<int>());
+    options.add_options()("resampling-filter", "Filter for resizing the input to the target width: lanczos, bicubic, area (computed in double precision), or decoder (the smooth scaling of the image decoder in 8-bit)", cxxopts::value<std::string>()->default_value("lanczos"));
     options.add_options()("h,help", "Print help");
     options.add_options()("e,explicit-mode-names", "Append blend mode names to output image file names");
     options.add_options()("v,verbose-export", "Export intermediate files as well as final outcomes");
+    options.add_options()("l,linear", "Use the linear additive model with a specialized fast solver (blend modes and comp ops are ignored)");
+    options.add_options()("active-set", "Solve each pixel with the closest layers first and add layers only when necessary");
+    options.add_options()("skip-tolerance", "Skip the refinement optimization for pixels whose alphas change by at most this value (default: disabled)", cxxopts::value<double>());
+    options.add_options()("r,report", "Export a reconstruction-quality report of the final layers (and an error heatmap with -v)");
+    options.add_options()("outputs", "Comma-separated outputs to export (default: layers): layers, alphas, non-smoothed-layers, non-smoothed-composite, input, composite, report, error-heatmap, models; -v and -r add theirs, and only the stages needed by the outputs are computed", cxxopts::value<std::string>());
+    options.add_options()("layer-file", "Write the final layers into a single float32 layer file (layer.ulf), which is mapped in place, instead of PNG files");
+    options.add_options()("openraster", "Write all the output images (including those of --verbose-export) and the layer infos into a single OpenRaster file (layers.ora) instead of separate files");
+    options.add_options()("crop", "Crop each exported layer to the bounding box of its visible pixels; the offsets are written into layer_regions.json (or into the OpenRaster file)");
+    options.add_options()("png-compression", "Compression level (0-9) of the exported PNG files; a lower level is faster but gives larger files (default: the default of the encoder)", cxxopts::value<int>());
+    options.add_options()("memory-budget", "Memory budget (MB) of the refinement; the image is processed in bands if it does not fit (default: unlimited)", cxxopts::value<double>());
+    options.add_options()("band-height", "Decompose the image band by band with this number of rows, reading the input and writing the layers (as 16-bit PAM files) incrementally; the memory usage does not depend on the image height", cxxopts::value<int>());
+    options.add_options()("memory-report", "Report the peak memory usage of the image buffers of each stage and section");
+    options.add_options()("batch", "Path to a batch manifest (json) listing images with their layer infos and output settings, which are processed in this single process (the positional arguments are not needed)", cxxopts::value<std::string>());
+    options.add_options()("batch-concurrency", "Number of images processed at the same time in the batch mode (default: the hardware concurrency)", cxxopts::value<int>());
+    options.add_options()("serve", "Run as a job server that accepts jobs (in the format of the images of a batch manifest) as lines of JSON over a Unix domain socket at this path until it receives {\"command\": \"shutdown\"}", cxxopts::value<std::string>());
+    options.add_options()("trace", "Export a trace of the stages and tiles in the Chrome trace format (requires a build with UNBLENDING_WITH_TRACING)", cxxopts::value<std::string>());
     options.add_options()("input-image-path", "Path to the input image (png or jpg)", cxxopts::value<std::string>());
     options.add_options()("layer-infos-path", "Path to the layer infos (json)", cxxopts::value<std::string>());
     
@@ -28,69 +59,402 @@ int main(int argc, char** argv)
     
     const auto parse_result = options.parse(argc, argv);
     
-    if (parse_result.count("input-image-path") != 1 ||
-        parse_result.count("layer-infos-path") != 1 ||
+    if ((!parse_result.count("batch") && !parse_result.count("serve") && (parse_result.count("input-image-path") != 1 || parse_result.count("layer-infos-path") != 1)) ||
         parse_result.count("help"))
     {
         std::cout << options.help() << std::endl;
         exit(0);
     }
     
-    const std::string image_file_path       = parse_result["input-image-path"].as<std::string>();
-    const std::string layer_infos_path      = parse_result["layer-infos-path"].as<std::string>();
+    const std::string image_file_path       = parse_result.count("input-image-path") ? parse_result["input-image-path"].as<std::string>() : "";
+    const std::string layer_infos_path      = parse_result.count("layer-infos-path") ? parse_result["layer-infos-path"].as<std::string>() : "";
     const std::string output_directory_path = parse_result["outdir"].as<std::string>();
     const bool        use_explicit_name     = parse_result.count("explicit-mode-names");
     const bool        export_verbosely      = parse_result.count("verbose-export");
+    const bool        export_report         = parse_result.count("report");
+    const bool        use_active_set        = parse_result.count("active-set");
+    const auto        model                 = parse_result.count("linear") ? UnmixingModel::Linear : UnmixingModel::Blending;
+    const double      skip_tolerance        = parse_result.count("skip-tolerance") ? parse_result["skip-tolerance"].as<double>() : - 1.0;
+    const std::size_t memory_budget         = parse_result.count("memory-budget") ? static_cast<std::size_t>(parse_result["memory-budget"].as<double>() * 1024.0 * 1024.0) : 0;
+    const bool        report_memory         = parse_result.count("memory-report");
+    const int         png_compression_level = parse_result.count("png-compression") ? parse_result["png-compression"].as<int>() : - 1;
+    const bool        use_layer_file        = parse_result.count("layer-file");
+    const bool        use_openraster        = parse_result.count("openraster");
+    const bool        crop_layers           = parse_result.count("crop");
     
     if (std::system(("mkdir -p " + output_directory_path).c_str()) < 0) { exit(1); };
     
-    // Import the target image and resize it if a target width is specified
-    const ColorImage original_image = [&]()
+    const bool use_tracing = parse_result.count("trace");
+    if (use_tracing && !tracing::is_available())
     {
-        const ColorImage image(image_file_path);
-        const bool use_target_width = (parse_result["width"].count() == 1);
-        return use_target_width ? image.get_scaled_image(parse_result["width"].as<int>()) : image;
-    }();
+        std::cerr << "Warning: tracing is not available in this build." << std::endl;
+    }
+    if (use_tracing) { tracing::start_tracing(); }
     
-    // Prepare layer infos
-    std::vector<LayerInfo> layer_infos = import_layer_infos(layer_infos_path);
+    // Report the peak memory usage of each section and stage
+    auto to_megabytes = [](std::size_t bytes) { return static_cast<double>(bytes) / (1024.0 * 1024.0); };
+    auto report_stage_memory = [&](const std::string& stage_name)
+    {
+        if (!report_memory) { return; }
+        std::cout << stage_name << ": peak image memory " << to_megabytes(get_peak_image_memory_usage()) << " MB" << std::endl;
+        reset_peak_image_memory_usage();
+    };
+    if (report_memory)
+    {
+        set_stage_memory_observer([&](const std::string& name, std::size_t peak_bytes)
+        {
+            // The box filters are scoped only for their timing and are too fine-grained to report
+            if (name == "apply_box_filter") { return; }
+            std::cout << name << ": peak image memory " << to_megabytes(peak_bytes) << " MB" << std::endl;
+        });
+    }
     
     // TODO: Allow users to specify these variables
     constexpr bool has_opaque_background   = true;
     constexpr bool force_smooth_background = true;
     
+    // Process the images of a batch manifest, sharing the thread pool and the per-layer-infos caches among them
+    if (parse_result.count("batch"))
+    {
+        std::vector<BatchJob> jobs;
+        try
+        {
+            jobs = import_batch_manifest(parse_result["batch"].as<std::string>());
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return 1;
+        }
+        
+        const int num_concurrent_images = parse_result.count("batch-concurrency") ? parse_result["batch-concurrency"].as<int>() : 0;
+        process_batch(jobs, has_opaque_background, force_smooth_background, num_concurrent_images, 0, use_active_set, skip_tolerance, model);
+        
+        if (use_tracing)
+        {
+            tracing::stop_tracing();
+            tracing::export_trace(parse_result["trace"].as<std::string>());
+        }
+        
+        return 0;
+    }
+    
+    // Serve jobs until a shutdown request comes, keeping the thread pool and the caches warm between the jobs
+    if (parse_result.count("serve"))
+    {
+        BatchProcessor processor(has_opaque_background, force_smooth_background, 0, use_active_set, skip_tolerance, model);
+        try
+        {
+            JobServer server(parse_result["serve"].as<std::string>(), processor);
+            server.run();
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return 1;
+        }
+        
+        if (use_tracing)
+        {
+            tracing::stop_tracing();
+            tracing::export_trace(parse_result["trace"].as<std::string>());
+        }
+        
+        return 0;
+    }
+    
+    // Decompose the image band by band without holding the whole image and layers in memory
+    if (parse_result.count("band-height"))
+    {
+        if (parse_result.count("width") || export_verbosely || export_report || parse_result.count("outputs") || parse_result.count("skip-tolerance") || parse_result.count("memory-budget") || crop_layers || use_openraster)
+        {
+            std::cerr << "Warning: --width, --verbose-export, --report, --outputs, --skip-tolerance, --memory-budget, --crop, and --openraster are not supported with --band-height; they are ignored." << std::endl;
+        }
+        
+        if (!ImageBandReader::is_streamable(image_file_path))
+        {
+            std::cout << "decompose_in_bands: " << image_file_path << " is not a binary PPM/PAM file; the whole image is decoded in 8-bit" << std::endl;
+        }
+        
+        try
+        {
+            const std::vector<LayerInfo> layer_infos = import_layer_infos(layer_infos_path);
+            decompose_in_bands(image_file_path, layer_infos, output_directory_path, "layer", parse_result["band-height"].as<int>(), has_opaque_background, force_smooth_background, 0, use_active_set, model, use_layer_file);
+            export_layer_infos(layer_infos, output_directory_path);
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return 1;
+        }
+        
+        if (use_tracing)
+        {
+            tracing::stop_tracing();
+            tracing::export_trace(parse_result["trace"].as<std::string>());
+        }
+        
+        return 0;
+    }
+    
+    // Check the resampling filter before any stage starts
+    const std::string resampling_filter_name = parse_result["resampling-filter"].as<std::string>();
+    const std::map<std::string, ResamplingFilter> resampling_filters = { { "lanczos", ResamplingFilter::Lanczos3 }, { "bicubic", ResamplingFilter::Bicubic }, { "area", ResamplingFilter::Area } };
+    if (resampling_filter_name != "decoder" && resampling_filters.count(resampling_filter_name) == 0)
+    {
+        std::cerr << "Error: unknown resampling filter: " << resampling_filter_name << std::endl;
+        exit(1);
+    }
+    
+    // Collect the requested outputs (only the final layers by default); each stage is run only if some requested output needs it
+    const std::vector<std::string> output_names = { "layers", "alphas", "non-smoothed-layers", "non-smoothed-composite", "input", "composite", "report", "error-heatmap", "models" };
+    std::set<std::string> requested_outputs;
+    if (parse_result.count("outputs"))
+    {
+        std::istringstream output_stream(parse_result["outputs"].as<std::string>());
+        for (std::string output_name; std::getline(output_stream, output_name, ',');)
+        {
+            if (std::find(output_names.begin(), output_names.end(), output_name) == output_names.end())
+            {
+                std::cerr << "Error: unknown output: " << output_name << std::endl;
+                exit(1);
+            }
+            requested_outputs.insert(output_name);
+        }
+    }
+    else
+    {
+        requested_outputs.insert("layers");
+    }
+    if (export_verbosely) { requested_outputs.insert({ "layers", "alphas", "non-smoothed-layers", "non-smoothed-composite", "input", "composite", "models" }); }
+    if (export_report) { requested_outputs.insert("report"); }
+    if (export_report && export_verbosely) { requested_outputs.insert("error-heatmap"); }
+    if (requested_outputs.count("error-heatmap")) { requested_outputs.insert("report"); }
+    if (requested_outputs.count("alphas")) { requested_outputs.insert("layers"); }
+    
+    auto is_requested = [&](const std::string& output_name) { return requested_outputs.count(output_name) != 0; };
+    
+    // Prepare layer infos
+    std::vector<LayerInfo> layer_infos;
+    try
+    {
+        layer_infos = import_layer_infos(layer_infos_path);
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+    
+    // The linear model is equivalent to compositing by "plus" with "LinearDodge"
+    const bool is_linear = model == UnmixingModel::Linear;
+    const auto modes     = is_linear ? std::vector<BlendMode>(layer_infos.size(), BlendMode::LinearDodge) : extract_blend_modes(layer_infos);
+    const auto comp_ops  = is_linear ? std::vector<CompOp>(layer_infos.size(), CompOp::Plus()) : extract_comp_ops(layer_infos);
+    
+    // Intermediate results, which are released as soon as all the tasks that use them finish
+    ColorImage                        original_image(0, 0);
+    std::vector<ColorImage>           layers;
+    std::vector<ColorImage>           refined_layers;
+    ColorImage                        recomposited_image(0, 0);
+    Image                             error_heatmap(0, 0);
+    std::unique_ptr<OpenRasterWriter> openraster_writer;
+    
+    TaskGraph graph;
+    
+    // Import the target image (resampled to the target width if specified)
+    const int decode_task = graph.add_task("decode", [&](int target_concurrency)
+    {
+        if (!parse_result.count("width")) { original_image = ColorImage(image_file_path, 0, target_concurrency); }
+        else if (resampling_filter_name == "decoder") { original_image = ColorImage(image_file_path, parse_result["width"].as<int>(), target_concurrency); }
+        else { original_image = ColorImage(image_file_path, 0, target_concurrency).get_scaled_image(parse_result["width"].as<int>(), resampling_filters.at(resampling_filter_name), target_concurrency); }
+        report_stage_memory("decode");
+    }, {}, [&]() { original_image = ColorImage(0, 0); });
+    
     // Compute color unmixing to obtain an initial result
-    const std::vector<ColorImage> layers = compute_color_unmixing(original_image, layer_infos, has_opaque_background);
+    const int unmixing_task = graph.add_task("unmixing", [&](int target_concurrency)
+    {
+        layers = compute_color_unmixing(original_image, layer_infos, has_opaque_background, target_concurrency, use_active_set, model);
+        report_stage_memory("unmixing");
+    }, { decode_task }, [&]() { std::vector<ColorImage>().swap(layers); });
     
     // Perform post processing steps
-    const std::vector<ColorImage> refined_layers = perform_matte_refinement(original_image, layers, layer_infos, has_opaque_background, force_smooth_background);
+    const int refinement_task = graph.add_task("refinement", [&](int target_concurrency)
+    {
+        OptimizationStatistics statistics;
+        refined_layers = perform_matte_refinement(original_image, layers, layer_infos, has_opaque_background, force_smooth_background, target_concurrency, skip_tolerance, &statistics, model, memory_budget);
+        report_stage_memory("refinement");
+        
+        if (statistics.is_budget_exceeded)
+        {
+            std::cerr << "perform_matte_refinement: the memory budget is too small; the smallest bands are used" << std::endl;
+        }
+        if (statistics.num_bands > 1)
+        {
+            std::cout << "perform_matte_refinement: processed " << statistics.num_bands << " bands of " << statistics.band_height << " rows" << std::endl;
+        }
+        if (skip_tolerance >= 0.0)
+        {
+            std::cout << "perform_matte_refinement: skipped " << statistics.num_skipped_pixels << " of " << statistics.num_pixels << " pixels (" << 100.0 * statistics.get_skip_ratio() << "%)" << std::endl;
+        }
+    }, { decode_task, unmixing_task }, [&]() { std::vector<ColorImage>().swap(refined_layers); });
     
-    // Export layers
-    if (export_verbosely) { export_layers(layers, output_directory_path, "non-smoothed-layer", true, use_explicit_name, layer_infos); }
-    export_layers(refined_layers, output_directory_path, "layer", export_verbosely, use_explicit_name, layer_infos);
+    // Compute the composited image of the final layers (which is always included in an OpenRaster file as its merged image)
+    const int recomposition_task = graph.add_task("recomposition", [&](int target_concurrency)
+    {
+        recomposited_image = composite_layers(refined_layers, comp_ops, modes, target_concurrency);
+    }, { refinement_task }, [&]() { recomposited_image = ColorImage(0, 0); });
     
-    // Export the original image
-    if (export_verbosely) { original_image.save(output_directory_path + "/input.png"); }
+    // Tasks that add images to the OpenRaster file are chained so that the order of its stack is deterministic
+    int last_openraster_task = - 1;
+    auto add_output_task = [&](const std::string& name, const std::function<void(int)>& process, std::vector<int> dependencies)
+    {
+        if (use_openraster) { dependencies.push_back(last_openraster_task); }
+        const int task = graph.add_task(name, process, dependencies);
+        if (use_openraster) { last_openraster_task = task; }
+        graph.request(task);
+        return task;
+    };
     
-    // Export the composited image
-    const auto modes    = extract_blend_modes(layer_infos);
-    const auto comp_ops = extract_comp_ops(layer_infos);
+    // Images are encoded as soon as they are added to the OpenRaster file, which is written at the end
+    if (use_openraster)
+    {
+        last_openraster_task = graph.add_task("open-openraster", [&](int)
+        {
+            openraster_writer.reset(new OpenRasterWriter(output_directory_path + "/layers.ora", original_image.width(), original_image.height(), png_compression_level));
+        }, { decode_task });
+    }
     
-    const ColorImage composited_image = composite_layers(layers, comp_ops, modes);
-    if (export_verbosely) { composited_image.save(output_directory_path + "/non-smoothed-recomposited.png"); }
+    // Export the non-smoothed layers and their composited image
+    if (is_requested("non-smoothed-composite"))
+    {
+        add_output_task("export-non-smoothed-composite", [&](int target_concurrency)
+        {
+            if (use_openraster) { openraster_writer->add_image("non-smoothed-recomposited", composite_layers(layers, comp_ops, modes, target_concurrency)); }
+            else { composite_layers(layers, comp_ops, modes, target_concurrency).save(output_directory_path + "/non-smoothed-recomposited.png", png_compression_level, target_concurrency); }
+        }, { unmixing_task });
+    }
+    if (is_requested("non-smoothed-layers"))
+    {
+        add_output_task("export-non-smoothed-layers", [&](int target_concurrency)
+        {
+            if (use_openraster) { openraster_writer->add_layers(layers, "non-smoothed-layer", modes, false, true, crop_layers); }
+            else { export_layers(layers, output_directory_path, "non-smoothed-layer", true, use_explicit_name, layer_infos, png_compression_level, target_concurrency, crop_layers); }
+        }, { unmixing_task });
+    }
+    
+    // Export the original image (below the final layers in an OpenRaster file)
+    if (is_requested("input"))
+    {
+        add_output_task("export-input", [&](int target_concurrency)
+        {
+            if (use_openraster) { openraster_writer->add_image("input", original_image); }
+            else { original_image.save(output_directory_path + "/input.png", png_compression_level, target_concurrency); }
+        }, { decode_task });
+    }
     
-    const ColorImage refined_composited_image = composite_layers(refined_layers, comp_ops, modes);
-    if (export_verbosely) { refined_composited_image.save(output_directory_path + "/recomposited.png"); }
+    // Export layers (with their alpha channels if requested)
+    if (is_requested("layers"))
+    {
+        add_output_task("export-layers", [&](int target_concurrency)
+        {
+            if (use_layer_file)
+            {
+                LayerFileWriter writer(output_directory_path + "/layer.ulf", refined_layers.front().width(), refined_layers.front().height(), layer_infos);
+                writer.write_layers(refined_layers, target_concurrency);
+            }
+            else if (use_openraster)
+            {
+                openraster_writer->add_layers(refined_layers, "layer", modes, true, is_requested("alphas"), crop_layers);
+            }
+            else
+            {
+                export_layers(refined_layers, output_directory_path, "layer", is_requested("alphas"), use_explicit_name, layer_infos, png_compression_level, target_concurrency, crop_layers);
+            }
+        }, { refinement_task });
+    }
+    
+    // Export the composited image
+    if (is_requested("composite") && !use_openraster)
+    {
+        add_output_task("export-composite", [&](int target_concurrency)
+        {
+            recomposited_image.save(output_directory_path + "/recomposited.png", png_compression_level, target_concurrency);
+        }, { recomposition_task });
+    }
+    
+    // Export the reconstruction-quality report (the heatmap is filled only if it is requested)
+    const int report_task = graph.add_task("report", [&](int target_concurrency)
+    {
+        if (is_requested("error-heatmap")) { error_heatmap = Image(refined_layers.front().width(), refined_layers.front().height()); }
+        const ReconstructionReport report = compute_reconstruction_report(original_image, refined_layers, comp_ops, modes, is_requested("error-heatmap") ? &error_heatmap : nullptr, target_concurrency);
+        export_reconstruction_report(report, output_directory_path + "/report.json");
+    }, { decode_task, refinement_task }, [&]() { error_heatmap = Image(0, 0); });
+    if (is_requested("report")) { graph.request(report_task); }
+    if (is_requested("error-heatmap"))
+    {
+        add_output_task("export-error-heatmap", [&](int target_concurrency)
+        {
+            if (use_openraster) { openraster_writer->add_image("error-heatmap", error_heatmap); }
+            else { error_heatmap.save(output_directory_path + "/error-heatmap.png", png_compression_level, target_concurrency); }
+        }, { report_task });
+    }
     
     // Export visualizations of color models
-    if (export_verbosely)
+    if (is_requested("models"))
+    {
+        add_output_task("export-models", [&](int)
+        {
+            const std::vector<ColorModelPtr> models = extract_color_models(layer_infos);
+            if (use_openraster)
+            {
+                for (int index = 0; index < models.size(); ++ index)
+                {
+                    const std::vector<std::uint8_t> data = models[index]->generate_visualization().encode_as_png(png_compression_level);
+                    openraster_writer->add_file("models/model_" + std::to_string(index) + ".png", std::string(data.begin(), data.end()));
+                }
+            }
+            else
+            {
+                export_models(models, output_directory_path, "model");
+            }
+        }, {});
+    }
+    
+    // Export layer infos (and write the OpenRaster file with the merged image)
+    add_output_task("export-layer-infos", [&](int)
+    {
+        if (use_openraster)
+        {
+            openraster_writer->set_merged_image(recomposited_image);
+            openraster_writer->add_file("layer_infos.json", serialize_layer_infos(layer_infos));
+            openraster_writer->close();
+        }
+        else
+        {
+            export_layer_infos(layer_infos, output_directory_path);
+        }
+    }, use_openraster ? std::vector<int>{ recomposition_task } : std::vector<int>{});
+    
+    // Run the required stages; independent stages (e.g., exporting the non-smoothed layers and the refinement) run
+    // concurrently, except when the peak memory of each stage is reported (the peak is tracked globally); a failed
+    // stage (e.g., an undecodable input image) stops the others
+    try
     {
-        const std::vector<ColorModelPtr> models = extract_color_models(layer_infos);
-        export_models(models, output_directory_path, "model");
+        graph.run(0, report_memory ? 1 : 0);
     }
+    catch (const std::exception& e)
+    {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+    report_stage_memory("export");
     
-    // Export layer infos
-    export_layer_infos(layer_infos, output_directory_path);
+    // Export the trace
+    if (use_tracing)
+    {
+        tracing::stop_tracing();
+        tracing::export_trace(parse_result["trace"].as<std::string>());
+    }
     
     return 0;
 }
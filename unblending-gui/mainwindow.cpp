@@ -3,6 +3,7 @@
 #include <iostream>
 #include <QFileDialog>
 #include <QLabel>
+#include <QMessageBox>
 #include <QPushButton>
 #include <QProgressDialog>
 #include <QFutureWatcher>
@@ -154,7 +155,17 @@ void MainWindow::on_actionImport_triggered()
 void MainWindow::on_actionExport_triggered()
 {
     const std::string output_dir_path = QFileDialog::getExistingDirectory(this).toStdString();
-    core.export_files(output_dir_path);
+    if (output_dir_path.empty()) { return; }
+
+    // Exceptions should not leave a slot, so a failed export (e.g., an unwritable directory) is shown here
+    try
+    {
+        core.export_files(output_dir_path);
+    }
+    catch (const std::exception& e)
+    {
+        QMessageBox::critical(this, "Export", QString::fromStdString(e.what()));
+    }
 }
 
 void MainWindow::on_actionCapture_triggered()
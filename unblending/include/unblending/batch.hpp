@@ -0,0 +1,132 @@
+#ifndef BATCH_HPP
+#define BATCH_HPP
+
+#include <map>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <unblending/unblending.hpp>
+#include <unblending/worker_pool.hpp>
+
+namespace unblending
+{
+    /// \brief Job of the batch mode, which decomposes a single image.
+    struct BatchJob
+    {
+        std::string input_image_path;
+        std::string layer_infos_path;
+        std::string layer_infos_json; ///< Layer infos given as a JSON text, which is used instead of the file if not empty.
+        std::string output_directory_path;
+
+        int  target_width          = 0;     ///< If positive, the image is resized (by the Lanczos filter) to this width.
+        bool export_verbosely      = false; ///< Export the intermediate files as well (as in the verbose mode of the CLI).
+        bool export_report         = false; ///< Export the reconstruction-quality report (and the error heatmap if verbose).
+        bool use_explicit_name     = false; ///< Append the blend mode names to the file names of the layers.
+        bool crop_layers           = false; ///< Crop the layers to the bounding boxes of their visible pixels.
+        bool use_layer_file        = false; ///< Write the final layers into a single layer file "layer.ulf" (see LayerFileWriter) instead of PNG files.
+        int  png_compression_level = - 1;
+    };
+
+    /// \brief Import the jobs of a batch manifest (json).
+    /// \details The manifest is an object with an array "images", each of which specifies "input" and optionally
+    /// "layer_infos" (a path or the layer infos themselves), "outdir", "width", "verbose", "report",
+    /// "explicit_mode_names", "crop", "layer_file", and "png_compression". The same keys at the top level give the
+    /// defaults shared by all the images. If "outdir" is not specified for an image, its layers are exported into
+    /// "<outdir>/<input file name without extension>". Relative paths are relative to the directory of the manifest.
+    /// std::runtime_error is thrown if the manifest cannot be read or parsed, or if an image lacks a required key.
+    std::vector<BatchJob> import_batch_manifest(const std::string& manifest_file_path);
+
+    /// \brief Parse a single job given as a JSON object with the same keys as the images of a batch manifest.
+    /// \details Relative paths are relative to the current directory, and "outdir" is required.
+    /// \param error The reason if the text is not a valid job (otherwise, it is cleared).
+    BatchJob parse_batch_job(const std::string& json_text, std::string& error);
+
+    /// \brief Processor of batch jobs that keeps its resources between jobs.
+    /// \details The layer infos of each distinct file (or text) are parsed once, and an unmixer (see RowUnmixer)
+    /// with a solution cache is created for each of them, so colors that appear in many images are solved once.
+    /// All the unmixers share a single persistent pool, which parallelizes the unmixing of each image over its
+    /// pixels. Only the most recently used max_num_layer_specs layer infos are kept (with their caches), and a file
+    /// is parsed again when its modification time changes, so a long-running processor does not grow without
+    /// bound nor use stale layer infos.
+    class BatchProcessor
+    {
+    public:
+        /// \param target_concurrency The number of threads of the pool. If zero, the hardware concurrency is used.
+        /// \param skip_tolerance See perform_matte_refinement.
+        BatchProcessor(const bool          has_opaque_background,
+                       const bool          force_smooth_background,
+                       const int           target_concurrency = 0,
+                       const bool          use_active_set     = false,
+                       const double        skip_tolerance     = - 1.0,
+                       const UnmixingModel model              = UnmixingModel::Blending);
+        ~BatchProcessor();
+
+        BatchProcessor(const BatchProcessor&)            = delete;
+        BatchProcessor& operator=(const BatchProcessor&) = delete;
+
+        /// \brief The number of layer infos (and their unmixers) that are kept.
+        static constexpr int max_num_layer_specs = 8;
+
+        /// \brief Process a single job on the calling thread. This can be called from multiple threads at the same time.
+        /// \details The output directory is created (with its parents) if it does not exist. std::runtime_error is
+        /// thrown if the image cannot be decoded, the layer infos are invalid, or the files cannot be written.
+        /// \return The paths of the files of the final layers (or the path of the layer file).
+        std::vector<std::string> process(const BatchJob& job);
+
+        /// \brief Process jobs concurrently.
+        /// \details The images are processed concurrently so that the other stages of small images also keep all the
+        /// cores busy. They are pipelined through three stages connected by bounded queues: decoding (in the order
+        /// of the jobs), solving (the unmixing, the refinement, and the report), and encoding and writing the files,
+        /// so the I/O of an image overlaps the solving of the others. A job that fails is reported to the standard
+        /// error and skipped.
+        /// \param num_concurrent_images The number of images solved (and encoded) at the same time. If zero, the
+        /// number of threads (or the number of jobs if smaller) is used. The other stages of each image use the
+        /// number of threads divided by this number.
+        /// \param queue_capacity The number of images that can wait between two stages, which bounds the memory usage
+        /// (together with the images in the stages).
+        void process(const std::vector<BatchJob>& jobs, int num_concurrent_images = 0, int queue_capacity = 2);
+
+    private:
+        struct LayerSpec;
+        struct SolvedImage;
+
+        struct CachedLayerSpec
+        {
+            std::shared_ptr<const LayerSpec> layer_spec;
+            std::int64_t                     modification_time = 0; ///< In nanoseconds (for files).
+            std::uint64_t                    last_use          = 0;
+        };
+
+        bool          has_opaque_background_;
+        bool          force_smooth_background_;
+        bool          use_active_set_;
+        double        skip_tolerance_;
+        UnmixingModel model_;
+
+        std::shared_ptr<WorkerPool> pool_;
+
+        std::mutex                             layer_specs_mutex_;
+        std::map<std::string, CachedLayerSpec> layer_specs_;
+        std::uint64_t                          num_layer_spec_uses_ = 0;
+
+        std::shared_ptr<const LayerSpec> retrieve_layer_spec(const BatchJob& job);
+        ColorImage                       decode_image(const BatchJob& job, int target_concurrency) const;
+        SolvedImage                      solve_image(ColorImage&& image, const BatchJob& job, const std::shared_ptr<const LayerSpec>& layer_spec, int target_concurrency) const;
+        std::vector<std::string>         encode_image(SolvedImage& solved_image, const BatchJob& job, int target_concurrency) const;
+    };
+
+    /// \brief Process the jobs of a batch in a single process (see BatchProcessor).
+    void process_batch(const std::vector<BatchJob>& jobs,
+                       const bool                   has_opaque_background,
+                       const bool                   force_smooth_background,
+                       const int                    num_concurrent_images = 0,
+                       const int                    target_concurrency    = 0,
+                       const bool                   use_active_set        = false,
+                       const double                 skip_tolerance        = - 1.0,
+                       const UnmixingModel          model                 = UnmixingModel::Blending,
+                       const int                    queue_capacity        = 2);
+}
+
+#endif // BATCH_HPP
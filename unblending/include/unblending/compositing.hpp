@@ -0,0 +1,47 @@
+#ifndef COMPOSITING_HPP
+#define COMPOSITING_HPP
+
+#include <unblending/common.hpp>
+#include <unblending/blend_mode.hpp>
+#include <unblending/comp_op.hpp>
+#include <unblending/image_processing.hpp>
+
+namespace unblending
+{
+    /// \brief The maximum number of pixels that are processed by a single call of composite_layer_spans.
+    constexpr int max_span_length = 256;
+
+    /// \brief Pointers to a horizontal span of the r, g, b, and a channels of a layer.
+    /// \details A span whose pointers are null is treated as fully transparent.
+    struct LayerSpan
+    {
+        const double* r;
+        const double* g;
+        const double* b;
+        const double* a;
+    };
+
+    inline LayerSpan make_layer_span(const ColorImage& layer, int x, int y)
+    {
+        const int offset = y * layer.width() + x;
+        return LayerSpan{ layer.get_r().data() + offset, layer.get_g().data() + offset, layer.get_b().data() + offset, layer.get_a().data() + offset };
+    }
+
+    /// \brief Calculate the recursive composition (Equation 7) for a horizontal span of pixels.
+    /// \details This is a vectorized version of the per-pixel composite_layers (without cropping). Blend
+    /// functions and Porter-Duff operations are specialized at compile time, and a layer whose alpha values
+    /// are zero over the whole span is skipped.
+    /// \param spans The spans of the layers. The front corresponds to the bottom layer.
+    /// \param length The number of pixels in the span. This should be in [1, max_span_length].
+    /// \param r, g, b, a Output arrays, each of which has at least "length" elements.
+    void composite_layer_spans(const LayerSpan*              spans,
+                               const std::vector<CompOp>&    comp_ops,
+                               const std::vector<BlendMode>& modes,
+                               const int                     length,
+                               double*                       r,
+                               double*                       g,
+                               double*                       b,
+                               double*                       a);
+}
+
+#endif // COMPOSITING_HPP
@@ -3,10 +3,26 @@
 
 #include <vector>
 #include <string>
+#include <cstdint>
 #include <Eigen/Core>
+#include <unblending/tracing.hpp>
+#include <unblending/instrumentation.hpp>
+
+class QImage;
 
 namespace unblending
 {
+    /// \brief Axis-aligned rectangular region of an image in pixels.
+    struct ImageRegion
+    {
+        int x      = 0;
+        int y      = 0;
+        int width  = 0;
+        int height = 0;
+
+        bool is_empty() const { return width <= 0 || height <= 0; }
+    };
+
     class AbstractImage
     {
     public:
@@ -14,7 +30,16 @@ namespace unblending
 
         using IntColor = Eigen::Vector4i;
 
-        void save(const std::string& file_path) const;
+        /// \brief Save the image as a file (the format is determined by the extension).
+        /// \details Pixels are converted into ARGB32 scanlines in bulk (and in parallel) before encoding.
+        /// std::runtime_error is thrown if the file cannot be written.
+        /// \param png_compression_level The zlib compression level (0: fastest and largest, 9: slowest and
+        /// smallest) of PNG files. If negative, the default of the encoder is used.
+        /// \param target_concurrency Target concurrency of the conversion. If zero, the hardware concurrency is used.
+        void save(const std::string& file_path, int png_compression_level = -1, int target_concurrency = 0) const;
+
+        /// \brief Encode the image as a PNG file in memory (see save for the parameters).
+        std::vector<std::uint8_t> encode_as_png(int png_compression_level = -1, int target_concurrency = 0) const;
 
         int width()  const { return width_;  }
         int height() const { return height_; }
@@ -23,7 +48,11 @@ namespace unblending
         int width_;
         int height_;
 
-        virtual IntColor get_color(int x, int y) const = 0;
+        /// \brief Convert the y-th row into ARGB32 pixels (i.e., 0xAARRGGBB).
+        virtual void convert_row_to_argb32(int y, std::uint32_t* pixels) const = 0;
+
+    private:
+        QImage convert_to_q_image(int target_concurrency) const;
     };
 
     /// \brief Image class for handling a single-channel image.
@@ -32,7 +61,7 @@ namespace unblending
     public:
         Image(int width, int height, double value = 0.0) : AbstractImage(width, height)
         {
-            pixels_ = std::vector<double>(width_ * height_, value);
+            pixels_.assign(width_ * height_, value);
         }
 
         void set_pixel(int x, int y, double value)
@@ -47,10 +76,20 @@ namespace unblending
             return pixels_[y * width() + x];
         }
 
+        /// \brief Get the pointer to the pixel values, which are stored in the row-major order.
+        double* data() { return pixels_.data(); }
+        const double* data() const { return pixels_.data(); }
+
         void force_unity();
         void scale_to_unit();
         void fill(const double value);
 
+        /// \brief Get the rows in [y_begin, y_end) as a new image.
+        Image get_rows(int y_begin, int y_end) const;
+
+        /// \brief Get the pixels in the (non-empty) region as a new image.
+        Image get_region(const ImageRegion& region) const;
+
         Image operator+(const Image& image) const
         {
             assert(width() == image.width());
@@ -88,9 +127,17 @@ namespace unblending
         }
 
     private:
-        IntColor get_color(int x, int y) const override;
+        void convert_row_to_argb32(int y, std::uint32_t* pixels) const override;
 
-        std::vector<double> pixels_;
+        std::vector<double, ImageBufferAllocator<double>> pixels_;
+    };
+
+    /// \brief Filter of the resampling functions.
+    enum class ResamplingFilter
+    {
+        Area,     ///< Average over the area that an output pixel covers (no ringing; blurry for upsampling).
+        Bicubic,  ///< Cubic convolution (Keys, a = -0.5).
+        Lanczos3, ///< Windowed sinc with three lobes (sharpest; may ring at edges, so values are cropped into [0, 1]).
     };
 
     /// \brief Image class for handling a 4-channel (RGBA) image.
@@ -102,7 +149,18 @@ namespace unblending
             rgba_ = std::vector<Image>(4, Image(width, height, 1.0));
         }
 
-        ColorImage(const std::string& file_path);
+        /// \brief Decode an image file.
+        /// \details Scanlines of the decoded image are converted into the channels in bulk and in parallel.
+        /// std::runtime_error is thrown if the file cannot be decoded.
+        /// \param target_width If positive, the image is decoded (and scaled with smoothing) to this width while
+        /// keeping the aspect ratio, which is cheaper than decoding at full size and calling get_scaled_image;
+        /// some formats (e.g., JPEG) are scaled by the decoder itself.
+        /// \param target_concurrency Target concurrency of the conversion. If zero, the hardware concurrency is used.
+        ColorImage(const std::string& file_path, int target_width = 0, int target_concurrency = 0);
+
+        /// \brief Convert the pixels of a decoded image.
+        /// \param target_concurrency Target concurrency of the conversion. If zero, the hardware concurrency is used.
+        ColorImage(const QImage& q_image, int target_concurrency = 0);
 
         void set_rgb(int x, int y, const Eigen::Vector3d& rgb)
         {
@@ -164,10 +222,17 @@ namespace unblending
         void set_b(const Image& b) { rgba_[2] = b; }
         void set_a(const Image& a) { rgba_[3] = a; }
 
-        ColorImage get_scaled_image(int target_width) const;
+        /// \brief Resample the image to the target width while keeping the aspect ratio (see resample_image).
+        ColorImage get_scaled_image(int target_width, ResamplingFilter filter = ResamplingFilter::Lanczos3, int target_concurrency = 0) const;
+
+        /// \brief Get the rows in [y_begin, y_end) as a new image.
+        ColorImage get_rows(int y_begin, int y_end) const;
+
+        /// \brief Get the pixels in the (non-empty) region as a new image.
+        ColorImage get_region(const ImageRegion& region) const;
 
     private:
-        IntColor get_color(int x, int y) const override;
+        void convert_row_to_argb32(int y, std::uint32_t* pixels) const override;
 
         std::vector<Image> rgba_;
     };
@@ -189,11 +254,48 @@ namespace unblending
 
     Image calculate_gradient_magnitude(const Image& image);
 
+    /// \brief Calculate the bounding box of the pixels whose alphas are at least the threshold.
+    /// \details Rows are scanned in parallel. The returned region is empty if there is no such pixel.
+    /// \param target_concurrency Target concurrency of multi-threading. If zero, the hardware concurrency is used.
+    ImageRegion calculate_alpha_bounding_box(const ColorImage& image,
+                                             double            threshold,
+                                             int               target_concurrency = 0);
+
     /// \brief Calculate the result of applying the guided image filter to an image.
+    /// \param target_concurrency Target concurrency of the box filters. If zero, the hardware concurrency is used.
     Image apply_guided_filter(const Image& input_image,
                               const ColorImage& guidance_image,
                               int radius,
-                              double epsilon);
+                              double epsilon,
+                              int target_concurrency = 0);
+
+    /// \brief Resample a single-channel image by a separable filter in double precision.
+    /// \details The horizontal pass and then the vertical pass are performed with precomputed weights, each
+    /// parallelized over rows; the vertical pass is a weighted sum of whole rows, which is vectorized. When
+    /// downsampling, the filter is stretched to cover the input pixels (i.e., it acts as an anti-aliasing filter).
+    /// Values are not cropped.
+    Image resample_image(const Image&     image,
+                         int              target_width,
+                         int              target_height,
+                         ResamplingFilter filter             = ResamplingFilter::Lanczos3,
+                         int              target_concurrency = 0);
+
+    /// \brief Resample a color image by a separable filter in double precision.
+    /// \details The colors are filtered premultiplied by the alpha so that transparent pixels do not bleed
+    /// into their neighbors, and all the channels are cropped into [0, 1].
+    ColorImage resample_image(const ColorImage& image,
+                              int               target_width,
+                              int               target_height,
+                              ResamplingFilter  filter             = ResamplingFilter::Lanczos3,
+                              int               target_concurrency = 0);
+
+    /// \brief Build an image pyramid whose levels are halved (rounded up) in each dimension.
+    /// \details The front is the input image itself, and each level is resampled from the previous one.
+    /// Building stops when the number of levels is reached or the image becomes a single pixel.
+    std::vector<ColorImage> build_image_pyramid(const ColorImage& image,
+                                                int               num_levels,
+                                                ResamplingFilter  filter             = ResamplingFilter::Area,
+                                                int               target_concurrency = 0);
 
     inline Image apply_sobel_filter_x(const Image& image)
     {
@@ -209,13 +311,15 @@ namespace unblending
         return apply_convolution(image, kernel);
     }
 
-    inline Image apply_box_filter(const Image& image, int radius)
+    inline Image apply_box_filter(const Image& image, int radius, int target_concurrency = 0)
     {
+        UNBLENDING_TRACE_SCOPE("apply_box_filter", "filter");
+        StageScope scope("apply_box_filter");
         assert(radius >= 0);
         if (radius == 0) return image;
         const int size = 2 * radius + 1;
         const Eigen::MatrixXd kernel = Eigen::MatrixXd::Constant(size, size, 1.0 / static_cast<double>(size * size));
-        return apply_convolution(image, kernel);
+        return apply_convolution(image, kernel, target_concurrency);
     }
 
     inline Image calculate_difference(const ColorImage& left_image, const ColorImage& right_image)
@@ -0,0 +1,99 @@
+#ifndef INSTRUMENTATION_HPP
+#define INSTRUMENTATION_HPP
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <cstddef>
+#include <functional>
+
+namespace unblending
+{
+    /// \brief Callback that receives the wall time (in seconds) of a named section of a stage.
+    /// \details Section names are qualified by the stage name (e.g., "perform_matte_refinement/guided_filter").
+    /// The callback is invoked from the thread that runs the stage, not from the worker threads.
+    using StageObserver = std::function<void(const std::string& name, double seconds)>;
+
+    /// \brief Callback that is invoked when a named section begins (e.g., to take a snapshot of counters).
+    using StageBeginObserver = std::function<void(const std::string& name)>;
+
+    /// \brief Callback that receives the peak number of bytes of the image buffers (see get_image_memory_usage)
+    /// that were alive during a named section.
+    using StageMemoryObserver = std::function<void(const std::string& name, std::size_t peak_bytes)>;
+
+    /// \brief Set the global stage observer. Passing nullptr disables the observation.
+    /// \details This should not be called while a stage is running.
+    void set_stage_observer(const StageObserver& observer);
+
+    /// \brief Set the global observer of the beginnings of sections. Passing nullptr disables it.
+    /// \details This should not be called while a stage is running.
+    void set_stage_begin_observer(const StageBeginObserver& observer);
+
+    /// \brief Set the global observer of the peak memory usages of sections. Passing nullptr disables it.
+    /// \details This should not be called while a stage is running.
+    void set_stage_memory_observer(const StageMemoryObserver& observer);
+
+    /// \brief Get the number of bytes of the pixel buffers of all the images (Image and ColorImage) that are
+    /// currently alive.
+    /// \details Image buffers dominate the memory usage of a decomposition; the other allocations (e.g., of the
+    /// per-pixel solvers) are not counted.
+    std::size_t get_image_memory_usage();
+
+    /// \brief Get the peak of get_image_memory_usage since the program started or the last reset.
+    std::size_t get_peak_image_memory_usage();
+
+    /// \brief Reset the peak to the current usage (e.g., to measure the peak of the next stage).
+    void reset_peak_image_memory_usage();
+
+    namespace internal
+    {
+        void record_image_allocation(std::size_t bytes);
+        void record_image_deallocation(std::size_t bytes);
+    }
+
+    /// \brief Allocator of the pixel buffers of images, which keeps track of the image memory usage.
+    template <typename T>
+    struct ImageBufferAllocator
+    {
+        using value_type = T;
+
+        ImageBufferAllocator() = default;
+        template <typename U> ImageBufferAllocator(const ImageBufferAllocator<U>&) {}
+
+        T* allocate(std::size_t n)
+        {
+            T* pointer = std::allocator<T>().allocate(n);
+            internal::record_image_allocation(n * sizeof(T));
+            return pointer;
+        }
+
+        void deallocate(T* pointer, std::size_t n)
+        {
+            internal::record_image_deallocation(n * sizeof(T));
+            std::allocator<T>().deallocate(pointer, n);
+        }
+
+        template <typename U> bool operator==(const ImageBufferAllocator<U>&) const { return true;  }
+        template <typename U> bool operator!=(const ImageBufferAllocator<U>&) const { return false; }
+    };
+
+    /// \brief Scope that reports its wall time to the stage observer (if set) and its peak image memory usage to
+    /// the stage memory observer (if set) when it is destroyed.
+    /// \details Scopes can be nested; the peak of an outer scope includes those of the inner ones.
+    class StageScope
+    {
+    public:
+        StageScope(const char* name);
+        ~StageScope();
+
+    private:
+        const char* name_;
+        bool        is_observed_;
+
+        std::size_t outer_peak_bytes_ = 0;
+
+        std::chrono::steady_clock::time_point start_;
+    };
+}
+
+#endif // INSTRUMENTATION_HPP
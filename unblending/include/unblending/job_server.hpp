@@ -0,0 +1,66 @@
+#ifndef JOB_SERVER_HPP
+#define JOB_SERVER_HPP
+
+#include <set>
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include <condition_variable>
+#include <unblending/batch.hpp>
+
+namespace unblending
+{
+    /// \brief Long-running server that accepts decomposition jobs over a Unix domain socket.
+    /// \details The protocol is line-delimited JSON. Each request is a single line that holds a job object with the
+    /// keys of parse_batch_job, where "layer_infos" can be either a path or the layer infos themselves, and an
+    /// optional "id". For each request, a single line is returned in the order of the requests of the connection:
+    /// {"id": ..., "status": "ok", "outdir": ..., "files": [...]} with the paths of the final layers (or of the
+    /// layer file "layer.ulf" with "layer_file": true, which clients can map into their memory; see
+    /// LayerFileReader), or {"id": ..., "status": "error", "message": ...}. The request {"command": "shutdown"}
+    /// stops the server.
+    ///
+    /// Connections are served concurrently by their own threads. All the jobs are processed by the same
+    /// BatchProcessor, so the thread pool, the parsed layer infos, and the solution caches stay warm between
+    /// requests.
+    class JobServer
+    {
+    public:
+        /// \details std::runtime_error is thrown if the socket cannot be created, bound, or listened on.
+        /// \param socket_path The path of the socket file, which is replaced if it is an existing socket (any other
+        /// file at the path is an error). The socket is accessible only by its owner.
+        JobServer(const std::string& socket_path, BatchProcessor& processor);
+        ~JobServer();
+
+        JobServer(const JobServer&)            = delete;
+        JobServer& operator=(const JobServer&) = delete;
+
+        /// \brief Accept connections until the server is stopped.
+        /// \details std::runtime_error is thrown (after the jobs in progress are completed) if accepting a connection
+        /// fails for a reason other than an interruption or an aborted connection.
+        void run();
+
+        /// \brief Stop accepting connections and close the current ones (the jobs in progress are completed).
+        void stop();
+
+    private:
+        std::string     socket_path_;
+        BatchProcessor& processor_;
+
+        int               listening_socket_ = - 1;
+        std::atomic<bool> is_stopped_{false};
+
+        // Connection threads are detached and counted, so a long-running server does not accumulate finished threads
+        std::mutex              connections_mutex_;
+        std::condition_variable connections_condition_;
+        std::set<int>           connection_sockets_;
+
+        void wait_for_connections();
+
+        void serve_connection(int connection_socket);
+        std::string process_request(const std::string& request_line);
+    };
+}
+
+#endif // JOB_SERVER_HPP
@@ -0,0 +1,124 @@
+#ifndef LAYER_FILE_HPP
+#define LAYER_FILE_HPP
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <unblending/unblending.hpp>
+
+namespace unblending
+{
+    /// \brief Memory layout of the pixels of each layer in a layer file.
+    enum class LayerFileLayout : std::uint32_t
+    {
+        Planar      = 0, ///< Four planes (R, G, B, and A) per layer, each of which has width * height values.
+        Interleaved = 1, ///< Interleaved RGBA values per layer (the layout of the outputs of RowUnmixer).
+    };
+
+    /// \brief Header of a layer file.
+    /// \details A layer file (".ulf") consists of this header, the layer infos as a JSON text (see
+    /// serialize_layer_infos), padding up to data_offset (a multiple of 64 bytes), and the float32 pixels of the
+    /// layers in order. Each layer has width * height * 4 values in [0, 1] (not cropped), laid out according to
+    /// the layout. All the values are stored in the byte order of the host.
+    struct LayerFileHeader
+    {
+        char          magic[8];
+        std::uint32_t version;
+        std::uint32_t layout;
+        std::uint32_t width;
+        std::uint32_t height;
+        std::uint32_t num_layers;
+        std::uint32_t reserved;
+        std::uint64_t json_size;
+        std::uint64_t data_offset;
+    };
+
+    /// \brief Writer of a layer file via a memory-mapped file.
+    /// \details The whole file is created (with its final size) and mapped in the constructor, so the layers can
+    /// be written in place in any order as they become available, for example, by write_rows for each finished
+    /// band or by RowUnmixer writing to get_layer_data directly. Different rows or layers can be written from
+    /// different threads at the same time. The file is complete when the writer is destroyed. std::runtime_error
+    /// is thrown if the file cannot be created, allocated, or mapped (and the partial file is removed).
+    class LayerFileWriter
+    {
+    public:
+        LayerFileWriter(const std::string&            file_path,
+                        int                           width,
+                        int                           height,
+                        const std::vector<LayerInfo>& layer_infos,
+                        LayerFileLayout               layout = LayerFileLayout::Interleaved);
+        ~LayerFileWriter();
+
+        LayerFileWriter(const LayerFileWriter&)            = delete;
+        LayerFileWriter& operator=(const LayerFileWriter&) = delete;
+
+        int width()  const { return width_;  }
+        int height() const { return height_; }
+        int get_num_layers() const { return num_layers_; }
+        LayerFileLayout get_layout() const { return layout_; }
+
+        /// \brief Get the pointer to the mapped pixels of the layer.
+        float* get_layer_data(int layer_index);
+
+        /// \brief Write rows of a layer starting at the y_begin-th row.
+        /// \param target_concurrency Target concurrency of the conversion. If zero, the hardware concurrency is used.
+        void write_rows(int layer_index, int y_begin, const ColorImage& rows, int target_concurrency = 0);
+
+        /// \brief Write all the layers.
+        void write_layers(const std::vector<ColorImage>& layers, int target_concurrency = 0);
+
+    private:
+        int             width_;
+        int             height_;
+        int             num_layers_;
+        LayerFileLayout layout_;
+
+        int           file_descriptor_ = - 1;
+        std::size_t   file_size_       = 0;
+        std::uint8_t* mapped_data_     = nullptr;
+        float*        layer_data_      = nullptr;
+    };
+
+    /// \brief Reader of a layer file via a memory-mapped file.
+    /// \details The file is mapped read-only, and the pixels are accessed in place without being copied.
+    /// std::runtime_error is thrown if the file cannot be opened or mapped, or if its header is invalid (the magic,
+    /// the version, the layout, the offsets, or a size that does not fit into the file).
+    class LayerFileReader
+    {
+    public:
+        LayerFileReader(const std::string& file_path);
+        ~LayerFileReader();
+
+        LayerFileReader(const LayerFileReader&)            = delete;
+        LayerFileReader& operator=(const LayerFileReader&) = delete;
+
+        int width()  const { return width_;  }
+        int height() const { return height_; }
+        int get_num_layers() const { return num_layers_; }
+        LayerFileLayout get_layout() const { return layout_; }
+
+        /// \brief Get the layer infos stored in the file.
+        std::vector<LayerInfo> get_layer_infos() const;
+
+        /// \brief Get the pointer to the mapped pixels of the layer (valid while the reader is alive).
+        const float* get_layer_data(int layer_index) const;
+
+        /// \brief Copy a layer into a new color image.
+        ColorImage get_layer(int layer_index, int target_concurrency = 0) const;
+
+    private:
+        int             width_      = 0;
+        int             height_     = 0;
+        int             num_layers_ = 0;
+        LayerFileLayout layout_     = LayerFileLayout::Interleaved;
+        std::string     json_text_;
+
+        int                 file_descriptor_ = - 1;
+        std::size_t         file_size_       = 0;
+        const std::uint8_t* mapped_data_     = nullptr;
+        const float*        layer_data_      = nullptr;
+    };
+}
+
+#endif // LAYER_FILE_HPP
@@ -0,0 +1,49 @@
+#ifndef LINEAR_UNMIXING_HPP
+#define LINEAR_UNMIXING_HPP
+
+#include <unblending/common.hpp>
+#include <unblending/blend_mode.hpp>
+#include <unblending/comp_op.hpp>
+#include <unblending/optimization.hpp>
+
+namespace unblending
+{
+    /// \brief Model of how the layers form the target color in the unmixing problem.
+    enum class UnmixingModel
+    {
+        Blending, ///< Recursive composition with blend modes and Porter-Duff operations (Equation 7).
+        Linear,   ///< Alpha-weighted sum of the layer colors with alphas summing up to one; blend modes and composition operations are ignored.
+    };
+
+    /// \brief Solver specialized for the linear model with Gaussian color models.
+    /// \details For fixed alphas, the optimal colors are given in a closed form:
+    /// \f[
+    ///     \mathbf{c}_i = \boldsymbol{\mu}_i + \boldsymbol{\Sigma}_i \mathbf{M}^{-1} \mathbf{r}, \quad
+    ///     \mathbf{M} = \sum_j \alpha_j \boldsymbol{\Sigma}_j, \quad
+    ///     \mathbf{r} = \mathbf{c}_{\mathrm{target}} - \sum_j \alpha_j \boldsymbol{\mu}_j,
+    /// \f]
+    /// and the remaining energy \f$ \mathbf{r}^{\mathrm{T}} \mathbf{M}^{-1} \mathbf{r} \f$ is convex in the
+    /// alphas. It is minimized on the simplex by projected gradient descent, so neither the augmented
+    /// Lagrangian iterations nor the recursive Jacobian are necessary. Colors are cropped into [0, 1] at the end.
+    class LinearUnmixingSolver
+    {
+    public:
+        LinearUnmixingSolver(const std::vector<ColorModelPtr>& models);
+
+        /// \param counts If not null, the projected gradient iterations and the energy evaluations are added to this.
+        /// \return The solution in the same layout as the blending solver, i.e., the alphas followed by the colors.
+        VecX solve(const Vec3& target_color, PerPixelOptimizationCounts* counts = nullptr) const;
+
+        /// \brief Solve only the colors with the fixed alphas (used in the refinement step).
+        VecX solve_with_fixed_alphas(const Vec3& target_color, const VecX& alphas, PerPixelOptimizationCounts* counts = nullptr) const;
+
+    private:
+        double calculate_energy(const Vec3& target_color, const VecX& alphas, Vec3& y) const;
+        VecX   compose_solution(const VecX& alphas, const Vec3& y) const;
+
+        std::vector<Vec3> mus_;
+        std::vector<Mat3> sigmas_;
+    };
+}
+
+#endif // LINEAR_UNMIXING_HPP
@@ -0,0 +1,96 @@
+#ifndef OPENRASTER_HPP
+#define OPENRASTER_HPP
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <unblending/unblending.hpp>
+
+namespace unblending
+{
+    /// \brief Get the composite operation of OpenRaster that corresponds to the blend mode.
+    /// \details OpenRaster composites every layer by source-over (except "svg:plus"), so the comp op of the layer
+    /// cannot be expressed and the result is exact only for the source-over comp op with the blend modes other than
+    /// linear dodge, and for the plus comp op with linear dodge (mapped into "svg:plus"). The other combinations are
+    /// approximated: a plus layer with another blend mode is composited by source-over with that mode, and a
+    /// source-over layer with linear dodge is added as "svg:plus".
+    std::string retrieve_openraster_composite_op(BlendMode mode);
+
+    /// \brief Writer of an OpenRaster (.ora) file, which stores all the images of a job in a single file.
+    /// \details Images are encoded into PNG as soon as they are added (the images in a single call are encoded
+    /// concurrently), so the caller can release them right after adding. The file itself is a ZIP archive without
+    /// compression (the PNG data is already compressed), which is written in a single sequential pass by close.
+    /// Images added later are stacked above those added earlier.
+    class OpenRasterWriter
+    {
+    public:
+        /// \param png_compression_level See AbstractImage::save.
+        /// \param target_concurrency The number of images that are encoded at the same time. If zero, the hardware concurrency is used.
+        OpenRasterWriter(const std::string& file_path, int width, int height, int png_compression_level = -1, int target_concurrency = 0);
+
+        /// \brief Write the file if it has not been written yet.
+        ~OpenRasterWriter();
+
+        OpenRasterWriter(const OpenRasterWriter&)            = delete;
+        OpenRasterWriter& operator=(const OpenRasterWriter&) = delete;
+
+        /// \brief Add layers named "<prefix>_<index>" with the composite operations of their blend modes (see
+        /// retrieve_openraster_composite_op).
+        /// \param with_alpha_channel If true, the alpha channels are also added as hidden layers (as in export_layers).
+        /// \param crop_to_alpha_bounding_box If true, each layer (but not its alpha channel) is cropped to the bounding
+        /// box of its visible pixels and placed at its offset (as in export_layers).
+        void add_layers(const std::vector<ColorImage>& layers,
+                        const std::string&             name_prefix,
+                        const std::vector<BlendMode>&  modes,
+                        bool                           is_visible                 = true,
+                        bool                           with_alpha_channel         = false,
+                        bool                           crop_to_alpha_bounding_box = false);
+
+        /// \brief Add an image as a layer composited normally (e.g., for intermediate or debug images).
+        void add_image(const std::string& name, const AbstractImage& image, bool is_visible = false);
+
+        /// \brief Set the image that represents the final composition ("mergedimage.png" and the thumbnail).
+        void set_merged_image(const ColorImage& image);
+
+        /// \brief Add an arbitrary file (e.g., "layer_infos.json") to the archive.
+        void add_file(const std::string& path, const std::string& content);
+
+        /// \brief Write the file.
+        /// \details std::runtime_error is thrown if the file cannot be written or exceeds the limits of ZIP without
+        /// the ZIP64 extension (4 GiB and 65535 entries).
+        void close();
+
+    private:
+        struct Entry
+        {
+            std::string               path;
+            std::vector<std::uint8_t> data;
+            std::uint32_t             crc;
+        };
+
+        struct StackItem
+        {
+            std::string name;
+            std::string path;
+            std::string composite_op;
+            bool        is_visible;
+            int         x;
+            int         y;
+        };
+
+        std::string file_path_;
+        int         width_;
+        int         height_;
+        int         png_compression_level_;
+        int         target_concurrency_;
+        bool        is_closed_ = false;
+
+        std::vector<StackItem> stack_;
+        std::vector<Entry>     layer_entries_;
+        std::vector<Entry>     other_entries_;
+
+        void add_stack_items(const std::vector<StackItem>& items, const std::vector<const AbstractImage*>& images);
+    };
+}
+
+#endif // OPENRASTER_HPP
@@ -0,0 +1,73 @@
+#ifndef OPTIMIZATION_HPP
+#define OPTIMIZATION_HPP
+
+#include <unblending/common.hpp>
+#include <unblending/blend_mode.hpp>
+#include <unblending/comp_op.hpp>
+
+namespace unblending
+{
+    /// \brief Parameters that are passed to the objective function of the per-pixel optimization.
+    struct OptimizationParameterSet
+    {
+        std::vector<ColorModelPtr> models;
+        std::vector<CompOp>        comp_ops;
+        std::vector<BlendMode>     modes;
+        
+        Vec3   target_color;
+        VecX   lambda;
+        double rho;
+        double sigma;               // Weight for the sparcity term
+        bool   use_sparcity;
+        bool   use_minimum_alpha;
+        bool   use_target_alphas;   // If true, the alternative constraint (Eq. 6) will be used instead of the unity constraint (Eq. 2).
+        VecX   target_alphas;       // This will be used when "use_target_alphas" is true.
+        
+        std::vector<int> gray_layers; // A list of gray layer indices. For example, if the second and fourth layers are to be gray, it looks like { 1, 3 }.
+        
+        int num_evaluations = 0;    // Incremented by each call of the objective function
+    };
+    
+    /// \brief Counters of a single run of the per-pixel optimization.
+    struct PerPixelOptimizationCounts
+    {
+        int  num_iterations  = 0;     ///< Outer iterations (i.e., augmented Lagrangian updates).
+        int  num_evaluations = 0;     ///< Evaluations of the objective function (and its gradient).
+        bool is_converged    = false; ///< False if the maximum number of outer iterations was reached.
+    };
+    
+    /// \brief Calculate the augmented Lagrangian and its gradient (in the NLopt interface).
+    /// \param data A pointer to OptimizationParameterSet. Its evaluation counter is incremented.
+    double objective_function(const std::vector<double>& x, std::vector<double>& grad, void* data);
+    
+    /// \brief Find the initial solution of the per-pixel optimization.
+    VecX find_initial_solution(const Vec3&                       target_color,
+                               const std::vector<ColorModelPtr>& models);
+    
+    /// \brief Solve the per-pixel optimization by the augmented Lagrangian method.
+    /// \param counts If not null, the iteration counts of this run are added to this.
+    /// \return The solution, i.e., the alphas of all the layers followed by the colors of all the layers.
+    VecX solve_per_pixel_optimization(const Vec3&                       target_color,
+                                      const std::vector<ColorModelPtr>& models,
+                                      const std::vector<CompOp>&        comp_ops,
+                                      const std::vector<BlendMode>&     modes,
+                                      const bool                        is_for_refinement       = false,
+                                      const bool                        has_opaque_background   = true,
+                                      const VecX&                       initial_colors          = VecX(),
+                                      const VecX&                       target_alphas           = VecX(),
+                                      const bool                        force_smooth_background = false,
+                                      const Vec3&                       target_background_color = Vec3(),
+                                      PerPixelOptimizationCounts*       counts                  = nullptr);
+    
+    /// \brief Solve the per-pixel optimization with the layers whose color models are closest to the target color
+    /// first, and add the other layers only when the constraints cannot be satisfied.
+    /// \details The inactive layers are pinned to zero alpha and their representative colors.
+    VecX solve_per_pixel_optimization_with_active_set(const Vec3&                       target_color,
+                                                      const std::vector<ColorModelPtr>& models,
+                                                      const std::vector<CompOp>&        comp_ops,
+                                                      const std::vector<BlendMode>&     modes,
+                                                      const bool                        has_opaque_background,
+                                                      PerPixelOptimizationCounts*       counts = nullptr);
+}
+
+#endif // OPTIMIZATION_HPP
@@ -0,0 +1,66 @@
+#ifndef RECONSTRUCTION_REPORT_HPP
+#define RECONSTRUCTION_REPORT_HPP
+
+#include <string>
+#include <unblending/common.hpp>
+#include <unblending/blend_mode.hpp>
+#include <unblending/comp_op.hpp>
+#include <unblending/image_processing.hpp>
+
+namespace unblending
+{
+    class SparseLayer;
+
+    /// \brief Alpha statistics of a single layer.
+    /// \details A pixel is counted as transparent (or opaque) when its alpha is quantized to 0 (or 255) in
+    /// 8-bit images.
+    struct LayerCoverage
+    {
+        double mean_alpha;
+        double transparent_ratio;
+        double opaque_ratio;
+    };
+
+    /// \brief Summary of how well a set of layers reconstructs the target image.
+    /// \details The per-pixel error is the Euclidean distance of RGBA values (the same as calculate_difference).
+    /// The RMSE is computed over all the four channels, and the PSNR assumes the peak value of 1.0 (it is
+    /// infinity when the reconstruction is exact).
+    struct ReconstructionReport
+    {
+        int    width;
+        int    height;
+        double rmse;
+        double psnr;
+        double mean_error;
+        double max_error;
+        int    max_error_x;
+        int    max_error_y;
+
+        std::vector<LayerCoverage> layer_coverages;
+    };
+
+    /// \brief Recomposite the layers and evaluate the reconstruction error in a single parallel pass.
+    /// \param error_heatmap If not null, the per-pixel error is written to this image.
+    /// \param target_concurrency The target concurrency. If zero, the hardware concurrency will be used.
+    ReconstructionReport compute_reconstruction_report(const ColorImage&              image,
+                                                       const std::vector<ColorImage>& layers,
+                                                       const std::vector<CompOp>&     comp_ops,
+                                                       const std::vector<BlendMode>&  modes,
+                                                       Image*                         error_heatmap      = nullptr,
+                                                       const int                      target_concurrency = 0);
+
+    /// \brief Evaluate the reconstruction by sparse layers, skipping the tiles that are not stored.
+    ReconstructionReport compute_reconstruction_report(const ColorImage&               image,
+                                                       const std::vector<SparseLayer>& layers,
+                                                       const std::vector<CompOp>&      comp_ops,
+                                                       const std::vector<BlendMode>&   modes,
+                                                       Image*                          error_heatmap      = nullptr,
+                                                       const int                       target_concurrency = 0);
+
+    /// \brief Export a reconstruction report as a JSON file.
+    /// \details std::runtime_error is thrown if the file cannot be written.
+    void export_reconstruction_report(const ReconstructionReport& report,
+                                      const std::string&          file_path);
+}
+
+#endif // RECONSTRUCTION_REPORT_HPP
@@ -0,0 +1,118 @@
+#ifndef ROW_UNMIXING_HPP
+#define ROW_UNMIXING_HPP
+
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <unordered_map>
+#include <unblending/unblending.hpp>
+#include <unblending/worker_pool.hpp>
+
+namespace unblending
+{
+    /// \brief Incremental color unmixing of blocks of rows given as interleaved pixel buffers.
+    /// \details This gives the same result as compute_color_unmixing but without building ColorImage objects,
+    /// so that a caller can feed the rows of a decoder directly and pass the resulting rows to an encoder. The
+    /// setup that is common to all the pixels (the extracted layer infos and the linear solver) and the worker
+    /// threads are created once in the constructor and reused by every call. The refinement is not performed as
+    /// it needs neighboring rows (see perform_matte_refinement_of_band).
+    class RowUnmixer
+    {
+    public:
+        /// \param target_concurrency The number of threads. If zero, the hardware concurrency will be used.
+        /// \param use_active_set See compute_color_unmixing.
+        /// \param model See compute_color_unmixing.
+        /// \param use_solution_cache If true, the solutions of 8-bit colors are cached and reused by all the later
+        /// calls (the solution of a pixel depends only on its color, so the result does not change). This pays off
+        /// when many pixels (e.g., of flat-colored images) share colors. The cache is not used with the linear
+        /// solver, which is as cheap as a lookup.
+        RowUnmixer(const std::vector<LayerInfo>& layer_infos,
+                   const bool                    has_opaque_background,
+                   const int                     target_concurrency = 0,
+                   const bool                    use_active_set     = false,
+                   const UnmixingModel           model              = UnmixingModel::Blending,
+                   const bool                    use_solution_cache = false);
+
+        /// \brief Construct an unmixer that runs its loops on a pool shared with other unmixers.
+        /// \details Loops of unmixers that share a pool are run one at a time.
+        RowUnmixer(const std::vector<LayerInfo>&      layer_infos,
+                   const bool                         has_opaque_background,
+                   const std::shared_ptr<WorkerPool>& pool,
+                   const bool                         use_active_set     = false,
+                   const UnmixingModel                model              = UnmixingModel::Blending,
+                   const bool                         use_solution_cache = false);
+
+        int get_num_layers() const { return static_cast<int>(models_.size()); }
+
+        /// \brief Unmix a block of rows of 8-bit pixels.
+        /// \param input The first pixel of the block. Pixels are interleaved RGB (num_channels = 3) or RGBA
+        /// (num_channels = 4, where the alpha is ignored as in compute_color_unmixing).
+        /// \param input_stride The number of elements (not bytes) from the beginning of a row to that of the next row.
+        /// \param layer_outputs The first pixel of the block of each layer (in the order of the layer infos), to
+        /// which interleaved RGBA values in [0, 1] are written.
+        /// \param output_stride The number of elements from the beginning of a row to that of the next row in the outputs.
+        void unmix_rows(const std::uint8_t*        input,
+                        const int                  width,
+                        const int                  num_rows,
+                        const int                  num_channels,
+                        const std::ptrdiff_t       input_stride,
+                        const std::vector<float*>& layer_outputs,
+                        const std::ptrdiff_t       output_stride);
+
+        /// \brief Unmix a block of rows of floating-point pixels in [0, 1].
+        void unmix_rows(const float*               input,
+                        const int                  width,
+                        const int                  num_rows,
+                        const int                  num_channels,
+                        const std::ptrdiff_t       input_stride,
+                        const std::vector<float*>& layer_outputs,
+                        const std::ptrdiff_t       output_stride);
+
+        /// \brief Unmix a whole image, which gives the same layers as compute_color_unmixing.
+        std::vector<ColorImage> unmix_image(const ColorImage& image);
+
+        /// \brief Get the statistics accumulated over all the calls so far. Pixels whose solutions are taken from
+        /// the cache are counted as skipped pixels.
+        OptimizationStatistics get_statistics() const;
+
+    private:
+        /// \brief Workspace that is owned by a single thread.
+        struct Workspace
+        {
+            OptimizationStatistics statistics;
+
+            // Keep the workspaces of different threads in different cache lines
+            char padding[64];
+        };
+
+        /// \brief Shard of the solution cache, which is locked independently of the others.
+        struct CacheShard
+        {
+            std::mutex                               mutex;
+            std::unordered_map<std::uint32_t, VecX> solutions;
+        };
+
+        template <typename Scalar>
+        void unmix(const Scalar* input, double max_value, int width, int num_rows, int num_channels, std::ptrdiff_t input_stride, const std::vector<float*>& layer_outputs, std::ptrdiff_t output_stride);
+
+        VecX solve(const Vec3& pixel_color, Workspace& workspace);
+
+        std::vector<ColorModelPtr> models_;
+        std::vector<CompOp>        comp_ops_;
+        std::vector<BlendMode>     modes_;
+
+        bool has_opaque_background_;
+        bool use_active_set_;
+
+        std::shared_ptr<const LinearUnmixingSolver> linear_solver_;
+
+        std::shared_ptr<WorkerPool> pool_;
+        std::vector<Workspace>      workspaces_;
+
+        std::unique_ptr<CacheShard[]> cache_shards_;
+    };
+}
+
+#endif // ROW_UNMIXING_HPP
@@ -0,0 +1,88 @@
+#ifndef SPARSE_LAYER_HPP
+#define SPARSE_LAYER_HPP
+
+#include <vector>
+#include <string>
+#include <cstddef>
+#include <unblending/compositing.hpp>
+#include <unblending/image_processing.hpp>
+
+namespace unblending
+{
+    /// \brief Layer that stores only the tiles that are not fully transparent.
+    /// \details The canvas is divided into square tiles, and a tile is stored (as a small color image) only if at
+    /// least one of its alphas is above the threshold; the other tiles are treated as fully transparent. The memory
+    /// usage and the cost of compositing and exporting are therefore proportional to the area covered by the
+    /// layer rather than to the canvas size.
+    class SparseLayer final : public AbstractImage
+    {
+    public:
+        /// \param alpha_threshold Tiles whose alphas are all at most this value are dropped. With zero (which is
+        /// the default), only exactly transparent tiles are dropped, so the layer is lossless (except for the colors
+        /// of the transparent pixels); with 1 / 255, the exported 8-bit alphas are still the same.
+        /// \param tile_size The width and height of the tiles, which should be in [1, max_span_length].
+        /// \param target_concurrency Target concurrency of multi-threading. If zero, the hardware concurrency is used.
+        SparseLayer(const ColorImage& layer, double alpha_threshold = 0.0, int tile_size = 64, int target_concurrency = 0);
+
+        int get_tile_size()   const { return tile_size_;   }
+        int get_num_tiles_x() const { return num_tiles_x_; }
+        int get_num_tiles_y() const { return num_tiles_y_; }
+
+        /// \brief Get the number of the tiles that are stored (i.e., not fully transparent).
+        int get_num_stored_tiles() const { return static_cast<int>(tiles_.size()); }
+
+        /// \brief Get the region of the canvas that the tile covers (tiles at the right and bottom may be smaller).
+        ImageRegion get_tile_region(int tile_x, int tile_y) const;
+
+        /// \brief Get the stored tile, or null if the tile is fully transparent.
+        const ColorImage* get_tile(int tile_x, int tile_y) const
+        {
+            const int slot = tile_slots_[tile_y * num_tiles_x_ + tile_x];
+            return (slot < 0) ? nullptr : &tiles_[slot];
+        }
+
+        /// \brief Get the span from the pixel (x, y) to the right end of its tile (null if the tile is not stored).
+        LayerSpan get_span(int x, int y) const;
+
+        /// \brief Get the number of bytes of the stored pixels.
+        std::size_t get_memory_usage() const;
+
+        /// \brief Convert into a dense color image (fully transparent tiles are filled with zeros).
+        ColorImage to_dense_image(int target_concurrency = 0) const;
+
+    private:
+        int tile_size_;
+        int num_tiles_x_;
+        int num_tiles_y_;
+
+        // The index of each tile in tiles_ (or -1 if the tile is fully transparent) in the row-major order
+        std::vector<int>        tile_slots_;
+        std::vector<ColorImage> tiles_;
+
+        void convert_row_to_argb32(int y, std::uint32_t* pixels) const override;
+    };
+
+    /// \brief Convert layers into sparse layers (see SparseLayer).
+    std::vector<SparseLayer> make_sparse_layers(const std::vector<ColorImage>& layers,
+                                                double                         alpha_threshold    = 0.0,
+                                                int                            tile_size          = 64,
+                                                int                            target_concurrency = 0);
+
+    /// \brief Calculate a blended image from multiple sparse layers (see composite_layers).
+    /// \details Rows are processed tile by tile, and the layers whose tiles are not stored are skipped.
+    ColorImage composite_layers(const std::vector<SparseLayer>& layers,
+                                const std::vector<CompOp>&      comp_ops,
+                                const std::vector<BlendMode>&   modes,
+                                const int                       target_concurrency = 0);
+
+    /// \brief Export sparse layers as image files named "<prefix>_<index>.png", which are encoded concurrently.
+    /// \details std::runtime_error is thrown if a file cannot be written.
+    /// \param png_compression_level See AbstractImage::save.
+    void export_layers(const std::vector<SparseLayer>& layers,
+                       const std::string&              output_directory_path,
+                       const std::string&              file_name_prefix,
+                       const int                       png_compression_level = -1,
+                       const int                       target_concurrency    = 0);
+}
+
+#endif // SPARSE_LAYER_HPP
@@ -0,0 +1,99 @@
+#ifndef STREAMING_HPP
+#define STREAMING_HPP
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <fstream>
+#include <unblending/unblending.hpp>
+
+class QImage;
+
+namespace unblending
+{
+    /// \brief Reader of horizontal bands of an image file.
+    /// \details Binary PPM (P6) and PAM (P7) files (8-bit or 16-bit) are read row by row directly from the file, so
+    /// only the requested rows are ever held in memory. Other formats (e.g., PNG and JPEG) are decoded once as a
+    /// whole and kept in 8-bit RGBA, which is still eight times smaller than a ColorImage.
+    /// std::runtime_error is thrown if the file cannot be decoded or its rows cannot be read (e.g., it is truncated).
+    class ImageBandReader
+    {
+    public:
+        ImageBandReader(const std::string& file_path);
+        ~ImageBandReader();
+
+        int width()  const { return width_;  }
+        int height() const { return height_; }
+
+        /// \brief Whether the rows are read directly from the file (i.e., it is a binary PPM/PAM file).
+        bool is_streaming() const { return is_netpbm_; }
+
+        /// \brief Check whether the rows of a file would be read directly from it without decoding the whole image.
+        static bool is_streamable(const std::string& file_path);
+
+        /// \brief Read the rows in [y_begin, y_end).
+        /// \param target_concurrency Target concurrency of the conversion. If zero, the hardware concurrency is used.
+        ColorImage read_rows(int y_begin, int y_end, int target_concurrency = 0);
+
+    private:
+        std::string file_path_;
+
+        int width_  = 0;
+        int height_ = 0;
+
+        // Netpbm files
+        bool           is_netpbm_        = false;
+        int            depth_            = 0;
+        int            max_value_        = 0;
+        std::streamoff data_offset_      = 0;
+        std::ifstream  netpbm_file_;
+
+        // Other formats
+        std::unique_ptr<QImage> decoded_image_;
+    };
+
+    /// \brief Writer of a 16-bit RGBA PAM (P7) file that receives its rows in order.
+    /// \details std::runtime_error is thrown if the file cannot be opened or written.
+    class PamWriter
+    {
+    public:
+        PamWriter(const std::string& file_path, int width, int height);
+
+        /// \brief Append rows to the file. The pixel values are cropped into [0, 1].
+        void write_rows(const ColorImage& rows);
+
+        bool is_complete() const { return num_written_rows_ == height_; }
+
+    private:
+        std::string   file_path_;
+        std::ofstream file_;
+
+        int width_;
+        int height_;
+        int num_written_rows_ = 0;
+    };
+
+    /// \brief Decompose an image file into layers band by band, streaming the resulting layers into PAM files.
+    /// \details Each band is read with halo rows of twice the refinement radius above and below it, unmixed
+    /// (including the halo rows), and refined by perform_matte_refinement_of_band, so the layers are identical to
+    /// those of compute_color_unmixing and perform_matte_refinement for the whole image up to the quantization of
+    /// the output (16-bit in the PAM files; none in the layer file). The memory usage depends on
+    /// the image width and the band height but not on the image height. The layers are written as
+    /// "<prefix>_<index>.pam" (16-bit RGBA) in the output directory.
+    /// \param band_height The number of rows of each band (excluding the halo rows).
+    /// \param write_layer_file If true, all the layers are written into a single float32 layer file
+    /// "<prefix>.ulf" (see LayerFileWriter) instead of the PAM files.
+    void decompose_in_bands(const std::string&            input_image_path,
+                            const std::vector<LayerInfo>& layer_infos,
+                            const std::string&            output_directory_path,
+                            const std::string&            file_name_prefix,
+                            const int                     band_height,
+                            const bool                    has_opaque_background,
+                            const bool                    force_smooth_background,
+                            const int                     target_concurrency = 0,
+                            const bool                    use_active_set     = false,
+                            const UnmixingModel           model              = UnmixingModel::Blending,
+                            const bool                    write_layer_file   = false);
+}
+
+#endif // STREAMING_HPP
@@ -0,0 +1,46 @@
+#ifndef SYNTHETIC_DATA_HPP
+#define SYNTHETIC_DATA_HPP
+
+#include <unblending/common.hpp>
+#include <unblending/layer_info.hpp>
+#include <unblending/image_processing.hpp>
+
+namespace unblending
+{
+    /// \brief An input image with its known ground-truth layers.
+    struct SyntheticData
+    {
+        ColorImage              image;
+        std::vector<ColorImage> layers;
+    };
+
+    /// \brief Generate an image by compositing random layers that follow the layer specifications.
+    /// \details The colors of each layer are drawn from its (Gaussian) color model as spatially smooth fields
+    /// and cropped into [0, 1]. The alpha mattes are unions of random ellipses with soft edges. When the
+    /// background is opaque, the bottom layer is fully opaque; when all the layers are composited by "plus", the
+    /// alphas are normalized to sum up to one for each pixel (as in the refinement step).
+    /// \param seed The seed of the random number generator; the same seed gives the same data.
+    SyntheticData generate_synthetic_data(const std::vector<LayerInfo>& layer_infos,
+                                          const int                     width,
+                                          const int                     height,
+                                          const unsigned                seed,
+                                          const bool                    has_opaque_background = true);
+
+    /// \brief Errors of estimated layers with respect to the ground-truth layers.
+    /// \details The color error of a layer is weighted by its ground-truth alpha because the colors of
+    /// transparent pixels cannot be recovered (and do not matter).
+    struct LayerRecoveryError
+    {
+        double alpha_rmse; ///< RMSE of the alphas over all the layers.
+        double color_rmse; ///< Alpha-weighted RMSE of the RGB values over all the layers.
+
+        std::vector<double> layer_alpha_rmses;
+        std::vector<double> layer_color_rmses;
+    };
+
+    /// \brief Compute the errors of estimated layers with respect to the ground-truth layers.
+    LayerRecoveryError compute_layer_recovery_error(const std::vector<ColorImage>& layers,
+                                                    const std::vector<ColorImage>& ground_truth_layers);
+}
+
+#endif // SYNTHETIC_DATA_HPP
@@ -0,0 +1,62 @@
+#ifndef TASK_GRAPH_HPP
+#define TASK_GRAPH_HPP
+
+#include <string>
+#include <vector>
+#include <functional>
+
+namespace unblending
+{
+    /// \brief Graph of tasks that are run on demand.
+    /// \details Tasks are registered with their dependencies, and only the requested tasks and the tasks they depend
+    /// on (transitively) are run. Tasks whose dependencies have finished are run concurrently by a shared set of
+    /// threads. A task can also have a release function, which is called as soon as all the tasks that depend on it
+    /// have finished (e.g., to free the images it produced).
+    ///
+    /// Since tasks parallelize their own loops as well, the threads of the machine are shared by the running tasks
+    /// as a budget: a starting task receives its share of the threads that the running tasks do not use (divided
+    /// among the tasks that are ready to start), which it should pass to its parallel loops as their target
+    /// concurrency, and returns them when it finishes. A task that starts when the budget is used up receives a
+    /// single thread.
+    class TaskGraph
+    {
+    public:
+        /// \brief Register a task and get its index.
+        /// \param process The function of the task, which receives the target concurrency of its parallel loops.
+        /// \param dependencies The indices of the tasks that should finish before this task starts (they should be
+        /// registered beforehand, so the graph is always acyclic).
+        int add_task(const std::string&              name,
+                     const std::function<void(int)>& process,
+                     const std::vector<int>&         dependencies = {},
+                     const std::function<void()>&    release      = nullptr);
+
+        /// \brief Request the task (and thus the tasks it depends on) to be run.
+        void request(int task_index);
+
+        /// \brief Check whether the task is going to be run (i.e., it is requested or some requested task depends on it).
+        bool is_required(int task_index) const;
+
+        /// \brief Run the required tasks and wait until all of them finish.
+        /// \details If a task throws an exception, no more tasks are started, and the exception is rethrown once the
+        /// running tasks have finished.
+        /// \param target_concurrency The number of threads shared by the tasks (see above). If zero, the hardware concurrency is used.
+        /// \param max_num_concurrent_tasks The number of tasks that are run at the same time. If zero, it is bounded only
+        /// by the target concurrency. With one, the tasks run one by one with all the threads (e.g., so that per-stage
+        /// measurements are not mixed).
+        void run(int target_concurrency = 0, int max_num_concurrent_tasks = 0);
+
+    private:
+        struct Task
+        {
+            std::string              name;
+            std::function<void(int)> process;
+            std::function<void()>    release;
+            std::vector<int>         dependencies;
+            bool                     is_required = false;
+        };
+
+        std::vector<Task> tasks_;
+    };
+}
+
+#endif // TASK_GRAPH_HPP
@@ -0,0 +1,84 @@
+#ifndef TRACING_HPP
+#define TRACING_HPP
+
+#include <atomic>
+#include <string>
+#include <cstddef>
+
+/// \file
+/// \brief Event tracing of the pipeline stages and tiles in the Chrome trace format (which can be loaded in
+/// Perfetto or chrome://tracing).
+/// \details Spans are recorded by UNBLENDING_TRACE_SCOPE into per-thread ring buffers, so recording does not
+/// need any synchronization; when a buffer is full, the oldest events are overwritten. The macros expand to
+/// nothing unless UNBLENDING_WITH_TRACING is defined (see the CMake option of the same name). When it is
+/// defined but tracing is not started, a scope costs a single branch.
+
+#ifdef UNBLENDING_WITH_TRACING
+#define UNBLENDING_TRACE_CONCAT_INNER(a, b) a##b
+#define UNBLENDING_TRACE_CONCAT(a, b) UNBLENDING_TRACE_CONCAT_INNER(a, b)
+#define UNBLENDING_TRACE_SCOPE(name, category) unblending::tracing::TraceScope UNBLENDING_TRACE_CONCAT(trace_scope_, __LINE__)(name, category)
+#define UNBLENDING_TRACE_SCOPE_WITH_ARG(name, category, arg) unblending::tracing::TraceScope UNBLENDING_TRACE_CONCAT(trace_scope_, __LINE__)(name, category, arg)
+#else
+#define UNBLENDING_TRACE_SCOPE(name, category)
+#define UNBLENDING_TRACE_SCOPE_WITH_ARG(name, category, arg)
+#endif
+
+namespace unblending
+{
+    namespace tracing
+    {
+        /// \brief Check whether the library is built with tracing.
+        bool is_available();
+
+        /// \brief Start recording events (previously recorded events are discarded).
+        /// \param events_per_thread The capacity of the ring buffer of each thread.
+        void start_tracing(const std::size_t events_per_thread = 1 << 14);
+
+        /// \brief Stop recording events.
+        void stop_tracing();
+
+        /// \brief Write the recorded events as a Chrome trace JSON file.
+        /// \details This should be called when no stage is running (e.g., after stop_tracing).
+        /// \return False if the library is built without tracing or the file cannot be written.
+        bool export_trace(const std::string& file_path);
+
+#ifdef UNBLENDING_WITH_TRACING
+        namespace internal
+        {
+            extern std::atomic<bool> is_tracing;
+
+            long long get_timestamp();
+            void      record_span(const char* name, const char* category, int arg, long long begin, long long end);
+        }
+
+        /// \brief Scope that records a span from its construction to its destruction.
+        /// \param name A string literal (it is stored as a pointer).
+        /// \param category A string literal (it is stored as a pointer).
+        /// \param arg An optional integer argument (e.g., a tile index); negative values are not recorded.
+        class TraceScope
+        {
+        public:
+            TraceScope(const char* name, const char* category, const int arg = - 1) :
+            name_(name),
+            category_(category),
+            arg_(arg),
+            begin_(internal::is_tracing.load(std::memory_order_relaxed) ? internal::get_timestamp() : - 1)
+            {
+            }
+
+            ~TraceScope()
+            {
+                if (begin_ >= 0) { internal::record_span(name_, category_, arg_, begin_, internal::get_timestamp()); }
+            }
+
+        private:
+            const char*     name_;
+            const char*     category_;
+            const int       arg_;
+            const long long begin_;
+        };
+#endif
+    }
+}
+
+#endif // TRACING_HPP
@@ -2,46 +2,137 @@
 #define UNBLENDING_HPP
 
 #include <string>
+#include <cstddef>
 #include <unblending/common.hpp>
 #include <unblending/layer_info.hpp>
 #include <unblending/color_model.hpp>
 #include <unblending/image_processing.hpp>
+#include <unblending/linear_unmixing.hpp>
 
 namespace unblending
 {
+    /// \brief Statistics of a per-pixel optimization stage.
+    struct OptimizationStatistics
+    {
+        int num_pixels         = 0;
+        int num_skipped_pixels = 0; ///< Pixels whose solution was obtained without running the optimization.
+        
+        long long num_iterations         = 0; ///< Outer iterations summed over the optimized pixels.
+        long long num_evaluations        = 0; ///< Objective evaluations summed over the optimized pixels.
+        int       max_iterations         = 0; ///< Maximum number of outer iterations of a single pixel.
+        int       num_unconverged_pixels = 0; ///< Pixels that reached the iteration limit.
+        
+        int num_bands   = 1; ///< Bands in which the image was processed (more than one if the memory budget is exceeded).
+        int band_height = 0; ///< Rows of each band (excluding the halo rows).
+        
+        bool is_budget_exceeded = false; ///< Whether even the smallest bands exceeded the memory budget.
+        
+        double get_skip_ratio() const { return (num_pixels > 0) ? static_cast<double>(num_skipped_pixels) / static_cast<double>(num_pixels) : 0.0; }
+        
+        /// \brief Calculate the mean number of outer iterations per optimized (i.e., not skipped) pixel.
+        double get_mean_iterations() const
+        {
+            const int num_optimized_pixels = num_pixels - num_skipped_pixels;
+            return (num_optimized_pixels > 0) ? static_cast<double>(num_iterations) / static_cast<double>(num_optimized_pixels) : 0.0;
+        }
+    };
+    
+    /// \brief Size (in pixels) of the square tiles in which the per-pixel optimizations are scheduled.
+    constexpr int solver_tile_size = 16;
+    
     /// \brief Compute the main unblending optimization.
     /// \param image The input image to be decomposed.
     /// \param layer_infos A set of layer specifications. The front corresponds to the bottom layer, and
     /// the back corresponds to the top layer.
     /// \param has_opaque_background True if the resulting background layer should be opaque.
     /// \param target_concurrency The target concurrency. If zero, the hardware concurrency will be used.
+    /// \param use_active_set If true, each pixel is first solved only with the layers whose color models are
+    /// closest to the pixel color (the other layers are pinned to zero alpha and their representative colors),
+    /// and more layers are added only when the constraints cannot be satisfied.
+    /// \param model The composition model. The linear model is solved by LinearUnmixingSolver and ignores
+    /// has_opaque_background (its alphas sum up to one) and use_active_set.
+    /// \param statistics If not null, the numbers of pixels and solver iterations are written to this.
     /// \return The resulting layers. The front corresponds to the bottom layer, and the back corresponds
     /// to the top layer.
     std::vector<ColorImage> compute_color_unmixing(const ColorImage& image,
                                                    const std::vector<LayerInfo>& layer_infos,
                                                    const bool has_opaque_background,
-                                                   const int target_concurrency = 0);
+                                                   const int target_concurrency = 0,
+                                                   const bool use_active_set = false,
+                                                   const UnmixingModel model = UnmixingModel::Blending,
+                                                   OptimizationStatistics* statistics = nullptr);
     
     /// \brief Compute the sub unblending optimization for refinement.
+    /// \param skip_tolerance If non-negative, the optimization is skipped for pixels where the refined
+    /// (i.e., filtered and normalized) alphas differ from the input alphas by at most this value (and, when
+    /// the background is forced to be smooth, so does the background color); the input layer values are
+    /// copied to such pixels instead. A negative value disables skipping.
+    /// \param statistics If not null, the numbers of processed and skipped pixels and solver iterations (and the bands) are written to this.
+    /// \param model The composition model. In the linear model, the alphas are normalized to sum up to one,
+    /// the colors are solved in a closed form, and has_opaque_background and force_smooth_background are ignored.
+    /// \param memory_budget If non-zero, the image is processed in horizontal bands (with halo rows that make the
+    /// result identical) such that the image buffers stay within this number of bytes as far as possible. The
+    /// input image and the input and output layers are always kept at full size.
     std::vector<ColorImage> perform_matte_refinement(const ColorImage&              image,
                                                      const std::vector<ColorImage>& layers,
                                                      const std::vector<LayerInfo>&  layer_infos,
                                                      const bool                     has_opaque_background,
                                                      const bool                     force_smooth_background,
-                                                     const int                      target_concurrency = 0);
+                                                     const int                      target_concurrency = 0,
+                                                     const double                   skip_tolerance     = - 1.0,
+                                                     OptimizationStatistics*        statistics         = nullptr,
+                                                     const UnmixingModel            model              = UnmixingModel::Blending,
+                                                     const std::size_t              memory_budget      = 0);
+    
+    /// \brief Calculate the radius of the guided filter that is used in the matte refinement of an image.
+    int calculate_refinement_radius(int width, int height);
+    
+    /// \brief Compute the matte refinement of a horizontal band of an image.
+    /// \details The rows of the band are [row_begin, row_end) of the band images, which also have halo rows above
+    /// and below the band. With halo rows of twice the radius (or up to the image border), the result is identical
+    /// to the corresponding rows of perform_matte_refinement for the whole image. Pixels are not skipped.
+    /// \param image_band The band of the input image including the halo rows.
+    /// \param layer_bands The bands of the layers obtained by compute_color_unmixing including the halo rows.
+    /// \param radius The radius of the guided filter, which should be calculated by calculate_refinement_radius for
+    /// the size of the whole image.
+    /// \return The refined layers of the rows [row_begin, row_end).
+    std::vector<ColorImage> perform_matte_refinement_of_band(const ColorImage&              image_band,
+                                                             const std::vector<ColorImage>& layer_bands,
+                                                             const std::vector<LayerInfo>&  layer_infos,
+                                                             const bool                     has_opaque_background,
+                                                             const bool                     force_smooth_background,
+                                                             const int                      radius,
+                                                             const int                      row_begin,
+                                                             const int                      row_end,
+                                                             const int                      target_concurrency = 0,
+                                                             OptimizationStatistics*        statistics         = nullptr,
+                                                             const UnmixingModel            model              = UnmixingModel::Blending);
     
     /// \brief Calculate a blended image from multiple layers by color blending.
+    /// \details Rows are processed in parallel by the vectorized span compositor (see compositing.hpp).
     ColorImage composite_layers(const std::vector<ColorImage>& layers,
                                 const std::vector<CompOp>&     comp_ops,
-                                const std::vector<BlendMode>&  modes);
+                                const std::vector<BlendMode>&  modes,
+                                const int                      target_concurrency = 0);
     
     /// \brief Export layers as image files.
+    /// \details The files (including the alpha-channel files) are converted and encoded concurrently.
+    /// std::runtime_error is thrown if a file cannot be written.
+    /// \param png_compression_level See AbstractImage::save.
+    /// \param target_concurrency The number of files that are encoded at the same time. If zero, the hardware concurrency is used.
+    /// \param crop_to_alpha_bounding_box If true, each layer is cropped to the bounding box of its visible pixels
+    /// (i.e., those whose alphas are not quantized to zero), and the offsets of the files in the canvas are written
+    /// into "<prefix>_regions.json". A layer without visible pixels is written as a single transparent pixel at the
+    /// origin. The alpha-channel files are opaque images and are not cropped (their regions cover the canvas).
     void export_layers(const std::vector<ColorImage>& layers,
                        const std::string&             output_directory_path,
                        const std::string&             file_name_prefix,
-                       const bool                     with_alpha_channel     = false,
-                       const bool                     with_blend_mode_suffix = false,
-                       const std::vector<LayerInfo>&  layer_infos            = {});
+                       const bool                     with_alpha_channel         = false,
+                       const bool                     with_blend_mode_suffix     = false,
+                       const std::vector<LayerInfo>&  layer_infos                = {},
+                       const int                      png_compression_level      = -1,
+                       const int                      target_concurrency         = 0,
+                       const bool                     crop_to_alpha_bounding_box = false);
     
     /// \brief Export color models as image files.
     void export_models(const std::vector<ColorModelPtr>& models,
@@ -49,11 +140,21 @@ namespace unblending
                        const std::string& file_name_prefix);
     
     /// \brief Export layer infos as a JSON file.
+    /// \details std::runtime_error is thrown if the file cannot be written.
     void export_layer_infos(const std::vector<LayerInfo>& layer_infos,
                             const std::string& output_directory_path);
     
     /// \brief Import layer infos from a JSON file.
+    /// \details std::runtime_error is thrown if the file cannot be read or is not valid (see parse_layer_infos).
     std::vector<LayerInfo> import_layer_infos(const std::string& input_file_path);
+    
+    /// \brief Convert layer infos into a JSON text (in the same format as export_layer_infos).
+    std::string serialize_layer_infos(const std::vector<LayerInfo>& layer_infos);
+    
+    /// \brief Convert a JSON text (in the same format as import_layer_infos) into layer infos.
+    /// \details std::runtime_error is thrown if the text is not a non-empty array of layer infos with known blend
+    /// modes, three-channel primary colors, and invertible color variances.
+    std::vector<LayerInfo> parse_layer_infos(const std::string& json_text);
 }
 
 #endif // UNBLENDING_HPP
@@ -0,0 +1,58 @@
+#ifndef WORKER_POOL_HPP
+#define WORKER_POOL_HPP
+
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <condition_variable>
+
+namespace unblending
+{
+    /// \brief Pool of persistent worker threads for running parallel loops repeatedly.
+    /// \details Unlike parallelutil::parallel_for, which creates and joins threads in every call, the threads are
+    /// created once and wait for the next loop, which makes it cheap to run many small loops (e.g., for a few rows
+    /// of an image at a time). The calling thread also takes part in each loop.
+    class WorkerPool
+    {
+    public:
+        /// \param num_threads The number of threads including the calling thread. If zero, the hardware
+        /// concurrency is used.
+        explicit WorkerPool(int num_threads = 0);
+        ~WorkerPool();
+
+        WorkerPool(const WorkerPool&)            = delete;
+        WorkerPool& operator=(const WorkerPool&) = delete;
+
+        /// \brief Get the number of threads including the calling thread.
+        int get_num_threads() const { return static_cast<int>(threads_.size()) + 1; }
+
+        /// \brief Call process(index, thread_index) for each index in [0, n) and wait until all the calls finish.
+        /// \details Indices are assigned to the threads dynamically. The thread index is in
+        /// [0, get_num_threads()) and can be used to access per-thread workspaces without synchronization; the
+        /// calling thread has the index 0. Loops are run one at a time (concurrent calls are serialized).
+        void parallel_for(int n, const std::function<void(int index, int thread_index)>& process);
+
+    private:
+        void run_worker(int thread_index);
+        void process_indices(int thread_index);
+
+        std::vector<std::thread> threads_;
+
+        std::mutex              loop_mutex_;
+        std::mutex              mutex_;
+        std::condition_variable start_condition_;
+        std::condition_variable finish_condition_;
+
+        const std::function<void(int, int)>* process_ = nullptr;
+
+        int              num_indices_        = 0;
+        std::atomic<int> next_index_{0};
+        int              generation_         = 0;
+        int              num_active_workers_ = 0;
+        bool             is_terminating_     = false;
+    };
+}
+
+#endif // WORKER_POOL_HPP
@@ -0,0 +1,467 @@
+#include <unblending/batch.hpp>
+#include <unblending/row_unmixing.hpp>
+#include <unblending/reconstruction_report.hpp>
+#include <unblending/layer_file.hpp>
+#include <unblending/tracing.hpp>
+#include <deque>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <algorithm>
+#include <condition_variable>
+#include <json11.hpp>
+#include <sys/stat.h>
+
+namespace unblending
+{
+    using std::vector;
+    using json11::Json;
+
+    namespace
+    {
+        std::string resolve_path(const std::string& base_directory_path, const std::string& path)
+        {
+            if (path.empty() || path.front() == '/') { return path; }
+            return base_directory_path + "/" + path;
+        }
+
+        std::string retrieve_stem(const std::string& file_path)
+        {
+            const std::size_t name_begin = file_path.find_last_of('/') + 1;
+            const std::size_t name_end   = file_path.find_last_of('.');
+            return file_path.substr(name_begin, (name_end == std::string::npos || name_end < name_begin) ? std::string::npos : name_end - name_begin);
+        }
+
+        // Create a directory and its missing parents without invoking a shell (the paths may come from clients)
+        void create_directories(const std::string& directory_path)
+        {
+            for (std::size_t end = directory_path.find('/', 1); ; end = directory_path.find('/', end + 1))
+            {
+                const std::string path = directory_path.substr(0, end);
+                if (!path.empty() && mkdir(path.c_str(), 0755) != 0 && errno != EEXIST)
+                {
+                    throw std::runtime_error("cannot create " + path + " (" + std::strerror(errno) + ")");
+                }
+                if (end == std::string::npos) { break; }
+            }
+
+            struct stat status;
+            if (stat(directory_path.c_str(), &status) != 0 || !S_ISDIR(status.st_mode)) { throw std::runtime_error(directory_path + " is not a directory"); }
+        }
+
+        // Queue that blocks the producers while it is full and the consumers while it is empty
+        template <typename T>
+        class BoundedQueue
+        {
+        public:
+            explicit BoundedQueue(std::size_t capacity) : capacity_(std::max(std::size_t(1), capacity)) {}
+
+            void push(T&& item)
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                not_full_condition_.wait(lock, [&]() { return items_.size() < capacity_; });
+                items_.push_back(std::move(item));
+                not_empty_condition_.notify_one();
+            }
+
+            /// \brief Take the oldest item, or return false if the queue is empty and closed.
+            bool pop(T& item)
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                not_empty_condition_.wait(lock, [&]() { return !items_.empty() || is_closed_; });
+                if (items_.empty()) { return false; }
+
+                item = std::move(items_.front());
+                items_.pop_front();
+                not_full_condition_.notify_one();
+                return true;
+            }
+
+            /// \brief Tell the consumers that no more items are pushed.
+            void close()
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                is_closed_ = true;
+                not_empty_condition_.notify_all();
+            }
+
+        private:
+            const std::size_t       capacity_;
+            std::deque<T>           items_;
+            bool                    is_closed_ = false;
+            std::mutex              mutex_;
+            std::condition_variable not_full_condition_;
+            std::condition_variable not_empty_condition_;
+        };
+
+        struct DecodedImage
+        {
+            int        job_index = - 1;
+            ColorImage image     = ColorImage(0, 0);
+        };
+
+        // Interpret a job, whose values override the default values
+        BatchJob interpret_json_as_batch_job(const Json&        job_json,
+                                             const Json&        default_json,
+                                             const std::string& base_directory_path,
+                                             const std::string& default_output_directory_path,
+                                             std::string&       error)
+        {
+            auto retrieve_value = [&](const std::string& key) -> const Json&
+            {
+                return job_json[key].is_null() ? default_json[key] : job_json[key];
+            };
+
+            BatchJob job;
+            error.clear();
+
+            if (!job_json["input"].is_string()) { error = "\"input\" is not specified"; return job; }
+            if (!retrieve_value("layer_infos").is_string() && !retrieve_value("layer_infos").is_array()) { error = "\"layer_infos\" is not specified"; return job; }
+            if (!job_json["outdir"].is_string() && default_output_directory_path.empty()) { error = "\"outdir\" is not specified"; return job; }
+
+            job.input_image_path      = resolve_path(base_directory_path, job_json["input"].string_value());
+            job.output_directory_path = job_json["outdir"].is_string() ? resolve_path(base_directory_path, job_json["outdir"].string_value()) : default_output_directory_path + "/" + retrieve_stem(job.input_image_path);
+            job.target_width          = retrieve_value("width").int_value();
+            job.export_verbosely      = retrieve_value("verbose").bool_value();
+            job.export_report         = retrieve_value("report").bool_value();
+            job.use_explicit_name     = retrieve_value("explicit_mode_names").bool_value();
+            job.crop_layers           = retrieve_value("crop").bool_value();
+            job.use_layer_file        = retrieve_value("layer_file").bool_value();
+            job.png_compression_level = retrieve_value("png_compression").is_number() ? retrieve_value("png_compression").int_value() : - 1;
+
+            if (retrieve_value("layer_infos").is_array()) { job.layer_infos_json = retrieve_value("layer_infos").dump(); }
+            else { job.layer_infos_path = resolve_path(base_directory_path, retrieve_value("layer_infos").string_value()); }
+
+            return job;
+        }
+    }
+
+    // Settings shared by all the images that use the same layer infos
+    struct BatchProcessor::LayerSpec
+    {
+        vector<LayerInfo>           layer_infos;
+        vector<CompOp>              comp_ops;
+        vector<BlendMode>           modes;
+        std::unique_ptr<RowUnmixer> unmixer;
+    };
+
+    // Results of an image that wait to be encoded (the intermediate images are kept only if they are exported)
+    struct BatchProcessor::SolvedImage
+    {
+        std::shared_ptr<const LayerSpec> layer_spec;
+        ColorImage                       image                  = ColorImage(0, 0);
+        vector<ColorImage>               non_smoothed_layers;
+        ColorImage                       non_smoothed_composite = ColorImage(0, 0);
+        vector<ColorImage>               refined_layers;
+        ColorImage                       composite              = ColorImage(0, 0);
+        ReconstructionReport             report;
+        Image                            error_heatmap          = Image(0, 0);
+    };
+
+    vector<BatchJob> import_batch_manifest(const std::string& manifest_file_path)
+    {
+        std::ifstream reading_file(manifest_file_path);
+        if (!reading_file) { throw std::runtime_error("cannot read " + manifest_file_path + " (" + std::strerror(errno) + ")"); }
+        const std::string json_text = std::string(std::istreambuf_iterator<char>(reading_file), std::istreambuf_iterator<char>());
+
+        std::string err;
+        const auto json = Json::parse(json_text, err);
+        if (!err.empty()) { throw std::runtime_error(manifest_file_path + ": " + err); }
+        if (!json["images"].is_array()) { throw std::runtime_error(manifest_file_path + ": \"images\" should be an array"); }
+
+        const std::size_t separator_position  = manifest_file_path.find_last_of('/');
+        const std::string base_directory_path = (separator_position == std::string::npos) ? "." : manifest_file_path.substr(0, separator_position);
+
+        const std::string output_directory_path = json["outdir"].is_string() ? resolve_path(base_directory_path, json["outdir"].string_value()) : "./out";
+
+        vector<BatchJob> jobs;
+        for (const auto& image_json : json["images"].array_items())
+        {
+            jobs.push_back(interpret_json_as_batch_job(image_json, json, base_directory_path, output_directory_path, err));
+            if (!err.empty()) { throw std::runtime_error(manifest_file_path + ": image " + std::to_string(jobs.size() - 1) + ": " + err); }
+        }
+
+        return jobs;
+    }
+
+    BatchJob parse_batch_job(const std::string& json_text, std::string& error)
+    {
+        const auto json = Json::parse(json_text, error);
+        if (!error.empty()) { return BatchJob(); }
+        if (!json.is_object()) { error = "a job should be an object"; return BatchJob(); }
+
+        return interpret_json_as_batch_job(json, Json(), ".", "", error);
+    }
+
+    BatchProcessor::BatchProcessor(const bool          has_opaque_background,
+                                   const bool          force_smooth_background,
+                                   const int           target_concurrency,
+                                   const bool          use_active_set,
+                                   const double        skip_tolerance,
+                                   const UnmixingModel model) :
+    has_opaque_background_(has_opaque_background),
+    force_smooth_background_(force_smooth_background),
+    use_active_set_(use_active_set),
+    skip_tolerance_(skip_tolerance),
+    model_(model),
+    pool_(std::make_shared<WorkerPool>(target_concurrency))
+    {
+    }
+
+    BatchProcessor::~BatchProcessor()
+    {
+    }
+
+    std::shared_ptr<const BatchProcessor::LayerSpec> BatchProcessor::retrieve_layer_spec(const BatchJob& job)
+    {
+        // Layer infos given as texts are distinguished by their texts, which are already canonical (dumped by json11
+        // with sorted keys), and files by their paths and modification times
+        const bool        is_file = job.layer_infos_json.empty();
+        const std::string key     = is_file ? "file:" + job.layer_infos_path : "json:" + job.layer_infos_json;
+
+        std::int64_t modification_time = 0;
+        struct stat  status;
+        if (is_file && stat(job.layer_infos_path.c_str(), &status) == 0)
+        {
+            modification_time = static_cast<std::int64_t>(status.st_mtim.tv_sec) * 1000000000 + status.st_mtim.tv_nsec;
+        }
+
+        std::lock_guard<std::mutex> lock(layer_specs_mutex_);
+
+        const auto cached_layer_spec = layer_specs_.find(key);
+        if (cached_layer_spec != layer_specs_.end() && cached_layer_spec->second.modification_time == modification_time)
+        {
+            cached_layer_spec->second.last_use = ++ num_layer_spec_uses_;
+            return cached_layer_spec->second.layer_spec;
+        }
+
+        std::shared_ptr<LayerSpec> layer_spec = std::make_shared<LayerSpec>();
+        layer_spec->layer_infos = is_file ? import_layer_infos(job.layer_infos_path) : parse_layer_infos(job.layer_infos_json);
+
+        // The linear model is equivalent to compositing by "plus" with "LinearDodge"
+        const bool is_linear = model_ == UnmixingModel::Linear;
+        layer_spec->modes    = is_linear ? vector<BlendMode>(layer_spec->layer_infos.size(), BlendMode::LinearDodge) : extract_blend_modes(layer_spec->layer_infos);
+        layer_spec->comp_ops = is_linear ? vector<CompOp>(layer_spec->layer_infos.size(), CompOp::Plus()) : extract_comp_ops(layer_spec->layer_infos);
+        layer_spec->unmixer.reset(new RowUnmixer(layer_spec->layer_infos, has_opaque_background_, pool_, use_active_set_, model_, true));
+
+        // Evict the least recently used spec (jobs in progress keep using it until they finish)
+        if (cached_layer_spec == layer_specs_.end() && layer_specs_.size() >= static_cast<std::size_t>(max_num_layer_specs))
+        {
+            const auto compare_uses = [](const std::pair<const std::string, CachedLayerSpec>& left, const std::pair<const std::string, CachedLayerSpec>& right) { return left.second.last_use < right.second.last_use; };
+            layer_specs_.erase(std::min_element(layer_specs_.begin(), layer_specs_.end(), compare_uses));
+        }
+
+        CachedLayerSpec& entry = layer_specs_[key];
+        entry.layer_spec        = layer_spec;
+        entry.modification_time = modification_time;
+        entry.last_use          = ++ num_layer_spec_uses_;
+
+        return layer_spec;
+    }
+
+    ColorImage BatchProcessor::decode_image(const BatchJob& job, int target_concurrency) const
+    {
+        if (job.target_width > 0) { return ColorImage(job.input_image_path).get_scaled_image(job.target_width, ResamplingFilter::Lanczos3, target_concurrency); }
+        return ColorImage(job.input_image_path, 0, target_concurrency);
+    }
+
+    BatchProcessor::SolvedImage BatchProcessor::solve_image(ColorImage&& image, const BatchJob& job, const std::shared_ptr<const LayerSpec>& layer_spec_pointer, int target_concurrency) const
+    {
+        const LayerSpec& layer_spec = *layer_spec_pointer;
+
+        SolvedImage solved_image;
+        solved_image.layer_spec = layer_spec_pointer;
+
+        // The unmixing of each image is parallelized over its pixels by the shared pool
+        vector<ColorImage> layers = layer_spec.unmixer->unmix_image(image);
+
+        solved_image.refined_layers = perform_matte_refinement(image, layers, layer_spec.layer_infos, has_opaque_background_, force_smooth_background_, target_concurrency, skip_tolerance_, nullptr, model_);
+
+        if (job.export_verbosely)
+        {
+            solved_image.non_smoothed_composite = composite_layers(layers, layer_spec.comp_ops, layer_spec.modes, target_concurrency);
+            solved_image.composite              = composite_layers(solved_image.refined_layers, layer_spec.comp_ops, layer_spec.modes, target_concurrency);
+            solved_image.non_smoothed_layers    = std::move(layers);
+        }
+        vector<ColorImage>().swap(layers);
+
+        if (job.export_report)
+        {
+            if (job.export_verbosely) { solved_image.error_heatmap = Image(image.width(), image.height()); }
+            solved_image.report = compute_reconstruction_report(image, solved_image.refined_layers, layer_spec.comp_ops, layer_spec.modes, job.export_verbosely ? &solved_image.error_heatmap : nullptr, target_concurrency);
+        }
+
+        if (job.export_verbosely) { solved_image.image = std::move(image); }
+
+        return solved_image;
+    }
+
+    vector<std::string> BatchProcessor::encode_image(SolvedImage& solved_image, const BatchJob& job, int target_concurrency) const
+    {
+        const LayerSpec&   layer_spec = *solved_image.layer_spec;
+        const std::string& outdir     = job.output_directory_path;
+        const int          png_level  = job.png_compression_level;
+
+        create_directories(outdir);
+
+        if (job.export_verbosely)
+        {
+            export_layers(solved_image.non_smoothed_layers, outdir, "non-smoothed-layer", true, job.use_explicit_name, layer_spec.layer_infos, png_level, target_concurrency, job.crop_layers);
+            solved_image.non_smoothed_composite.save(outdir + "/non-smoothed-recomposited.png", png_level, target_concurrency);
+        }
+
+        vector<std::string> layer_file_paths;
+        if (job.use_layer_file)
+        {
+            const ColorImage& front = solved_image.refined_layers.front();
+
+            LayerFileWriter writer(outdir + "/layer.ulf", front.width(), front.height(), layer_spec.layer_infos);
+            writer.write_layers(solved_image.refined_layers, target_concurrency);
+            layer_file_paths.push_back(outdir + "/layer.ulf");
+        }
+        else
+        {
+            export_layers(solved_image.refined_layers, outdir, "layer", job.export_verbosely, job.use_explicit_name, layer_spec.layer_infos, png_level, target_concurrency, job.crop_layers);
+            for (int index = 0; index < solved_image.refined_layers.size(); ++ index)
+            {
+                const std::string suffix = job.use_explicit_name ? "_" + retrieve_name(layer_spec.layer_infos[index].blend_mode) : "";
+                layer_file_paths.push_back(outdir + "/layer_" + std::to_string(index) + suffix + ".png");
+            }
+        }
+
+        if (job.export_verbosely)
+        {
+            solved_image.image.save(outdir + "/input.png", png_level, target_concurrency);
+            solved_image.composite.save(outdir + "/recomposited.png", png_level, target_concurrency);
+            export_models(extract_color_models(layer_spec.layer_infos), outdir, "model");
+        }
+
+        if (job.export_report)
+        {
+            export_reconstruction_report(solved_image.report, outdir + "/report.json");
+            if (job.export_verbosely) { solved_image.error_heatmap.save(outdir + "/error-heatmap.png", png_level, target_concurrency); }
+        }
+
+        export_layer_infos(layer_spec.layer_infos, outdir);
+
+        return layer_file_paths;
+    }
+
+    vector<std::string> BatchProcessor::process(const BatchJob& job)
+    {
+        UNBLENDING_TRACE_SCOPE("process_batch_job", "stage");
+
+        const std::shared_ptr<const LayerSpec> layer_spec  = retrieve_layer_spec(job);
+        const int                              num_threads = pool_->get_num_threads();
+
+        SolvedImage solved_image = solve_image(decode_image(job, num_threads), job, layer_spec, num_threads);
+        return encode_image(solved_image, job, num_threads);
+    }
+
+    void BatchProcessor::process(const vector<BatchJob>& jobs, int num_concurrent_images, int queue_capacity)
+    {
+        UNBLENDING_TRACE_SCOPE("process_batch", "stage");
+
+        const int num_jobs              = static_cast<int>(jobs.size());
+        const int num_threads           = pool_->get_num_threads();
+        const int num_images_at_once    = std::max(1, std::min(num_jobs, (num_concurrent_images > 0) ? num_concurrent_images : num_threads));
+        const int per_image_concurrency = std::max(1, num_threads / num_images_at_once);
+
+        // Parse each layer infos file and set up its unmixer before the images start flowing (invalid ones are
+        // reported when their images are solved)
+        for (const BatchJob& job : jobs)
+        {
+            try { retrieve_layer_spec(job); }
+            catch (const std::exception&) {}
+        }
+
+        // A job that fails is reported and skipped, and the other jobs continue
+        auto report_error = [&](int job_index, const std::exception& exception)
+        {
+            std::cerr << "Error: " << jobs[job_index].input_image_path << ": " << exception.what() << std::endl;
+        };
+
+        // Images flow through three stages connected by bounded queues: image k + 1 is decoded while image k is
+        // solved, and the layers of image k - 1 are encoded and written in the background
+        BoundedQueue<DecodedImage>                decoded_images(queue_capacity);
+        BoundedQueue<std::pair<int, SolvedImage>> solved_images(queue_capacity);
+
+        auto decode_images = [&]()
+        {
+            for (int job_index = 0; job_index < num_jobs; ++ job_index)
+            {
+                UNBLENDING_TRACE_SCOPE_WITH_ARG("decode_batch_image", "io", job_index);
+
+                DecodedImage decoded_image;
+                decoded_image.job_index = job_index;
+                try { decoded_image.image = decode_image(jobs[job_index], per_image_concurrency); }
+                catch (const std::exception& exception) { report_error(job_index, exception); continue; }
+                decoded_images.push(std::move(decoded_image));
+            }
+            decoded_images.close();
+        };
+
+        std::atomic<int> num_active_solvers(num_images_at_once);
+        auto solve_images = [&]()
+        {
+            DecodedImage decoded_image;
+            while (decoded_images.pop(decoded_image))
+            {
+                UNBLENDING_TRACE_SCOPE_WITH_ARG("solve_batch_image", "stage", decoded_image.job_index);
+
+                const BatchJob& job = jobs[decoded_image.job_index];
+
+                SolvedImage solved_image;
+                try { solved_image = solve_image(std::move(decoded_image.image), job, retrieve_layer_spec(job), per_image_concurrency); }
+                catch (const std::exception& exception) { report_error(decoded_image.job_index, exception); continue; }
+                decoded_image.image = ColorImage(0, 0);
+
+                solved_images.push(std::make_pair(decoded_image.job_index, std::move(solved_image)));
+            }
+
+            // The last solver tells the encoders that no more images come
+            if (-- num_active_solvers == 0) { solved_images.close(); }
+        };
+
+        auto encode_images = [&]()
+        {
+            std::pair<int, SolvedImage> solved_image;
+            while (solved_images.pop(solved_image))
+            {
+                UNBLENDING_TRACE_SCOPE_WITH_ARG("encode_batch_image", "io", solved_image.first);
+
+                const BatchJob& job = jobs[solved_image.first];
+                try { encode_image(solved_image.second, job, per_image_concurrency); }
+                catch (const std::exception& exception) { report_error(solved_image.first, exception); }
+
+                solved_image.second = SolvedImage();
+            }
+        };
+
+        // Images are taken by the solvers (and the encoders) one by one, so a large image does not hold back the others
+        vector<std::thread> threads;
+        threads.emplace_back(decode_images);
+        for (int index = 0; index < num_images_at_once; ++ index) { threads.emplace_back(solve_images); }
+        for (int index = 0; index < num_images_at_once; ++ index) { threads.emplace_back(encode_images); }
+        for (std::thread& thread : threads) { thread.join(); }
+    }
+
+    void process_batch(const vector<BatchJob>& jobs,
+                       const bool              has_opaque_background,
+                       const bool              force_smooth_background,
+                       const int               num_concurrent_images,
+                       const int               target_concurrency,
+                       const bool              use_active_set,
+                       const double            skip_tolerance,
+                       const UnmixingModel     model,
+                       const int               queue_capacity)
+    {
+        BatchProcessor processor(has_opaque_background, force_smooth_background, target_concurrency, use_active_set, skip_tolerance, model);
+        processor.process(jobs, num_concurrent_images, queue_capacity);
+    }
+}
@@ -0,0 +1,240 @@
+#include <unblending/compositing.hpp>
+#include <unblending/unblending.hpp>
+#include <unblending/tracing.hpp>
+#include <algorithm>
+#include <parallel-util.hpp>
+
+namespace unblending
+{
+    using std::vector;
+
+    namespace
+    {
+        // Fixed-capacity arrays are used so that no heap allocation happens inside the kernels
+        using SpanArray     = Eigen::Array<double, Eigen::Dynamic, 1, Eigen::ColMajor, max_span_length, 1>;
+        using ArrayMap      = Eigen::Map<Eigen::ArrayXd>;
+        using ConstArrayMap = Eigen::Map<const Eigen::ArrayXd>;
+
+        // The same value as in composite_two_layers
+        constexpr double alpha_epsilon = 1e-12;
+
+        template <int X_, int Y_, int Z_>
+        struct StaticCompOp
+        {
+            StaticCompOp(const CompOp&) {}
+            double X() const { return X_; }
+            double Y() const { return Y_; }
+            double Z() const { return Z_; }
+        };
+
+        struct DynamicCompOp
+        {
+            DynamicCompOp(const CompOp& comp_op) : comp_op_(comp_op) {}
+            double X() const { return comp_op_.X; }
+            double Y() const { return comp_op_.Y; }
+            double Z() const { return comp_op_.Z; }
+            const CompOp comp_op_;
+        };
+
+        // The switch is resolved at compile time, so each instantiation contains only one expression
+        template <BlendMode mode>
+        void blend_span(const ConstArrayMap& s, const ArrayMap& d, SpanArray& f)
+        {
+            constexpr double e = blend_function_internal_epsilon;
+
+            switch (mode)
+            {
+                case BlendMode::Normal:
+                    f = s;
+                    break;
+                case BlendMode::Multiply:
+                    f = s * d;
+                    break;
+                case BlendMode::Screen:
+                    f = 1.0 - (1.0 - s) * (1.0 - d);
+                    break;
+                case BlendMode::Overlay:
+                    f = (d <= 0.5).select(2.0 * s * d, 1.0 - 2.0 * (1.0 - s) * (1.0 - d));
+                    break;
+                case BlendMode::Darken:
+                    f = (s < d).select(s, d);
+                    break;
+                case BlendMode::Lighten:
+                    f = (s < d).select(d, s);
+                    break;
+                case BlendMode::ColorDodge:
+                    f = (d < e).select(0.0, (1.0 - s < e).select(1.0, (d / (1.0 - s)).min(1.0)));
+                    break;
+                case BlendMode::ColorBurn:
+                    f = (1.0 - d < e).select(1.0, (s < e).select(0.0, 1.0 - ((1.0 - d) / s).min(1.0)));
+                    break;
+                case BlendMode::HardLight:
+                    f = (s <= 0.5).select(2.0 * s * d, 1.0 - 2.0 * (1.0 - s) * (1.0 - d));
+                    break;
+                case BlendMode::SoftLight:
+                    f = (d <= 0.25).select(((16.0 * d - 12.0) * d + 4.0) * d, d.sqrt());
+                    f = (s <= 0.5).select(d - (1.0 - 2.0 * s) * d * (1.0 - d), d + (2.0 * s - 1.0) * (f - d));
+                    break;
+                case BlendMode::Difference:
+                    f = (s - d).abs();
+                    break;
+                case BlendMode::Exclusion:
+                    f = s + d - 2.0 * s * d;
+                    break;
+                case BlendMode::LinearDodge:
+                    f = s + d;
+                    break;
+            }
+        }
+
+        // Composite a source span onto the destination span (i.e., the output arrays) in place
+        template <typename Op, BlendMode mode>
+        void composite_span_onto(const LayerSpan& source, const Op& op, const int length, double* r, double* g, double* b, double* a)
+        {
+            const ConstArrayMap a_s(source.a, length);
+            const ArrayMap      a_d(a, length);
+
+            const SpanArray w_sd  = a_s * a_d;
+            const SpanArray w_s   = op.Y() * a_s * (1.0 - a_d);
+            const SpanArray w_d   = op.Z() * a_d * (1.0 - a_s);
+            const SpanArray a_new = op.X() * w_sd + w_s + w_d;
+            const SpanArray scale = (a_new > alpha_epsilon).select(a_new.inverse(), 1.0);
+
+            SpanArray f(length);
+            for (auto channel : { std::make_pair(source.r, r), std::make_pair(source.g, g), std::make_pair(source.b, b) })
+            {
+                const ConstArrayMap c_s(channel.first, length);
+                const ArrayMap      c_d(channel.second, length);
+
+                blend_span<mode>(c_s, c_d, f);
+
+                ArrayMap(channel.second, length) = (f * w_sd + w_s * c_s + w_d * c_d) * scale;
+            }
+
+            ArrayMap(a, length) = a_new;
+        }
+
+        template <typename Op>
+        void composite_span_onto(const LayerSpan& source, const CompOp& comp_op, const BlendMode mode, const int length, double* r, double* g, double* b, double* a)
+        {
+            const Op op(comp_op);
+            switch (mode)
+            {
+                case BlendMode::Normal:      composite_span_onto<Op, BlendMode::Normal>     (source, op, length, r, g, b, a); break;
+                case BlendMode::Multiply:    composite_span_onto<Op, BlendMode::Multiply>   (source, op, length, r, g, b, a); break;
+                case BlendMode::Screen:      composite_span_onto<Op, BlendMode::Screen>     (source, op, length, r, g, b, a); break;
+                case BlendMode::Overlay:     composite_span_onto<Op, BlendMode::Overlay>    (source, op, length, r, g, b, a); break;
+                case BlendMode::Darken:      composite_span_onto<Op, BlendMode::Darken>     (source, op, length, r, g, b, a); break;
+                case BlendMode::Lighten:     composite_span_onto<Op, BlendMode::Lighten>    (source, op, length, r, g, b, a); break;
+                case BlendMode::ColorDodge:  composite_span_onto<Op, BlendMode::ColorDodge> (source, op, length, r, g, b, a); break;
+                case BlendMode::ColorBurn:   composite_span_onto<Op, BlendMode::ColorBurn>  (source, op, length, r, g, b, a); break;
+                case BlendMode::HardLight:   composite_span_onto<Op, BlendMode::HardLight>  (source, op, length, r, g, b, a); break;
+                case BlendMode::SoftLight:   composite_span_onto<Op, BlendMode::SoftLight>  (source, op, length, r, g, b, a); break;
+                case BlendMode::Difference:  composite_span_onto<Op, BlendMode::Difference> (source, op, length, r, g, b, a); break;
+                case BlendMode::Exclusion:   composite_span_onto<Op, BlendMode::Exclusion>  (source, op, length, r, g, b, a); break;
+                case BlendMode::LinearDodge: composite_span_onto<Op, BlendMode::LinearDodge>(source, op, length, r, g, b, a); break;
+                default:
+                    assert(false);
+            }
+        }
+
+        // A fully transparent source changes nothing as long as the destination is not (almost) transparent
+        bool can_skip(const LayerSpan& source, const CompOp& comp_op, const int length, const double* a)
+        {
+            if (source.a == nullptr) { return comp_op.Z == 1 && (ConstArrayMap(a, length) > alpha_epsilon).all(); }
+            return comp_op.Z == 1 && (ConstArrayMap(source.a, length) == 0.0).all() && (ConstArrayMap(a, length) > alpha_epsilon).all();
+        }
+    }
+
+    void composite_layer_spans(const LayerSpan*         spans,
+                               const vector<CompOp>&    comp_ops,
+                               const vector<BlendMode>& modes,
+                               const int                length,
+                               double*                  r,
+                               double*                  g,
+                               double*                  b,
+                               double*                  a)
+    {
+        const int num_layers = static_cast<int>(comp_ops.size());
+
+        assert(num_layers == modes.size());
+        assert(length > 0 && length <= max_span_length);
+
+        // Initialize the destination by the bottom layer
+        if (spans[0].a != nullptr)
+        {
+            std::copy(spans[0].r, spans[0].r + length, r);
+            std::copy(spans[0].g, spans[0].g + length, g);
+            std::copy(spans[0].b, spans[0].b + length, b);
+            std::copy(spans[0].a, spans[0].a + length, a);
+        }
+        else
+        {
+            for (double* channel : { r, g, b, a }) { std::fill(channel, channel + length, 0.0); }
+        }
+
+        for (int index = 1; index < num_layers; ++ index)
+        {
+            const LayerSpan& source  = spans[index];
+            const CompOp&    comp_op = comp_ops[index];
+
+            if (can_skip(source, comp_op, length, a)) { continue; }
+
+            // A transparent span that cannot be skipped is treated as an explicit zero-alpha span
+            static const double zeros[max_span_length] = {};
+            const LayerSpan effective_source = (source.a != nullptr) ? source : LayerSpan{ zeros, zeros, zeros, zeros };
+
+            if (comp_op.is_source_over())
+            {
+                composite_span_onto<StaticCompOp<1, 1, 1>>(effective_source, comp_op, modes[index], length, r, g, b, a);
+            }
+            else if (comp_op.is_plus())
+            {
+                composite_span_onto<StaticCompOp<2, 1, 1>>(effective_source, comp_op, modes[index], length, r, g, b, a);
+            }
+            else
+            {
+                composite_span_onto<DynamicCompOp>(effective_source, comp_op, modes[index], length, r, g, b, a);
+            }
+        }
+    }
+
+    ColorImage composite_layers(const vector<ColorImage>& layers,
+                                const vector<CompOp>&     comp_ops,
+                                const vector<BlendMode>&  modes,
+                                const int                 target_concurrency)
+    {
+        UNBLENDING_TRACE_SCOPE("composite_layers", "stage");
+
+        const int number = static_cast<int>(layers.size());
+        const int width  = layers.front().width();
+        const int height = layers.front().height();
+
+        ColorImage composited_image(width, height);
+
+        auto per_row_process = [&](int y)
+        {
+            vector<LayerSpan> spans(number);
+            for (int x = 0; x < width; x += max_span_length)
+            {
+                const int length = std::min(max_span_length, width - x);
+                const int offset = y * width + x;
+
+                for (int index = 0; index < number; ++ index) { spans[index] = make_layer_span(layers[index], x, y); }
+
+                composite_layer_spans(spans.data(),
+                                      comp_ops,
+                                      modes,
+                                      length,
+                                      composited_image.get_r().data() + offset,
+                                      composited_image.get_g().data() + offset,
+                                      composited_image.get_b().data() + offset,
+                                      composited_image.get_a().data() + offset);
+            }
+        };
+
+        parallelutil::parallel_for(height, per_row_process, target_concurrency);
+
+        return composited_image;
+    }
+}
@@ -1,8 +1,6 @@
 #include <unblending/equations.hpp>
 #include <unblending/color_model.hpp>
 
-//#define AKSOY_PERFORMANCE_TEST_OPTION
-
 namespace unblending
 {
     using std::vector;
@@ -37,17 +35,6 @@ namespace unblending
                           const vector<BlendMode>& modes,
                           const bool               crop)
     {
-#ifdef AKSOY_PERFORMANCE_TEST_OPTION
-        const int num_layers = alphas.rows();
-        Vec3   sum_color = Vec3::Zero();
-        double sum_alpha = 0.0;
-        for (int i = 0; i < num_layers; ++ i)
-        {
-            sum_color += alphas[i] * colors.segment<3>(i * 3);
-            sum_alpha += alphas[i];
-        }
-        return (Vec4() << sum_color, sum_alpha).finished();
-#else
         const int num_layers = static_cast<int>(alphas.rows());
         
         assert(num_layers == comp_ops.size());
@@ -70,7 +57,6 @@ namespace unblending
         }
         
         return (Vec4() << color, alpha).finished();
-#endif
     }
     
     double calculate_lagrange_term(const VecX& constraint_vector,
@@ -350,16 +336,6 @@ namespace unblending
         
         for (int i = 0; i < num_layers; ++ i)
         {
-#ifdef AKSOY_PERFORMANCE_TEST_OPTION
-            Mat4 i_th_derivative = Mat4::Zero();
-            i_th_derivative(0, 0) = alphas[i];
-            i_th_derivative(1, 1) = alphas[i];
-            i_th_derivative(2, 2) = alphas[i];
-            i_th_derivative(3, 0) = colors(3 * i + 0);
-            i_th_derivative(3, 1) = colors(3 * i + 1);
-            i_th_derivative(3, 2) = colors(3 * i + 2);
-            i_th_derivative(3, 3) = 1.0;
-#else
             const Mat4 i_th_derivative = calculate_derivative_of_k_th_composited_rgba_by_i_th_layer_rgba(alphas,
                                                                                                          colors,
                                                                                                          target_color,
@@ -367,7 +343,6 @@ namespace unblending
                                                                                                          modes,
                                                                                                          i,
                                                                                                          num_layers - 1);
-#endif
             
             if (use_target_alphas)
             {
@@ -1,9 +1,15 @@
 #include <unblending/image_processing.hpp>
+#include <unblending/instrumentation.hpp>
+#include <cmath>
+#include <stdexcept>
 #include <numeric>
 #include <cfloat>
 #include <thread>
 #include <Eigen/LU>
 #include <QImage>
+#include <QImageReader>
+#include <QBuffer>
+#include <QByteArray>
 #include <QColor>
 #include <tinycolormap.hpp>
 #include <parallel-util.hpp>
@@ -16,6 +22,40 @@ namespace unblending
         return std::max(std::min(x, max_x), min_x);
     }
 
+    namespace
+    {
+        // Convert the pixels of a QImage into the channels of a color image of the same size, scanline by scanline
+        // in parallel; each channel of a scanline is converted by a single (vectorizable) array expression
+        void convert_from_q_image(const QImage& source_image, ColorImage& image, int target_concurrency)
+        {
+            assert(source_image.width() == image.width() && source_image.height() == image.height());
+
+            // The byte order of this format is R, G, B, A regardless of the endianness
+            const QImage q_image = source_image.convertToFormat(QImage::Format_RGBA8888);
+
+            const int width = q_image.width();
+
+            Image* channels[] = { &image.get_r(), &image.get_g(), &image.get_b(), &image.get_a() };
+
+            auto convert_scanline = [&](int y)
+            {
+                const Eigen::Map<const Eigen::Array<uchar, 4, Eigen::Dynamic>> bytes(q_image.constScanLine(y), 4, width);
+                for (int i : { 0, 1, 2, 3 })
+                {
+                    Eigen::Map<Eigen::ArrayXd>(channels[i]->data() + y * width, width) = bytes.row(i).transpose().cast<double>() / 255.0;
+                }
+            };
+
+            parallelutil::parallel_for(q_image.height(), convert_scanline, target_concurrency);
+        }
+
+        // The PNG handler of Qt maps a quality q in [0, 100] into the compression level (100 - q) * 9 / 91
+        int calculate_png_quality(int png_compression_level)
+        {
+            return (png_compression_level >= 0) ? 100 - (std::min(png_compression_level, 9) * 91 + 8) / 9 : -1;
+        }
+    }
+
     void Image::force_unity()
     {
         const double sum = std::accumulate(pixels_.begin(), pixels_.end(), 0.0);
@@ -46,79 +86,156 @@ namespace unblending
 
     void Image::fill(const double value)
     {
-        pixels_ = std::vector<double>(width_ * height_, value);
+        pixels_.assign(width_ * height_, value);
     }
 
-    void AbstractImage::save(const std::string &file_path) const
+    Image Image::get_rows(int y_begin, int y_end) const
     {
-        QImage q_image(width(), height(), QImage::Format_ARGB32);
-        for (int x = 0; x < width(); ++ x) for (int y = 0; y < height(); ++ y)
+        assert(0 <= y_begin && y_begin < y_end && y_end <= height());
+
+        Image new_image(width(), y_end - y_begin);
+        std::copy(pixels_.begin() + y_begin * width(), pixels_.begin() + y_end * width(), new_image.pixels_.begin());
+        return new_image;
+    }
+
+    Image Image::get_region(const ImageRegion& region) const
+    {
+        assert(!region.is_empty());
+        assert(0 <= region.x && region.x + region.width <= width() && 0 <= region.y && region.y + region.height <= height());
+
+        Image new_image(region.width, region.height);
+        for (int y = 0; y < region.height; ++ y)
         {
-            const IntColor color = get_color(x, y);
-            q_image.setPixel(x, y, qRgba(color(0), color(1), color(2), color(3)));
+            const auto row_begin = pixels_.begin() + (region.y + y) * width() + region.x;
+            std::copy(row_begin, row_begin + region.width, new_image.pixels_.begin() + y * region.width);
         }
-        q_image.save(QString::fromStdString(file_path));
+        return new_image;
     }
 
-    AbstractImage::IntColor Image::get_color(int x, int y) const
+    void AbstractImage::save(const std::string &file_path, int png_compression_level, int target_concurrency) const
     {
-        const tinycolormap::ColormapType type = tinycolormap::ColormapType::Magma;
-        const tinycolormap::Color color = tinycolormap::GetColor(get_pixel(x, y), type);
-        return IntColor(color[0] * 255, color[1] * 255, color[2] * 255, 255);
+        UNBLENDING_TRACE_SCOPE("save_image", "io");
+
+        const bool is_png = file_path.size() >= 4 && file_path.compare(file_path.size() - 4, 4, ".png") == 0;
+
+        if (!convert_to_q_image(target_concurrency).save(QString::fromStdString(file_path), nullptr, is_png ? calculate_png_quality(png_compression_level) : -1))
+        {
+            throw std::runtime_error("cannot write " + file_path);
+        }
     }
 
-    AbstractImage::IntColor ColorImage::get_color(int x, int y) const
+    std::vector<std::uint8_t> AbstractImage::encode_as_png(int png_compression_level, int target_concurrency) const
     {
-        Eigen::Vector4d color = get_rgba(x, y);
-        for (int i : { 0, 1, 2, 3 }) color(i) = crop(color(i), 0.0, 1.0);
-        return IntColor(color(0) * 255, color(1) * 255, color(2) * 255, color(3) * 255);
+        UNBLENDING_TRACE_SCOPE("encode_image", "io");
+
+        QByteArray bytes;
+        QBuffer    buffer(&bytes);
+        buffer.open(QIODevice::WriteOnly);
+        convert_to_q_image(target_concurrency).save(&buffer, "PNG", calculate_png_quality(png_compression_level));
+
+        return std::vector<std::uint8_t>(bytes.constData(), bytes.constData() + bytes.size());
     }
 
-    ColorImage::ColorImage(const std::string &file_path)
+    QImage AbstractImage::convert_to_q_image(int target_concurrency) const
     {
-        QImage q_image(QString::fromStdString(file_path));
-        width_  = q_image.width();
-        height_ = q_image.height();
+        QImage q_image(width(), height(), QImage::Format_ARGB32);
 
-        assert(width() > 0 && height() > 0);
+        // The non-const accessors of QImage may detach its data, so the pointer is taken once before the workers
+        // start writing into it
+        uchar*    bits           = q_image.bits();
+        const int bytes_per_line = q_image.bytesPerLine();
 
-        rgba_ = std::vector<Image>(4, Image(width(), height()));
-        for (int x = 0; x < width(); ++ x) for (int y = 0; y < height(); ++ y)
+        auto convert_scanline = [&](int y)
         {
-            const QRgb q_color = q_image.pixel(x, y);
-            rgba_[0].set_pixel(x, y, qRed  (q_color) / 255.0);
-            rgba_[1].set_pixel(x, y, qGreen(q_color) / 255.0);
-            rgba_[2].set_pixel(x, y, qBlue (q_color) / 255.0);
-            rgba_[3].set_pixel(x, y, qAlpha(q_color) / 255.0);
-        }
+            convert_row_to_argb32(y, reinterpret_cast<std::uint32_t*>(bits + static_cast<std::size_t>(y) * bytes_per_line));
+        };
+        parallelutil::parallel_for(height(), convert_scanline, target_concurrency);
+
+        return q_image;
     }
 
-    ColorImage ColorImage::get_scaled_image(int target_width) const
+    void Image::convert_row_to_argb32(int y, std::uint32_t* pixels) const
     {
-        QImage q_image(width(), height(), QImage::Format_ARGB32);
-        for (int x = 0; x < width(); ++ x) for (int y = 0; y < height(); ++ y)
+        // The colormap is tabulated once; values are cropped into [0, 1] and looked up at the nearest entry
+        constexpr int table_size = 4096;
+        static const std::vector<std::uint32_t> colormap_table = []()
         {
-            const IntColor color = get_color(x, y);
-            q_image.setPixel(x, y, qRgba(color(0), color(1), color(2), color(3)));
-        }
+            std::vector<std::uint32_t> table(table_size);
+            for (int i = 0; i < table_size; ++ i)
+            {
+                const tinycolormap::Color color = tinycolormap::GetColor(static_cast<double>(i) / static_cast<double>(table_size - 1), tinycolormap::ColormapType::Magma);
+                table[i] = qRgba(color[0] * 255, color[1] * 255, color[2] * 255, 255);
+            }
+            return table;
+        }();
 
-        q_image = q_image.scaledToWidth(target_width, Qt::SmoothTransformation);
+        const Eigen::ArrayXi indices = (Eigen::Map<const Eigen::ArrayXd>(data() + y * width(), width()).max(0.0).min(1.0) * static_cast<double>(table_size - 1) + 0.5).cast<int>();
+        for (int x = 0; x < width(); ++ x) { pixels[x] = colormap_table[indices[x]]; }
+    }
 
-        ColorImage new_image(q_image.width(), q_image.height());
+    void ColorImage::convert_row_to_argb32(int y, std::uint32_t* pixels) const
+    {
+        using ArrayXu = Eigen::Array<std::uint32_t, Eigen::Dynamic, 1>;
 
-        for (int x = 0; x < q_image.width(); ++ x) for (int y = 0; y < q_image.height(); ++ y)
+        auto quantize = [&](int channel) -> ArrayXu
         {
-            const QRgb q_rgba = q_image.pixel(x, y);
-            const Eigen::Vector4d rgba
-            {
-                static_cast<double>(qRed  (q_rgba)) / 255.0,
-                static_cast<double>(qGreen(q_rgba)) / 255.0,
-                static_cast<double>(qBlue (q_rgba)) / 255.0,
-                static_cast<double>(qAlpha(q_rgba)) / 255.0
-            };
-            new_image.set_rgba(x, y, rgba);
+            const Eigen::Map<const Eigen::ArrayXd> values(rgba_[channel].data() + y * width(), width());
+            return (values.max(0.0).min(1.0) * 255.0).cast<int>().cast<std::uint32_t>();
+        };
+
+        Eigen::Map<ArrayXu>(pixels, width()) = quantize(3) * 0x01000000u + quantize(0) * 0x00010000u + quantize(1) * 0x00000100u + quantize(2);
+    }
+
+    ColorImage::ColorImage(const std::string &file_path, int target_width, int target_concurrency)
+    {
+        UNBLENDING_TRACE_SCOPE("decode_image", "io");
+
+        QImageReader reader(QString::fromStdString(file_path));
+
+        // Let the decoder scale the image if the original size is known in advance
+        const QSize size = reader.size();
+        if (target_width > 0 && size.isValid() && size.width() != target_width)
+        {
+            const int target_height = std::max(1, static_cast<int>(std::round(static_cast<double>(size.height()) * target_width / size.width())));
+            reader.setScaledSize(QSize(target_width, target_height));
         }
 
+        QImage q_image = reader.read();
+        if (target_width > 0 && q_image.width() != target_width)
+        {
+            q_image = q_image.scaledToWidth(target_width, Qt::SmoothTransformation);
+        }
+
+        if (q_image.isNull()) { throw std::runtime_error("cannot decode " + file_path + " (" + reader.errorString().toStdString() + ")"); }
+
+        *this = ColorImage(q_image, target_concurrency);
+    }
+
+    ColorImage::ColorImage(const QImage& q_image, int target_concurrency) : AbstractImage(q_image.width(), q_image.height())
+    {
+        rgba_ = std::vector<Image>(4, Image(width(), height()));
+        convert_from_q_image(q_image, *this, target_concurrency);
+    }
+
+    ColorImage ColorImage::get_scaled_image(int target_width, ResamplingFilter filter, int target_concurrency) const
+    {
+        assert(target_width > 0);
+
+        const int target_height = std::max(1, static_cast<int>(std::round(static_cast<double>(height()) * target_width / width())));
+        return resample_image(*this, target_width, target_height, filter, target_concurrency);
+    }
+
+    ColorImage ColorImage::get_rows(int y_begin, int y_end) const
+    {
+        ColorImage new_image(width(), y_end - y_begin);
+        for (int i : { 0, 1, 2, 3 }) new_image.rgba_[i] = rgba_[i].get_rows(y_begin, y_end);
+        return new_image;
+    }
+
+    ColorImage ColorImage::get_region(const ImageRegion& region) const
+    {
+        ColorImage new_image(region.width, region.height);
+        for (int i : { 0, 1, 2, 3 }) new_image.rgba_[i] = rgba_[i].get_region(region);
         return new_image;
     }
 
@@ -126,13 +243,17 @@ namespace unblending
     {
         std::vector<uint8_t> buffer(width() * height() * 4);
 
-        for (int y = 0; y < height(); ++ y) for (int x = 0; x < width(); ++ x)
+        std::vector<std::uint32_t> scanline(width());
+        for (int y = 0; y < height(); ++ y)
         {
-            const IntColor color = get_color(x, y);
-            buffer[4 * (y * width() + x) + 0] = static_cast<uint8_t>(color(0));
-            buffer[4 * (y * width() + x) + 1] = static_cast<uint8_t>(color(1));
-            buffer[4 * (y * width() + x) + 2] = static_cast<uint8_t>(color(2));
-            buffer[4 * (y * width() + x) + 3] = static_cast<uint8_t>(color(3));
+            convert_row_to_argb32(y, scanline.data());
+            for (int x = 0; x < width(); ++ x)
+            {
+                buffer[4 * (y * width() + x) + 0] = static_cast<uint8_t>(qRed  (scanline[x]));
+                buffer[4 * (y * width() + x) + 1] = static_cast<uint8_t>(qGreen(scanline[x]));
+                buffer[4 * (y * width() + x) + 2] = static_cast<uint8_t>(qBlue (scanline[x]));
+                buffer[4 * (y * width() + x) + 3] = static_cast<uint8_t>(qAlpha(scanline[x]));
+            }
         }
 
         return buffer;
@@ -272,8 +393,11 @@ namespace unblending
         return gradient_magnitude;
     }
 
-    Image apply_guided_filter(const Image& input_image, const ColorImage& guidance_image, int radius, double epsilon)
+    Image apply_guided_filter(const Image& input_image, const ColorImage& guidance_image, int radius, double epsilon, int target_concurrency)
     {
+        UNBLENDING_TRACE_SCOPE("apply_guided_filter", "filter");
+        StageScope scope("apply_guided_filter");
+
         const int width  = input_image.width();
         const int height = input_image.height();
 
@@ -284,26 +408,26 @@ namespace unblending
         const Image I_g = guidance_image.get_g();
         const Image I_b = guidance_image.get_b();
 
-        const Image mean_I_r = apply_box_filter(I_r, radius);
-        const Image mean_I_g = apply_box_filter(I_g, radius);
-        const Image mean_I_b = apply_box_filter(I_b, radius);
+        const Image mean_I_r = apply_box_filter(I_r, radius, target_concurrency);
+        const Image mean_I_g = apply_box_filter(I_g, radius, target_concurrency);
+        const Image mean_I_b = apply_box_filter(I_b, radius, target_concurrency);
 
-        const Image mean_p = apply_box_filter(input_image, radius);
+        const Image mean_p = apply_box_filter(input_image, radius, target_concurrency);
 
-        const Image mean_Ip_r = apply_box_filter((I_r * input_image), radius);
-        const Image mean_Ip_g = apply_box_filter((I_g * input_image), radius);
-        const Image mean_Ip_b = apply_box_filter((I_b * input_image), radius);
+        const Image mean_Ip_r = apply_box_filter((I_r * input_image), radius, target_concurrency);
+        const Image mean_Ip_g = apply_box_filter((I_g * input_image), radius, target_concurrency);
+        const Image mean_Ip_b = apply_box_filter((I_b * input_image), radius, target_concurrency);
 
         const Image cov_Ip_r = mean_Ip_r - (mean_I_r * mean_p);
         const Image cov_Ip_g = mean_Ip_g - (mean_I_g * mean_p);
         const Image cov_Ip_b = mean_Ip_b - (mean_I_b * mean_p);
 
-        const Image var_I_rr = apply_box_filter((I_r * I_r), radius) - (mean_I_r * mean_I_r);
-        const Image var_I_rg = apply_box_filter((I_r * I_g), radius) - (mean_I_r * mean_I_g);
-        const Image var_I_rb = apply_box_filter((I_r * I_b), radius) - (mean_I_r * mean_I_b);
-        const Image var_I_gg = apply_box_filter((I_g * I_g), radius) - (mean_I_g * mean_I_g);
-        const Image var_I_gb = apply_box_filter((I_g * I_b), radius) - (mean_I_g * mean_I_b);
-        const Image var_I_bb = apply_box_filter((I_b * I_b), radius) - (mean_I_b * mean_I_b);
+        const Image var_I_rr = apply_box_filter((I_r * I_r), radius, target_concurrency) - (mean_I_r * mean_I_r);
+        const Image var_I_rg = apply_box_filter((I_r * I_g), radius, target_concurrency) - (mean_I_r * mean_I_g);
+        const Image var_I_rb = apply_box_filter((I_r * I_b), radius, target_concurrency) - (mean_I_r * mean_I_b);
+        const Image var_I_gg = apply_box_filter((I_g * I_g), radius, target_concurrency) - (mean_I_g * mean_I_g);
+        const Image var_I_gb = apply_box_filter((I_g * I_b), radius, target_concurrency) - (mean_I_g * mean_I_b);
+        const Image var_I_bb = apply_box_filter((I_b * I_b), radius, target_concurrency) - (mean_I_b * mean_I_b);
 
         Image a_r(width, height);
         Image a_g(width, height);
@@ -325,11 +449,245 @@ namespace unblending
 
         const Image b = ((mean_p - (a_r * mean_I_r)) - (a_g * mean_I_g)) - (a_b * mean_I_b);
 
-        Image q = apply_box_filter(b, radius);
-        q = q + (apply_box_filter(a_r, radius) * I_r);
-        q = q + (apply_box_filter(a_g, radius) * I_g);
-        q = q + (apply_box_filter(a_b, radius) * I_b);
+        Image q = apply_box_filter(b, radius, target_concurrency);
+        q = q + (apply_box_filter(a_r, radius, target_concurrency) * I_r);
+        q = q + (apply_box_filter(a_g, radius, target_concurrency) * I_g);
+        q = q + (apply_box_filter(a_b, radius, target_concurrency) * I_b);
 
         return q;
     }
+
+    ImageRegion calculate_alpha_bounding_box(const ColorImage& image, double threshold, int target_concurrency)
+    {
+        const int width  = image.width();
+        const int height = image.height();
+
+        // The range [begin, end) of the columns of the pixels above the threshold in each row (empty if begin >= end)
+        std::vector<int> column_begins(height, width);
+        std::vector<int> column_ends(height, 0);
+
+        auto scan_row = [&](int y)
+        {
+            const double* alphas = image.get_a().data() + y * width;
+
+            int x_begin = 0;
+            while (x_begin < width && alphas[x_begin] < threshold) { ++ x_begin; }
+            if (x_begin == width) { return; }
+
+            int x_end = width;
+            while (alphas[x_end - 1] < threshold) { -- x_end; }
+
+            column_begins[y] = x_begin;
+            column_ends[y]   = x_end;
+        };
+        parallelutil::parallel_for(height, scan_row, target_concurrency);
+
+        ImageRegion region;
+        int x_begin = width, x_end = 0, y_begin = height, y_end = 0;
+        for (int y = 0; y < height; ++ y)
+        {
+            if (column_begins[y] >= column_ends[y]) { continue; }
+
+            x_begin = std::min(x_begin, column_begins[y]);
+            x_end   = std::max(x_end,   column_ends[y]);
+            y_begin = std::min(y_begin, y);
+            y_end   = y + 1;
+        }
+        if (y_begin < y_end)
+        {
+            region.x      = x_begin;
+            region.y      = y_begin;
+            region.width  = x_end - x_begin;
+            region.height = y_end - y_begin;
+        }
+        return region;
+    }
+
+    ///////////////////////////////////////////////////////////////////////////////////////
+
+    namespace
+    {
+        double evaluate_cubic_kernel(double x)
+        {
+            constexpr double a = - 0.5;
+
+            x = std::abs(x);
+            if (x < 1.0) { return ((a + 2.0) * x - (a + 3.0)) * x * x + 1.0; }
+            if (x < 2.0) { return (((x - 5.0) * x + 8.0) * x - 4.0) * a; }
+            return 0.0;
+        }
+
+        double evaluate_lanczos3_kernel(double x)
+        {
+            constexpr double pi = 3.14159265358979323846;
+
+            x = std::abs(x);
+            if (x < 1e-12) { return 1.0; }
+            if (x >= 3.0)  { return 0.0; }
+            return 3.0 * std::sin(pi * x) * std::sin(pi * x / 3.0) / (pi * pi * x * x);
+        }
+
+        // Weights of a one-dimensional resampling; the k-th tap of the i-th output refers to the input at
+        // indices[i * num_taps + k] (already clamped into the input range)
+        struct ResamplingWeights
+        {
+            int                 num_taps;
+            std::vector<int>    indices;
+            std::vector<double> weights;
+        };
+
+        ResamplingWeights calculate_resampling_weights(int input_size, int output_size, ResamplingFilter filter)
+        {
+            // Pixel j of the input covers [j, j + 1), and pixel i of the output covers [i / scale, (i + 1) / scale)
+            const double scale        = static_cast<double>(output_size) / static_cast<double>(input_size);
+            const double filter_scale = std::min(scale, 1.0);
+
+            const double support = [&]()
+            {
+                switch (filter)
+                {
+                    case ResamplingFilter::Area:     return 0.5 / scale;
+                    case ResamplingFilter::Bicubic:  return 2.0 / filter_scale;
+                    case ResamplingFilter::Lanczos3: return 3.0 / filter_scale;
+                }
+                return 0.0;
+            }();
+
+            ResamplingWeights result;
+            result.num_taps = static_cast<int>(std::ceil(2.0 * support)) + 1;
+            result.indices.resize(output_size * result.num_taps);
+            result.weights.resize(output_size * result.num_taps);
+
+            for (int i = 0; i < output_size; ++ i)
+            {
+                const double center = (static_cast<double>(i) + 0.5) / scale;
+                const int    first  = static_cast<int>(std::floor(center - support));
+
+                double sum = 0.0;
+                for (int k = 0; k < result.num_taps; ++ k)
+                {
+                    const int j = first + k;
+
+                    double weight = 0.0;
+                    switch (filter)
+                    {
+                        case ResamplingFilter::Area:
+                            weight = std::max(0.0, std::min(static_cast<double>(j + 1), center + support) - std::max(static_cast<double>(j), center - support));
+                            break;
+                        case ResamplingFilter::Bicubic:
+                            weight = evaluate_cubic_kernel((static_cast<double>(j) + 0.5 - center) * filter_scale);
+                            break;
+                        case ResamplingFilter::Lanczos3:
+                            weight = evaluate_lanczos3_kernel((static_cast<double>(j) + 0.5 - center) * filter_scale);
+                            break;
+                    }
+
+                    result.indices[i * result.num_taps + k] = crop(j, 0, input_size - 1);
+                    result.weights[i * result.num_taps + k] = weight;
+                    sum += weight;
+                }
+
+                assert(sum > 0.0);
+                for (int k = 0; k < result.num_taps; ++ k) { result.weights[i * result.num_taps + k] /= sum; }
+            }
+
+            return result;
+        }
+    }
+
+    Image resample_image(const Image& image, int target_width, int target_height, ResamplingFilter filter, int target_concurrency)
+    {
+        UNBLENDING_TRACE_SCOPE("resample_image", "filter");
+
+        assert(target_width > 0 && target_height > 0);
+
+        const int width  = image.width();
+        const int height = image.height();
+
+        const ResamplingWeights horizontal_weights = calculate_resampling_weights(width,  target_width,  filter);
+        const ResamplingWeights vertical_weights   = calculate_resampling_weights(height, target_height, filter);
+
+        // Horizontal pass
+        Image intermediate_image(target_width, height);
+        auto horizontal_process = [&](int y)
+        {
+            const double* input  = image.data() + y * width;
+            double*       output = intermediate_image.data() + y * target_width;
+
+            const int num_taps = horizontal_weights.num_taps;
+            for (int x = 0; x < target_width; ++ x)
+            {
+                double value = 0.0;
+                for (int k = 0; k < num_taps; ++ k)
+                {
+                    value += horizontal_weights.weights[x * num_taps + k] * input[horizontal_weights.indices[x * num_taps + k]];
+                }
+                output[x] = value;
+            }
+        };
+        parallelutil::parallel_for(height, horizontal_process, target_concurrency);
+
+        // Vertical pass (a weighted sum of rows)
+        Image new_image(target_width, target_height);
+        auto vertical_process = [&](int y)
+        {
+            Eigen::Map<Eigen::ArrayXd> output(new_image.data() + y * target_width, target_width);
+            output.setZero();
+
+            const int num_taps = vertical_weights.num_taps;
+            for (int k = 0; k < num_taps; ++ k)
+            {
+                const double weight = vertical_weights.weights[y * num_taps + k];
+                if (weight == 0.0) { continue; }
+
+                output += weight * Eigen::Map<const Eigen::ArrayXd>(intermediate_image.data() + vertical_weights.indices[y * num_taps + k] * target_width, target_width);
+            }
+        };
+        parallelutil::parallel_for(target_height, vertical_process, target_concurrency);
+
+        return new_image;
+    }
+
+    ColorImage resample_image(const ColorImage& image, int target_width, int target_height, ResamplingFilter filter, int target_concurrency)
+    {
+        constexpr double alpha_epsilon = 1e-12;
+
+        const int num_pixels        = image.width() * image.height();
+        const int num_target_pixels = target_width * target_height;
+
+        // Premultiply the colors by the alpha
+        Image premultiplied_channels[] = { image.get_r(), image.get_g(), image.get_b() };
+        const Eigen::Map<const Eigen::ArrayXd> alphas(image.get_a().data(), num_pixels);
+        for (Image& channel : premultiplied_channels) { Eigen::Map<Eigen::ArrayXd>(channel.data(), num_pixels) *= alphas; }
+
+        ColorImage new_image(target_width, target_height);
+        new_image.set_a(resample_image(image.get_a(), target_width, target_height, filter, target_concurrency));
+        new_image.set_r(resample_image(premultiplied_channels[0], target_width, target_height, filter, target_concurrency));
+        new_image.set_g(resample_image(premultiplied_channels[1], target_width, target_height, filter, target_concurrency));
+        new_image.set_b(resample_image(premultiplied_channels[2], target_width, target_height, filter, target_concurrency));
+
+        // Crop the values (the Lanczos and bicubic filters overshoot) and restore the straight colors
+        Eigen::Map<Eigen::ArrayXd> new_alphas(new_image.get_a().data(), num_target_pixels);
+        new_alphas = new_alphas.max(0.0).min(1.0);
+        for (Image* channel : { &new_image.get_r(), &new_image.get_g(), &new_image.get_b() })
+        {
+            Eigen::Map<Eigen::ArrayXd> colors(channel->data(), num_target_pixels);
+            colors = (new_alphas > alpha_epsilon).select(colors / new_alphas.max(alpha_epsilon), 0.0).max(0.0).min(1.0);
+        }
+
+        return new_image;
+    }
+
+    std::vector<ColorImage> build_image_pyramid(const ColorImage& image, int num_levels, ResamplingFilter filter, int target_concurrency)
+    {
+        assert(num_levels > 0);
+
+        std::vector<ColorImage> pyramid = { image };
+        while (static_cast<int>(pyramid.size()) < num_levels && (pyramid.back().width() > 1 || pyramid.back().height() > 1))
+        {
+            const ColorImage& level = pyramid.back();
+            pyramid.push_back(resample_image(level, (level.width() + 1) / 2, (level.height() + 1) / 2, filter, target_concurrency));
+        }
+        return pyramid;
+    }
 }
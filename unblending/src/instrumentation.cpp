@@ -0,0 +1,91 @@
+#include <unblending/instrumentation.hpp>
+#include <atomic>
+
+namespace unblending
+{
+    namespace
+    {
+        StageObserver       stage_observer;
+        StageBeginObserver  stage_begin_observer;
+        StageMemoryObserver stage_memory_observer;
+
+        std::atomic<std::size_t> image_memory_usage(0);
+        std::atomic<std::size_t> peak_image_memory_usage(0);
+
+        void update_peak(std::size_t bytes)
+        {
+            std::size_t peak = peak_image_memory_usage.load();
+            while (bytes > peak && !peak_image_memory_usage.compare_exchange_weak(peak, bytes)) {}
+        }
+    }
+
+    void internal::record_image_allocation(std::size_t bytes)
+    {
+        update_peak(image_memory_usage += bytes);
+    }
+
+    void internal::record_image_deallocation(std::size_t bytes)
+    {
+        image_memory_usage -= bytes;
+    }
+
+    std::size_t get_image_memory_usage()
+    {
+        return image_memory_usage;
+    }
+
+    std::size_t get_peak_image_memory_usage()
+    {
+        return peak_image_memory_usage;
+    }
+
+    void reset_peak_image_memory_usage()
+    {
+        peak_image_memory_usage = image_memory_usage.load();
+    }
+
+    void set_stage_observer(const StageObserver& observer)
+    {
+        stage_observer = observer;
+    }
+
+    void set_stage_begin_observer(const StageBeginObserver& observer)
+    {
+        stage_begin_observer = observer;
+    }
+
+    void set_stage_memory_observer(const StageMemoryObserver& observer)
+    {
+        stage_memory_observer = observer;
+    }
+
+    StageScope::StageScope(const char* name) : name_(name), is_observed_(stage_observer || stage_begin_observer || stage_memory_observer)
+    {
+        if (!is_observed_) { return; }
+
+        // Measure the peak of this scope from the current usage, and restore the peak of the outer scope later
+        if (stage_memory_observer)
+        {
+            outer_peak_bytes_ = peak_image_memory_usage;
+            reset_peak_image_memory_usage();
+        }
+
+        if (stage_begin_observer) { stage_begin_observer(name_); }
+        start_ = std::chrono::steady_clock::now();
+    }
+
+    StageScope::~StageScope()
+    {
+        if (!is_observed_) { return; }
+
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count();
+        if (stage_observer) { stage_observer(name_, seconds); }
+
+        if (stage_memory_observer)
+        {
+            const std::size_t peak_bytes = peak_image_memory_usage;
+            update_peak(outer_peak_bytes_);
+            stage_memory_observer(name_, peak_bytes);
+        }
+    }
+}
@@ -0,0 +1,201 @@
+#include <unblending/job_server.hpp>
+#include <unblending/tracing.hpp>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <system_error>
+#include <unistd.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <json11.hpp>
+
+namespace unblending
+{
+    using std::vector;
+    using json11::Json;
+
+    namespace
+    {
+        bool send_line(int connection_socket, const std::string& line)
+        {
+            const std::string data = line + "\n";
+            for (std::size_t offset = 0; offset < data.size();)
+            {
+                const ssize_t size = send(connection_socket, data.data() + offset, data.size() - offset, MSG_NOSIGNAL);
+                if (size <= 0) { return false; }
+                offset += static_cast<std::size_t>(size);
+            }
+            return true;
+        }
+
+        bool is_readable(const std::string& file_path)
+        {
+            return std::ifstream(file_path).good();
+        }
+    }
+
+    JobServer::JobServer(const std::string& socket_path, BatchProcessor& processor) :
+    socket_path_(socket_path),
+    processor_(processor)
+    {
+        sockaddr_un address;
+        std::memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if (socket_path.size() >= sizeof(address.sun_path)) { throw std::runtime_error("JobServer: the socket path " + socket_path + " is too long"); }
+        std::strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+
+        // Replace only a stale socket, so that a mistyped path does not delete an unrelated file
+        struct stat status;
+        if (lstat(socket_path.c_str(), &status) == 0)
+        {
+            if (!S_ISSOCK(status.st_mode)) { throw std::runtime_error("JobServer: " + socket_path + " exists and is not a socket"); }
+            if (unlink(socket_path.c_str()) != 0) { throw std::runtime_error("JobServer: cannot remove " + socket_path + " (" + std::strerror(errno) + ")"); }
+        }
+
+        listening_socket_ = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listening_socket_ < 0) { throw std::runtime_error(std::string("JobServer: cannot create a socket (") + std::strerror(errno) + ")"); }
+
+        // Only the owner can connect, since clients can read and write files with the permissions of the server
+        const mode_t original_mask = umask(0077);
+        const int    bind_result   = bind(listening_socket_, reinterpret_cast<const sockaddr*>(&address), sizeof(address));
+        umask(original_mask);
+        if (bind_result != 0)
+        {
+            const std::string reason = std::strerror(errno);
+            close(listening_socket_);
+            throw std::runtime_error("JobServer: cannot bind " + socket_path + " (" + reason + ")");
+        }
+
+        if (listen(listening_socket_, SOMAXCONN) != 0)
+        {
+            const std::string reason = std::strerror(errno);
+            close(listening_socket_);
+            unlink(socket_path.c_str());
+            throw std::runtime_error("JobServer: cannot listen on " + socket_path + " (" + reason + ")");
+        }
+    }
+
+    JobServer::~JobServer()
+    {
+        stop();
+        wait_for_connections();
+
+        close(listening_socket_);
+        unlink(socket_path_.c_str());
+    }
+
+    void JobServer::run()
+    {
+        while (!is_stopped_)
+        {
+            const int connection_socket = accept(listening_socket_, nullptr, nullptr);
+            if (connection_socket < 0)
+            {
+                if (is_stopped_ || errno == EINTR || errno == ECONNABORTED) { continue; }
+
+                // Other errors (e.g., running out of file descriptors) would recur immediately
+                const std::string reason = std::strerror(errno);
+                stop();
+                wait_for_connections();
+                throw std::runtime_error("JobServer: cannot accept connections (" + reason + ")");
+            }
+
+            std::lock_guard<std::mutex> lock(connections_mutex_);
+            if (is_stopped_) { close(connection_socket); break; }
+
+            connection_sockets_.insert(connection_socket);
+            try { std::thread(&JobServer::serve_connection, this, connection_socket).detach(); }
+            catch (const std::system_error&)
+            {
+                connection_sockets_.erase(connection_socket);
+                close(connection_socket);
+            }
+        }
+
+        // Wait for the jobs in progress
+        wait_for_connections();
+    }
+
+    void JobServer::wait_for_connections()
+    {
+        std::unique_lock<std::mutex> lock(connections_mutex_);
+        connections_condition_.wait(lock, [&]() { return connection_sockets_.empty(); });
+    }
+
+    void JobServer::stop()
+    {
+        std::lock_guard<std::mutex> lock(connections_mutex_);
+        if (is_stopped_.exchange(true)) { return; }
+
+        // Wake up the threads that wait in accept and recv
+        shutdown(listening_socket_, SHUT_RDWR);
+        for (const int connection_socket : connection_sockets_) { shutdown(connection_socket, SHUT_RDWR); }
+    }
+
+    void JobServer::serve_connection(int connection_socket)
+    {
+        std::string buffer;
+        char        chunk[4096];
+
+        bool is_open = true;
+        while (is_open)
+        {
+            const ssize_t size = recv(connection_socket, chunk, sizeof(chunk), 0);
+            if (size <= 0) { break; }
+            buffer.append(chunk, static_cast<std::size_t>(size));
+
+            // Process all the complete lines in the buffer
+            for (std::size_t line_end = buffer.find('\n'); is_open && line_end != std::string::npos; line_end = buffer.find('\n'))
+            {
+                const std::string line = buffer.substr(0, line_end);
+                buffer.erase(0, line_end + 1);
+
+                if (line.find_first_not_of(" \t\r") == std::string::npos) { continue; }
+
+                std::string err;
+                if (Json::parse(line, err)["command"].string_value() == "shutdown")
+                {
+                    send_line(connection_socket, Json(Json::object{ { "status", "ok" } }).dump());
+                    stop();
+                    is_open = false;
+                    break;
+                }
+
+                is_open = send_line(connection_socket, process_request(line));
+            }
+        }
+
+        // This is the last access to the server, which may be destroyed as soon as the lock is released
+        std::lock_guard<std::mutex> lock(connections_mutex_);
+        connection_sockets_.erase(connection_socket);
+        close(connection_socket);
+        connections_condition_.notify_all();
+    }
+
+    std::string JobServer::process_request(const std::string& request_line)
+    {
+        UNBLENDING_TRACE_SCOPE("process_request", "server");
+
+        std::string err;
+        const Json  request = Json::parse(request_line, err);
+
+        auto make_error_response = [&](const std::string& message)
+        {
+            return Json(Json::object{ { "id", request["id"] }, { "status", "error" }, { "message", message } }).dump();
+        };
+
+        const BatchJob job = parse_batch_job(request_line, err);
+        if (!err.empty()) { return make_error_response(err); }
+
+        if (!is_readable(job.input_image_path)) { return make_error_response("cannot read " + job.input_image_path); }
+
+        // Invalid images, layer infos, and outputs are reported by exceptions so that a bad request does not stop the server
+        vector<std::string> file_paths;
+        try { file_paths = processor_.process(job); }
+        catch (const std::exception& exception) { return make_error_response(exception.what()); }
+
+        return Json(Json::object{ { "id", request["id"] }, { "status", "ok" }, { "outdir", job.output_directory_path }, { "files", Json(file_paths) } }).dump();
+    }
+}
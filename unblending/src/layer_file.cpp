@@ -0,0 +1,227 @@
+#include <unblending/layer_file.hpp>
+#include <unblending/tracing.hpp>
+#include <cerrno>
+#include <limits>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <parallel-util.hpp>
+
+namespace unblending
+{
+    namespace
+    {
+        constexpr char          magic[8]  = { 'U', 'N', 'B', 'L', 'N', 'D', 'L', 'F' };
+        constexpr std::uint32_t version   = 1;
+        constexpr std::size_t   alignment = 64;
+
+        static_assert(sizeof(LayerFileHeader) == 48, "LayerFileHeader should not have padding");
+
+        std::size_t calculate_num_layer_values(int width, int height)
+        {
+            return static_cast<std::size_t>(width) * static_cast<std::size_t>(height) * 4;
+        }
+    }
+
+    LayerFileWriter::LayerFileWriter(const std::string&            file_path,
+                                     const int                     width,
+                                     const int                     height,
+                                     const std::vector<LayerInfo>& layer_infos,
+                                     const LayerFileLayout         layout) :
+    width_(width),
+    height_(height),
+    num_layers_(static_cast<int>(layer_infos.size())),
+    layout_(layout)
+    {
+        assert(width > 0 && height > 0);
+
+        const std::string json_text = serialize_layer_infos(layer_infos);
+
+        LayerFileHeader header;
+        std::memcpy(header.magic, magic, sizeof(magic));
+        header.version     = version;
+        header.layout      = static_cast<std::uint32_t>(layout);
+        header.width       = static_cast<std::uint32_t>(width);
+        header.height      = static_cast<std::uint32_t>(height);
+        header.num_layers  = static_cast<std::uint32_t>(num_layers_);
+        header.reserved    = 0;
+        header.json_size   = json_text.size();
+        header.data_offset = (sizeof(LayerFileHeader) + json_text.size() + alignment - 1) / alignment * alignment;
+
+        file_size_ = header.data_offset + calculate_num_layer_values(width, height) * num_layers_ * sizeof(float);
+
+        file_descriptor_ = open(file_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (file_descriptor_ < 0) { throw std::runtime_error("LayerFileWriter: cannot open " + file_path + " (" + std::strerror(errno) + ")"); }
+
+        // The partial file is removed if it cannot be allocated or mapped
+        auto fail = [&](const std::string& reason)
+        {
+            const std::string message = "LayerFileWriter: cannot " + reason + " " + file_path + " (" + std::strerror(errno) + ")";
+            close(file_descriptor_);
+            unlink(file_path.c_str());
+            throw std::runtime_error(message);
+        };
+
+        if (ftruncate(file_descriptor_, static_cast<off_t>(file_size_)) != 0) { fail("allocate"); }
+
+        void* mapped_data = mmap(nullptr, file_size_, PROT_READ | PROT_WRITE, MAP_SHARED, file_descriptor_, 0);
+        if (mapped_data == MAP_FAILED) { fail("map"); }
+
+        mapped_data_ = static_cast<std::uint8_t*>(mapped_data);
+        layer_data_  = reinterpret_cast<float*>(mapped_data_ + header.data_offset);
+
+        std::memcpy(mapped_data_, &header, sizeof(LayerFileHeader));
+        std::memcpy(mapped_data_ + sizeof(LayerFileHeader), json_text.data(), json_text.size());
+    }
+
+    LayerFileWriter::~LayerFileWriter()
+    {
+        munmap(mapped_data_, file_size_);
+        close(file_descriptor_);
+    }
+
+    float* LayerFileWriter::get_layer_data(int layer_index)
+    {
+        assert(0 <= layer_index && layer_index < num_layers_);
+        return layer_data_ + calculate_num_layer_values(width_, height_) * layer_index;
+    }
+
+    void LayerFileWriter::write_rows(int layer_index, int y_begin, const ColorImage& rows, int target_concurrency)
+    {
+        assert(rows.width() == width_);
+        assert(0 <= y_begin && y_begin + rows.height() <= height_);
+
+        float* layer_data = get_layer_data(layer_index);
+
+        const Image* channels[] = { &rows.get_r(), &rows.get_g(), &rows.get_b(), &rows.get_a() };
+
+        auto write_row = [&](int y)
+        {
+            if (layout_ == LayerFileLayout::Planar)
+            {
+                for (int i : { 0, 1, 2, 3 })
+                {
+                    float* plane = layer_data + static_cast<std::size_t>(width_) * height_ * i;
+                    Eigen::Map<Eigen::ArrayXf>(plane + static_cast<std::size_t>(y_begin + y) * width_, width_) = Eigen::Map<const Eigen::ArrayXd>(channels[i]->data() + y * width_, width_).cast<float>();
+                }
+            }
+            else
+            {
+                Eigen::Map<Eigen::Array<float, 4, Eigen::Dynamic>> pixels(layer_data + static_cast<std::size_t>(y_begin + y) * width_ * 4, 4, width_);
+                for (int i : { 0, 1, 2, 3 })
+                {
+                    pixels.row(i) = Eigen::Map<const Eigen::ArrayXd>(channels[i]->data() + y * width_, width_).cast<float>().transpose();
+                }
+            }
+        };
+        parallelutil::parallel_for(rows.height(), write_row, target_concurrency);
+    }
+
+    void LayerFileWriter::write_layers(const std::vector<ColorImage>& layers, int target_concurrency)
+    {
+        assert(layers.size() == num_layers_);
+
+        UNBLENDING_TRACE_SCOPE("write_layer_file", "io");
+
+        for (int index = 0; index < num_layers_; ++ index) { write_rows(index, 0, layers[index], target_concurrency); }
+    }
+
+    LayerFileReader::LayerFileReader(const std::string& file_path)
+    {
+        file_descriptor_ = open(file_path.c_str(), O_RDONLY);
+        if (file_descriptor_ < 0) { throw std::runtime_error("LayerFileReader: cannot open " + file_path + " (" + std::strerror(errno) + ")"); }
+
+        auto fail = [&](const std::string& reason)
+        {
+            if (mapped_data_ != nullptr) { munmap(const_cast<std::uint8_t*>(mapped_data_), file_size_); }
+            close(file_descriptor_);
+            throw std::runtime_error("LayerFileReader: " + file_path + " " + reason);
+        };
+
+        struct stat status;
+        if (fstat(file_descriptor_, &status) != 0) { fail("cannot be inspected"); }
+        file_size_ = static_cast<std::size_t>(status.st_size);
+        if (file_size_ < sizeof(LayerFileHeader)) { fail("is too small to be a layer file"); }
+
+        LayerFileHeader header;
+        if (pread(file_descriptor_, &header, sizeof(LayerFileHeader), 0) != static_cast<ssize_t>(sizeof(LayerFileHeader))) { fail("cannot be read"); }
+
+        // Validate the header before the data is accessed through the mapping
+        if (std::memcmp(header.magic, magic, sizeof(magic)) != 0) { fail("is not a layer file"); }
+        if (header.version != version) { fail("has an unsupported version " + std::to_string(header.version)); }
+        if (header.layout > static_cast<std::uint32_t>(LayerFileLayout::Interleaved)) { fail("has an unknown layout " + std::to_string(header.layout)); }
+
+        const std::uint32_t max_extent = static_cast<std::uint32_t>(std::numeric_limits<int>::max());
+        if (header.width == 0 || header.height == 0 || header.width > max_extent || header.height > max_extent || header.num_layers > max_extent) { fail("has an invalid size"); }
+
+        if (header.data_offset < sizeof(LayerFileHeader) || header.json_size > header.data_offset - sizeof(LayerFileHeader)) { fail("has an invalid JSON size"); }
+        if (header.data_offset % alignment != 0 || header.data_offset > file_size_) { fail("has an invalid data offset"); }
+
+        // Check that the pixels fit into the file without overflowing the products
+        const std::size_t available_size = file_size_ - header.data_offset;
+        const std::size_t pixel_size     = 4 * sizeof(float);
+        if (header.width > available_size / pixel_size / header.height) { fail("is truncated"); }
+        const std::size_t layer_size = static_cast<std::size_t>(header.width) * header.height * pixel_size;
+        if (header.num_layers > available_size / layer_size) { fail("is truncated"); }
+
+        const void* mapped_data = mmap(nullptr, file_size_, PROT_READ, MAP_SHARED, file_descriptor_, 0);
+        if (mapped_data == MAP_FAILED) { fail("cannot be mapped"); }
+        mapped_data_ = static_cast<const std::uint8_t*>(mapped_data);
+
+        width_      = static_cast<int>(header.width);
+        height_     = static_cast<int>(header.height);
+        num_layers_ = static_cast<int>(header.num_layers);
+        layout_     = static_cast<LayerFileLayout>(header.layout);
+        json_text_  = std::string(reinterpret_cast<const char*>(mapped_data_ + sizeof(LayerFileHeader)), header.json_size);
+        layer_data_ = reinterpret_cast<const float*>(mapped_data_ + header.data_offset);
+    }
+
+    LayerFileReader::~LayerFileReader()
+    {
+        munmap(const_cast<std::uint8_t*>(mapped_data_), file_size_);
+        close(file_descriptor_);
+    }
+
+    std::vector<LayerInfo> LayerFileReader::get_layer_infos() const
+    {
+        return parse_layer_infos(json_text_);
+    }
+
+    const float* LayerFileReader::get_layer_data(int layer_index) const
+    {
+        assert(0 <= layer_index && layer_index < num_layers_);
+        return layer_data_ + calculate_num_layer_values(width_, height_) * layer_index;
+    }
+
+    ColorImage LayerFileReader::get_layer(int layer_index, int target_concurrency) const
+    {
+        const float* layer_data = get_layer_data(layer_index);
+
+        ColorImage layer(width_, height_);
+        Image* channels[] = { &layer.get_r(), &layer.get_g(), &layer.get_b(), &layer.get_a() };
+
+        auto read_row = [&](int y)
+        {
+            for (int i : { 0, 1, 2, 3 })
+            {
+                Eigen::Map<Eigen::ArrayXd> values(channels[i]->data() + y * width_, width_);
+                if (layout_ == LayerFileLayout::Planar)
+                {
+                    const float* plane = layer_data + static_cast<std::size_t>(width_) * height_ * i;
+                    values = Eigen::Map<const Eigen::ArrayXf>(plane + static_cast<std::size_t>(y) * width_, width_).cast<double>();
+                }
+                else
+                {
+                    const Eigen::Map<const Eigen::Array<float, 4, Eigen::Dynamic>> pixels(layer_data + static_cast<std::size_t>(y) * width_ * 4, 4, width_);
+                    values = pixels.row(i).transpose().cast<double>();
+                }
+            }
+        };
+        parallelutil::parallel_for(height_, read_row, target_concurrency);
+
+        return layer;
+    }
+}
@@ -0,0 +1,154 @@
+#include <unblending/linear_unmixing.hpp>
+#include <unblending/color_model.hpp>
+#include <algorithm>
+#include <functional>
+#include <Eigen/LU>
+
+namespace unblending
+{
+    using std::vector;
+
+    namespace
+    {
+        constexpr int    max_iterations   = 100;
+        constexpr double alpha_tolerance  = 1e-06;
+        constexpr double armijo_parameter = 1e-04;
+        constexpr double min_step_size    = 1e-12;
+        constexpr double regularization   = 1e-12;
+
+        // Euclidean projection onto the probability simplex { x | x >= 0, sum(x) = 1 }
+        VecX project_onto_simplex(const VecX& v)
+        {
+            const int n = static_cast<int>(v.rows());
+
+            vector<double> u(v.data(), v.data() + n);
+            std::sort(u.begin(), u.end(), std::greater<double>());
+
+            double sum   = 0.0;
+            double theta = 0.0;
+            for (int j = 0; j < n; ++ j)
+            {
+                sum += u[j];
+                const double candidate = (sum - 1.0) / static_cast<double>(j + 1);
+                if (u[j] - candidate > 0.0) { theta = candidate; }
+            }
+
+            return (v.array() - theta).cwiseMax(0.0).matrix();
+        }
+    }
+
+    LinearUnmixingSolver::LinearUnmixingSolver(const vector<ColorModelPtr>& models)
+    {
+        for (const ColorModelPtr& model : models)
+        {
+            const GaussianColorModel* gaussian = dynamic_cast<const GaussianColorModel*>(model.get());
+            assert(gaussian != nullptr);
+
+            mus_.push_back(gaussian->get_mu());
+            sigmas_.push_back(gaussian->get_sigma());
+        }
+    }
+
+    double LinearUnmixingSolver::calculate_energy(const Vec3& target_color, const VecX& alphas, Vec3& y) const
+    {
+        const int num_layers = static_cast<int>(mus_.size());
+
+        Mat3 M = regularization * Mat3::Identity();
+        Vec3 r = target_color;
+        for (int index = 0; index < num_layers; ++ index)
+        {
+            M += alphas(index) * sigmas_[index];
+            r -= alphas(index) * mus_[index];
+        }
+
+        y = M.inverse() * r;
+
+        return r.dot(y);
+    }
+
+    VecX LinearUnmixingSolver::compose_solution(const VecX& alphas, const Vec3& y) const
+    {
+        const int num_layers = static_cast<int>(mus_.size());
+
+        VecX x(num_layers * 4);
+        x.segment(0, num_layers) = alphas;
+        for (int index = 0; index < num_layers; ++ index)
+        {
+            x.segment<3>(num_layers + index * 3) = crop_vec3(mus_[index] + sigmas_[index] * y);
+        }
+        return x;
+    }
+
+    VecX LinearUnmixingSolver::solve(const Vec3& target_color, PerPixelOptimizationCounts* counts) const
+    {
+        const int num_layers = static_cast<int>(mus_.size());
+
+        VecX   alphas = VecX::Constant(num_layers, 1.0 / static_cast<double>(num_layers));
+        Vec3   y;
+        double energy = calculate_energy(target_color, alphas, y);
+        double step   = 1.0;
+
+        int  num_iterations  = 0;
+        int  num_evaluations = 1;
+        bool is_converged    = false;
+
+        for (int iteration = 0; iteration < max_iterations; ++ iteration)
+        {
+            // Gradient of r^T M^{-1} r with respect to the alphas
+            VecX grad(num_layers);
+            for (int index = 0; index < num_layers; ++ index)
+            {
+                grad(index) = - 2.0 * mus_[index].dot(y) - y.dot(sigmas_[index] * y);
+            }
+
+            // Projected gradient step with backtracking line search
+            VecX   alphas_new;
+            Vec3   y_new;
+            double energy_new;
+            while (true)
+            {
+                alphas_new = project_onto_simplex(alphas - step * grad);
+                energy_new = calculate_energy(target_color, alphas_new, y_new);
+                ++ num_evaluations;
+
+                if (energy_new <= energy + armijo_parameter * grad.dot(alphas_new - alphas) || step < min_step_size) { break; }
+
+                step *= 0.5;
+            }
+
+            is_converged = (alphas_new - alphas).cwiseAbs().maxCoeff() < alpha_tolerance;
+
+            alphas = alphas_new;
+            energy = energy_new;
+            y      = y_new;
+
+            ++ num_iterations;
+
+            if (is_converged) { break; }
+
+            step *= 2.0;
+        }
+
+        if (counts != nullptr)
+        {
+            counts->num_iterations  += num_iterations;
+            counts->num_evaluations += num_evaluations;
+            counts->is_converged     = is_converged;
+        }
+
+        return compose_solution(alphas, y);
+    }
+
+    VecX LinearUnmixingSolver::solve_with_fixed_alphas(const Vec3& target_color, const VecX& alphas, PerPixelOptimizationCounts* counts) const
+    {
+        Vec3 y;
+        calculate_energy(target_color, alphas, y);
+
+        if (counts != nullptr)
+        {
+            counts->num_evaluations += 1;
+            counts->is_converged     = true;
+        }
+        return compose_solution(alphas, y);
+    }
+}
@@ -0,0 +1,337 @@
+#include <unblending/openraster.hpp>
+#include <unblending/tracing.hpp>
+#include <sstream>
+#include <fstream>
+#include <stdexcept>
+#include <algorithm>
+#include <parallel-util.hpp>
+
+namespace unblending
+{
+    using std::vector;
+
+    namespace
+    {
+        std::uint32_t calculate_crc32(const std::uint8_t* data, std::size_t size)
+        {
+            static const vector<std::uint32_t> table = []()
+            {
+                vector<std::uint32_t> table(256);
+                for (std::uint32_t i = 0; i < 256; ++ i)
+                {
+                    std::uint32_t value = i;
+                    for (int k = 0; k < 8; ++ k) { value = (value & 1) ? 0xedb88320u ^ (value >> 1) : value >> 1; }
+                    table[i] = value;
+                }
+                return table;
+            }();
+
+            std::uint32_t crc = 0xffffffffu;
+            for (std::size_t i = 0; i < size; ++ i) { crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8); }
+            return crc ^ 0xffffffffu;
+        }
+
+        std::string escape_xml(const std::string& text)
+        {
+            std::string escaped;
+            for (const char c : text)
+            {
+                switch (c)
+                {
+                    case '&':  escaped += "&amp;";  break;
+                    case '<':  escaped += "&lt;";   break;
+                    case '>':  escaped += "&gt;";   break;
+                    case '"':  escaped += "&quot;"; break;
+                    default:   escaped += c;        break;
+                }
+            }
+            return escaped;
+        }
+
+        // Writer of a ZIP archive whose entries are stored without compression
+        class StoredZipWriter
+        {
+        public:
+            StoredZipWriter(const std::string& file_path) : file_path_(file_path), file_(file_path, std::ios::binary)
+            {
+                if (!file_) { throw std::runtime_error("OpenRasterWriter: cannot open " + file_path_); }
+            }
+
+            void add_entry(const std::string& path, const std::uint8_t* data, std::size_t size, std::uint32_t crc)
+            {
+                // ZIP64 records are not written, so the archive (including its central directory) should fit in the
+                // 32-bit offsets and the 16-bit entry count
+                const std::size_t header_size = 30 + path.size();
+                if (size > max_zip_offset || offset_ + header_size + size > max_zip_offset || records_.size() + 1 > max_num_zip_entries || path.size() > max_num_zip_entries)
+                {
+                    throw std::runtime_error("OpenRasterWriter: " + file_path_ + " exceeds the size limit of ZIP (4 GiB)");
+                }
+
+                CentralDirectoryRecord record = { path, crc, static_cast<std::uint32_t>(size), static_cast<std::uint32_t>(offset_) };
+
+                // Local file header (version 1.0, no flags, stored, 1980-01-01 00:00)
+                std::string header;
+                append_32(header, 0x04034b50);
+                append_16(header, 10);
+                append_16(header, 0);
+                append_16(header, 0);
+                append_16(header, 0);
+                append_16(header, 0x21);
+                append_32(header, crc);
+                append_32(header, record.size);
+                append_32(header, record.size);
+                append_16(header, static_cast<std::uint16_t>(path.size()));
+                append_16(header, 0);
+                header += path;
+
+                file_.write(header.data(), header.size());
+                file_.write(reinterpret_cast<const char*>(data), size);
+                offset_ += header.size() + size;
+
+                records_.push_back(record);
+            }
+
+            void finish()
+            {
+                std::string directory;
+                for (const CentralDirectoryRecord& record : records_)
+                {
+                    append_32(directory, 0x02014b50);
+                    append_16(directory, 20);
+                    append_16(directory, 10);
+                    append_16(directory, 0);
+                    append_16(directory, 0);
+                    append_16(directory, 0);
+                    append_16(directory, 0x21);
+                    append_32(directory, record.crc);
+                    append_32(directory, record.size);
+                    append_32(directory, record.size);
+                    append_16(directory, static_cast<std::uint16_t>(record.path.size()));
+                    append_16(directory, 0);
+                    append_16(directory, 0);
+                    append_16(directory, 0);
+                    append_16(directory, 0);
+                    append_32(directory, 0);
+                    append_32(directory, record.offset);
+                    directory += record.path;
+                }
+
+                if (offset_ + directory.size() > max_zip_offset) { throw std::runtime_error("OpenRasterWriter: " + file_path_ + " exceeds the size limit of ZIP (4 GiB)"); }
+
+                // End of central directory record
+                std::string end_record;
+                append_32(end_record, 0x06054b50);
+                append_16(end_record, 0);
+                append_16(end_record, 0);
+                append_16(end_record, static_cast<std::uint16_t>(records_.size()));
+                append_16(end_record, static_cast<std::uint16_t>(records_.size()));
+                append_32(end_record, static_cast<std::uint32_t>(directory.size()));
+                append_32(end_record, static_cast<std::uint32_t>(offset_));
+                append_16(end_record, 0);
+
+                file_.write(directory.data(), directory.size());
+                file_.write(end_record.data(), end_record.size());
+                file_.close();
+
+                if (!file_) { throw std::runtime_error("OpenRasterWriter: cannot write into " + file_path_); }
+            }
+
+        private:
+            struct CentralDirectoryRecord
+            {
+                std::string   path;
+                std::uint32_t crc;
+                std::uint32_t size;
+                std::uint32_t offset;
+            };
+
+            static constexpr std::size_t max_zip_offset      = 0xffffffffu;
+            static constexpr std::size_t max_num_zip_entries = 0xffffu;
+
+            std::string                    file_path_;
+            std::ofstream                  file_;
+            std::size_t                    offset_ = 0;
+            vector<CentralDirectoryRecord> records_;
+
+            // Values are stored in the little-endian order
+            static void append_16(std::string& buffer, std::uint16_t value)
+            {
+                for (int i = 0; i < 2; ++ i) { buffer += static_cast<char>((value >> (8 * i)) & 0xff); }
+            }
+
+            static void append_32(std::string& buffer, std::uint32_t value)
+            {
+                for (int i = 0; i < 4; ++ i) { buffer += static_cast<char>((value >> (8 * i)) & 0xff); }
+            }
+        };
+    }
+
+    std::string retrieve_openraster_composite_op(BlendMode mode)
+    {
+        switch (mode)
+        {
+            case BlendMode::Normal:      return "svg:src-over";
+            case BlendMode::Multiply:    return "svg:multiply";
+            case BlendMode::Screen:      return "svg:screen";
+            case BlendMode::Overlay:     return "svg:overlay";
+            case BlendMode::Darken:      return "svg:darken";
+            case BlendMode::Lighten:     return "svg:lighten";
+            case BlendMode::ColorDodge:  return "svg:color-dodge";
+            case BlendMode::ColorBurn:   return "svg:color-burn";
+            case BlendMode::HardLight:   return "svg:hard-light";
+            case BlendMode::SoftLight:   return "svg:soft-light";
+            case BlendMode::Difference:  return "svg:difference";
+            case BlendMode::Exclusion:   return "svg:exclusion";
+            case BlendMode::LinearDodge: return "svg:plus";
+            default:
+                assert(false);
+                return "";
+        }
+    }
+
+    OpenRasterWriter::OpenRasterWriter(const std::string& file_path, int width, int height, int png_compression_level, int target_concurrency) :
+    file_path_(file_path),
+    width_(width),
+    height_(height),
+    png_compression_level_(png_compression_level),
+    target_concurrency_(target_concurrency)
+    {
+    }
+
+    OpenRasterWriter::~OpenRasterWriter()
+    {
+        // Errors cannot be reported from the destructor; call close explicitly to get them
+        if (!is_closed_) { try { close(); } catch (const std::exception&) {} }
+    }
+
+    void OpenRasterWriter::add_layers(const vector<ColorImage>& layers,
+                                      const std::string&        name_prefix,
+                                      const vector<BlendMode>&  modes,
+                                      const bool                is_visible,
+                                      const bool                with_alpha_channel,
+                                      const bool                crop_to_alpha_bounding_box)
+    {
+        assert(modes.size() == layers.size());
+
+        const int number = static_cast<int>(layers.size());
+
+        // Crop the layers but not the opaque alpha images (see export_layers); the cropped images are kept until they
+        // are encoded
+        vector<ImageRegion> regions(number);
+        vector<ColorImage>  cropped_layers;
+        for (int index = 0; index < number; ++ index)
+        {
+            if (!crop_to_alpha_bounding_box) { continue; }
+
+            regions[index] = calculate_alpha_bounding_box(layers[index], 1.0 / 255.0, target_concurrency_);
+            if (regions[index].is_empty()) { regions[index].width = regions[index].height = 1; }
+            cropped_layers.push_back(layers[index].get_region(regions[index]));
+        }
+        const vector<ColorImage>& source_layers = crop_to_alpha_bounding_box ? cropped_layers : layers;
+
+        vector<StackItem>            items;
+        vector<const AbstractImage*> images;
+        for (int index = 0; index < number; ++ index)
+        {
+            items.push_back({ name_prefix + "_" + std::to_string(index), "", retrieve_openraster_composite_op(modes[index]), is_visible, regions[index].x, regions[index].y });
+            images.push_back(&source_layers[index]);
+        }
+        if (with_alpha_channel)
+        {
+            for (int index = 0; index < number; ++ index)
+            {
+                items.push_back({ name_prefix + "-alpha_" + std::to_string(index), "", "svg:src-over", false, 0, 0 });
+                images.push_back(&layers[index].get_a());
+            }
+        }
+        add_stack_items(items, images);
+    }
+
+    void OpenRasterWriter::add_image(const std::string& name, const AbstractImage& image, bool is_visible)
+    {
+        add_stack_items({ { name, "", "svg:src-over", is_visible, 0, 0 } }, { &image });
+    }
+
+    void OpenRasterWriter::set_merged_image(const ColorImage& image)
+    {
+        // The thumbnail should fit in 256 x 256
+        const double     scale     = std::min(1.0, 256.0 / static_cast<double>(std::max(image.width(), image.height())));
+        const ColorImage thumbnail = resample_image(image, std::max(1, static_cast<int>(image.width() * scale)), std::max(1, static_cast<int>(image.height() * scale)), ResamplingFilter::Area, target_concurrency_);
+
+        for (const auto& file : { std::make_pair("mergedimage.png", &image), std::make_pair("Thumbnails/thumbnail.png", &thumbnail) })
+        {
+            const vector<std::uint8_t> data = file.second->encode_as_png(png_compression_level_, target_concurrency_);
+            other_entries_.push_back({ file.first, data, calculate_crc32(data.data(), data.size()) });
+        }
+    }
+
+    void OpenRasterWriter::add_file(const std::string& path, const std::string& content)
+    {
+        const vector<std::uint8_t> data(content.begin(), content.end());
+        other_entries_.push_back({ path, data, calculate_crc32(data.data(), data.size()) });
+    }
+
+    void OpenRasterWriter::add_stack_items(const vector<StackItem>& items, const vector<const AbstractImage*>& images)
+    {
+        assert(!is_closed_);
+
+        UNBLENDING_TRACE_SCOPE("encode_openraster_layers", "export");
+
+        const int num_existing_items = static_cast<int>(stack_.size());
+        const int num_items          = static_cast<int>(items.size());
+
+        stack_.insert(stack_.end(), items.begin(), items.end());
+        layer_entries_.resize(num_existing_items + num_items);
+
+        // Each image is encoded (and its checksum is calculated) by a single thread
+        auto encode_image = [&](int index)
+        {
+            StackItem& item  = stack_[num_existing_items + index];
+            Entry&     entry = layer_entries_[num_existing_items + index];
+
+            item.path  = "data/layer" + std::to_string(num_existing_items + index) + ".png";
+            entry.path = item.path;
+            entry.data = images[index]->encode_as_png(png_compression_level_, 1);
+            entry.crc  = calculate_crc32(entry.data.data(), entry.data.size());
+        };
+        parallelutil::queue_based_parallel_for(num_items, encode_image, target_concurrency_);
+    }
+
+    void OpenRasterWriter::close()
+    {
+        assert(!is_closed_);
+
+        UNBLENDING_TRACE_SCOPE("write_openraster", "io");
+
+        // The file is not written again (by the destructor) even if this fails
+        is_closed_ = true;
+
+        // The topmost layer comes first in the stack
+        std::ostringstream stack_xml;
+        stack_xml << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n";
+        stack_xml << "<image version=\"0.0.5\" w=\"" << width_ << "\" h=\"" << height_ << "\">\n";
+        stack_xml << "  <stack>\n";
+        for (auto item = stack_.rbegin(); item != stack_.rend(); ++ item)
+        {
+            stack_xml << "    <layer name=\"" << escape_xml(item->name) << "\" src=\"" << item->path << "\" x=\"" << item->x << "\" y=\"" << item->y << "\" opacity=\"1.0\" visibility=\"" << (item->is_visible ? "visible" : "hidden") << "\" composite-op=\"" << item->composite_op << "\"/>\n";
+        }
+        stack_xml << "  </stack>\n";
+        stack_xml << "</image>\n";
+
+        const std::string mimetype = "image/openraster";
+        const std::string stack    = stack_xml.str();
+
+        StoredZipWriter writer(file_path_);
+
+        // The mimetype should be the first entry (and stored without compression)
+        const vector<std::uint8_t> mimetype_data(mimetype.begin(), mimetype.end());
+        const vector<std::uint8_t> stack_data(stack.begin(), stack.end());
+        writer.add_entry("mimetype", mimetype_data.data(), mimetype_data.size(), calculate_crc32(mimetype_data.data(), mimetype_data.size()));
+        writer.add_entry("stack.xml", stack_data.data(), stack_data.size(), calculate_crc32(stack_data.data(), stack_data.size()));
+
+        for (const Entry& entry : layer_entries_) { writer.add_entry(entry.path, entry.data.data(), entry.data.size(), entry.crc); }
+        for (const Entry& entry : other_entries_) { writer.add_entry(entry.path, entry.data.data(), entry.data.size(), entry.crc); }
+
+        writer.finish();
+    }
+}
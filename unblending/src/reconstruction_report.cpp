@@ -0,0 +1,239 @@
+#include <unblending/reconstruction_report.hpp>
+#include <unblending/sparse_layer.hpp>
+#include <unblending/compositing.hpp>
+#include <unblending/tracing.hpp>
+#include <cmath>
+#include <limits>
+#include <fstream>
+#include <stdexcept>
+#include <algorithm>
+#include <json11.hpp>
+#include <parallel-util.hpp>
+
+namespace unblending
+{
+    using std::vector;
+    using json11::Json;
+
+    namespace
+    {
+        using SpanArray     = Eigen::Array<double, Eigen::Dynamic, 1, Eigen::ColMajor, max_span_length, 1>;
+        using ConstArrayMap = Eigen::Map<const Eigen::ArrayXd>;
+
+        // Alpha values that are quantized to 0 or 255 in 8-bit images
+        constexpr double coverage_epsilon = 0.5 / 255.0;
+
+        struct RowStatistics
+        {
+            double squared_error_sum = 0.0;
+            double error_sum         = 0.0;
+            double max_error         = - 1.0;
+            int    max_error_x       = 0;
+
+            vector<double> alpha_sums;
+            vector<int>    transparent_counts;
+            vector<int>    opaque_counts;
+        };
+
+        // Evaluate the reconstruction with the spans given by get_span(index, x, y), which should be valid for
+        // segment_length pixels from every x that is a multiple of segment_length
+        template <typename GetSpan>
+        ReconstructionReport evaluate_reconstruction(const ColorImage&        image,
+                                                     const int                number,
+                                                     const int                segment_length,
+                                                     GetSpan                  get_span,
+                                                     const vector<CompOp>&    comp_ops,
+                                                     const vector<BlendMode>& modes,
+                                                     Image*                   error_heatmap,
+                                                     const int                target_concurrency)
+        {
+            const int width  = image.width();
+            const int height = image.height();
+
+            assert(number > 0);
+            assert(segment_length > 0 && segment_length <= max_span_length);
+            assert(error_heatmap == nullptr || (error_heatmap->width() == width && error_heatmap->height() == height));
+
+            vector<RowStatistics> row_statistics(height);
+
+            auto per_row_process = [&](int y)
+            {
+                RowStatistics& statistics = row_statistics[y];
+                statistics.alpha_sums         = vector<double>(number, 0.0);
+                statistics.transparent_counts = vector<int>(number, 0);
+                statistics.opaque_counts      = vector<int>(number, 0);
+
+                vector<LayerSpan> spans(number);
+                double r[max_span_length];
+                double g[max_span_length];
+                double b[max_span_length];
+                double a[max_span_length];
+
+                for (int x = 0; x < width; x += segment_length)
+                {
+                    const int length = std::min(segment_length, width - x);
+                    const int offset = y * width + x;
+
+                    for (int index = 0; index < number; ++ index) { spans[index] = get_span(index, x, y); }
+
+                    composite_layer_spans(spans.data(), comp_ops, modes, length, r, g, b, a);
+
+                    // Per-pixel error
+                    const SpanArray diff_r = ConstArrayMap(r, length) - ConstArrayMap(image.get_r().data() + offset, length);
+                    const SpanArray diff_g = ConstArrayMap(g, length) - ConstArrayMap(image.get_g().data() + offset, length);
+                    const SpanArray diff_b = ConstArrayMap(b, length) - ConstArrayMap(image.get_b().data() + offset, length);
+                    const SpanArray diff_a = ConstArrayMap(a, length) - ConstArrayMap(image.get_a().data() + offset, length);
+
+                    const SpanArray squared_error = diff_r.square() + diff_g.square() + diff_b.square() + diff_a.square();
+                    const SpanArray error         = squared_error.sqrt();
+
+                    statistics.squared_error_sum += squared_error.sum();
+                    statistics.error_sum         += error.sum();
+
+                    int index_of_max;
+                    const double max_error = error.maxCoeff(&index_of_max);
+                    if (max_error > statistics.max_error)
+                    {
+                        statistics.max_error   = max_error;
+                        statistics.max_error_x = x + index_of_max;
+                    }
+
+                    if (error_heatmap != nullptr)
+                    {
+                        std::copy(error.data(), error.data() + length, error_heatmap->data() + offset);
+                    }
+
+                    // Per-layer alpha coverage
+                    for (int index = 0; index < number; ++ index)
+                    {
+                        // A span without pixels is fully transparent
+                        if (spans[index].a == nullptr) { statistics.transparent_counts[index] += length; continue; }
+
+                        const ConstArrayMap alpha(spans[index].a, length);
+
+                        statistics.alpha_sums[index]         += alpha.sum();
+                        statistics.transparent_counts[index] += static_cast<int>((alpha < coverage_epsilon).count());
+                        statistics.opaque_counts[index]      += static_cast<int>((alpha > 1.0 - coverage_epsilon).count());
+                    }
+                }
+            };
+
+            parallelutil::parallel_for(height, per_row_process, target_concurrency);
+
+            // Reduce the row statistics
+            double squared_error_sum = 0.0;
+            double error_sum         = 0.0;
+
+            ReconstructionReport report;
+            report.width       = width;
+            report.height      = height;
+            report.max_error   = - 1.0;
+            report.max_error_x = 0;
+            report.max_error_y = 0;
+
+            vector<double> alpha_sums(number, 0.0);
+            vector<double> transparent_counts(number, 0.0);
+            vector<double> opaque_counts(number, 0.0);
+
+            for (int y = 0; y < height; ++ y)
+            {
+                const RowStatistics& statistics = row_statistics[y];
+
+                squared_error_sum += statistics.squared_error_sum;
+                error_sum         += statistics.error_sum;
+
+                if (statistics.max_error > report.max_error)
+                {
+                    report.max_error   = statistics.max_error;
+                    report.max_error_x = statistics.max_error_x;
+                    report.max_error_y = y;
+                }
+
+                for (int index = 0; index < number; ++ index)
+                {
+                    alpha_sums[index]         += statistics.alpha_sums[index];
+                    transparent_counts[index] += statistics.transparent_counts[index];
+                    opaque_counts[index]      += statistics.opaque_counts[index];
+                }
+            }
+
+            const double num_pixels = static_cast<double>(width) * static_cast<double>(height);
+            const double mse        = squared_error_sum / (4.0 * num_pixels);
+
+            report.rmse       = std::sqrt(mse);
+            report.psnr       = (mse > 0.0) ? - 10.0 * std::log10(mse) : std::numeric_limits<double>::infinity();
+            report.mean_error = error_sum / num_pixels;
+
+            for (int index = 0; index < number; ++ index)
+            {
+                report.layer_coverages.push_back(LayerCoverage{ alpha_sums[index] / num_pixels, transparent_counts[index] / num_pixels, opaque_counts[index] / num_pixels });
+            }
+
+            return report;
+        }
+    }
+
+    ReconstructionReport compute_reconstruction_report(const ColorImage&         image,
+                                                       const vector<ColorImage>& layers,
+                                                       const vector<CompOp>&     comp_ops,
+                                                       const vector<BlendMode>&  modes,
+                                                       Image*                    error_heatmap,
+                                                       const int                 target_concurrency)
+    {
+        UNBLENDING_TRACE_SCOPE("compute_reconstruction_report", "stage");
+
+        assert(layers.front().width() == image.width() && layers.front().height() == image.height());
+
+        auto get_span = [&](int index, int x, int y) { return make_layer_span(layers[index], x, y); };
+        return evaluate_reconstruction(image, static_cast<int>(layers.size()), max_span_length, get_span, comp_ops, modes, error_heatmap, target_concurrency);
+    }
+
+    ReconstructionReport compute_reconstruction_report(const ColorImage&          image,
+                                                       const vector<SparseLayer>& layers,
+                                                       const vector<CompOp>&      comp_ops,
+                                                       const vector<BlendMode>&   modes,
+                                                       Image*                     error_heatmap,
+                                                       const int                  target_concurrency)
+    {
+        UNBLENDING_TRACE_SCOPE("compute_reconstruction_report", "stage");
+
+        assert(layers.front().width() == image.width() && layers.front().height() == image.height());
+
+        auto get_span = [&](int index, int x, int y) { return layers[index].get_span(x, y); };
+        return evaluate_reconstruction(image, static_cast<int>(layers.size()), layers.front().get_tile_size(), get_span, comp_ops, modes, error_heatmap, target_concurrency);
+    }
+
+    void export_reconstruction_report(const ReconstructionReport& report,
+                                      const std::string&          file_path)
+    {
+        vector<Json> layers_json;
+        for (const LayerCoverage& coverage : report.layer_coverages)
+        {
+            layers_json.push_back(Json::object
+            {
+                { "mean_alpha",        coverage.mean_alpha },
+                { "transparent_ratio", coverage.transparent_ratio },
+                { "opaque_ratio",      coverage.opaque_ratio }
+            });
+        }
+
+        // JSON does not have infinity; an exact reconstruction is written as null
+        const Json psnr_json = std::isfinite(report.psnr) ? Json(report.psnr) : Json(nullptr);
+
+        const Json json_object = Json::object
+        {
+            { "width",      report.width },
+            { "height",     report.height },
+            { "rmse",       report.rmse },
+            { "psnr",       psnr_json },
+            { "mean_error", report.mean_error },
+            { "max_error",  Json::object { { "value", report.max_error }, { "x", report.max_error_x }, { "y", report.max_error_y } } },
+            { "layers",     layers_json }
+        };
+
+        std::ofstream writing_file(file_path);
+        writing_file << json_object.dump();
+        writing_file.close();
+        if (!writing_file) { throw std::runtime_error("cannot write " + file_path); }
+    }
+}
@@ -0,0 +1,219 @@
+#include <unblending/row_unmixing.hpp>
+#include <unblending/optimization.hpp>
+#include <unblending/tracing.hpp>
+#include <cmath>
+#include <algorithm>
+
+namespace unblending
+{
+    namespace
+    {
+        // Number of pixels of a row that are processed as a single task
+        constexpr int segment_size = 64;
+
+        // The solution cache is divided into shards by the lowest bits of the keys so that threads rarely wait
+        constexpr int num_cache_shards = 64;
+
+        // Solutions are no longer added once a shard has this number of them, which bounds the memory usage
+        constexpr std::size_t max_solutions_per_shard = (1 << 18) / num_cache_shards;
+
+        // Get the key of a color if all of its components are 8-bit values (i.e., multiples of 1 / 255)
+        bool retrieve_cache_key(const Vec3& color, std::uint32_t& key)
+        {
+            key = 0;
+            for (int i : { 0, 1, 2 })
+            {
+                const double value = std::round(color(i) * 255.0);
+                if (value < 0.0 || value > 255.0 || value / 255.0 != color(i)) { return false; }
+                key = (key << 8) | static_cast<std::uint32_t>(value);
+            }
+            return true;
+        }
+    }
+
+    RowUnmixer::RowUnmixer(const std::vector<LayerInfo>& layer_infos,
+                           const bool                    has_opaque_background,
+                           const int                     target_concurrency,
+                           const bool                    use_active_set,
+                           const UnmixingModel           model,
+                           const bool                    use_solution_cache) :
+    RowUnmixer(layer_infos, has_opaque_background, std::make_shared<WorkerPool>(target_concurrency), use_active_set, model, use_solution_cache)
+    {
+    }
+
+    RowUnmixer::RowUnmixer(const std::vector<LayerInfo>&      layer_infos,
+                           const bool                         has_opaque_background,
+                           const std::shared_ptr<WorkerPool>& pool,
+                           const bool                         use_active_set,
+                           const UnmixingModel                model,
+                           const bool                         use_solution_cache) :
+    models_(extract_color_models(layer_infos)),
+    comp_ops_(extract_comp_ops(layer_infos)),
+    modes_(extract_blend_modes(layer_infos)),
+    has_opaque_background_(has_opaque_background),
+    use_active_set_(use_active_set),
+    pool_(pool)
+    {
+        const bool use_linear_model = model == UnmixingModel::Linear;
+        if (use_linear_model) { linear_solver_ = std::make_shared<const LinearUnmixingSolver>(models_); }
+
+        if (use_solution_cache && !use_linear_model) { cache_shards_.reset(new CacheShard[num_cache_shards]); }
+
+        workspaces_.resize(pool_->get_num_threads());
+    }
+
+    void RowUnmixer::unmix_rows(const std::uint8_t*        input,
+                                const int                  width,
+                                const int                  num_rows,
+                                const int                  num_channels,
+                                const std::ptrdiff_t       input_stride,
+                                const std::vector<float*>& layer_outputs,
+                                const std::ptrdiff_t       output_stride)
+    {
+        unmix(input, 255.0, width, num_rows, num_channels, input_stride, layer_outputs, output_stride);
+    }
+
+    void RowUnmixer::unmix_rows(const float*               input,
+                                const int                  width,
+                                const int                  num_rows,
+                                const int                  num_channels,
+                                const std::ptrdiff_t       input_stride,
+                                const std::vector<float*>& layer_outputs,
+                                const std::ptrdiff_t       output_stride)
+    {
+        unmix(input, 1.0, width, num_rows, num_channels, input_stride, layer_outputs, output_stride);
+    }
+
+    template <typename Scalar>
+    void RowUnmixer::unmix(const Scalar*              input,
+                           const double               max_value,
+                           const int                  width,
+                           const int                  num_rows,
+                           const int                  num_channels,
+                           const std::ptrdiff_t       input_stride,
+                           const std::vector<float*>& layer_outputs,
+                           const std::ptrdiff_t       output_stride)
+    {
+        assert(num_channels == 3 || num_channels == 4);
+        assert(layer_outputs.size() == models_.size());
+
+        UNBLENDING_TRACE_SCOPE("RowUnmixer::unmix_rows", "stage");
+
+        const int num_layers           = get_num_layers();
+        const int num_segments_per_row = (width + segment_size - 1) / segment_size;
+
+        auto per_segment_process = [&](int segment_index, int thread_index)
+        {
+            const int y       = segment_index / num_segments_per_row;
+            const int x_begin = (segment_index % num_segments_per_row) * segment_size;
+            const int x_end   = std::min(x_begin + segment_size, width);
+
+            for (int x = x_begin; x < x_end; ++ x)
+            {
+                const Scalar* pixel       = input + y * input_stride + x * num_channels;
+                const Vec3    pixel_color = Vec3(pixel[0], pixel[1], pixel[2]) / max_value;
+                const VecX    solution    = solve(pixel_color, workspaces_[thread_index]);
+
+                for (int index = 0; index < num_layers; ++ index)
+                {
+                    float* output = layer_outputs[index] + y * output_stride + x * 4;
+                    for (int i : { 0, 1, 2 }) { output[i] = static_cast<float>(solution(num_layers + index * 3 + i)); }
+                    output[3] = static_cast<float>(solution(index));
+                }
+            }
+        };
+
+        pool_->parallel_for(num_rows * num_segments_per_row, per_segment_process);
+    }
+
+    std::vector<ColorImage> RowUnmixer::unmix_image(const ColorImage& image)
+    {
+        UNBLENDING_TRACE_SCOPE("RowUnmixer::unmix_image", "stage");
+
+        const int width                = image.width();
+        const int num_layers           = get_num_layers();
+        const int num_segments_per_row = (width + segment_size - 1) / segment_size;
+
+        std::vector<ColorImage> layers(num_layers, ColorImage(width, image.height()));
+
+        auto per_segment_process = [&](int segment_index, int thread_index)
+        {
+            const int y       = segment_index / num_segments_per_row;
+            const int x_begin = (segment_index % num_segments_per_row) * segment_size;
+            const int x_end   = std::min(x_begin + segment_size, width);
+
+            for (int x = x_begin; x < x_end; ++ x)
+            {
+                const VecX solution = solve(image.get_rgb(x, y), workspaces_[thread_index]);
+
+                for (int index = 0; index < num_layers; ++ index)
+                {
+                    layers[index].set_rgba(x, y, solution.segment<3>(num_layers + index * 3), solution(index));
+                }
+            }
+        };
+
+        pool_->parallel_for(image.height() * num_segments_per_row, per_segment_process);
+
+        return layers;
+    }
+
+    VecX RowUnmixer::solve(const Vec3& pixel_color, Workspace& workspace)
+    {
+        OptimizationStatistics& statistics = workspace.statistics;
+
+        statistics.num_pixels += 1;
+
+        // Look up the cache first
+        std::uint32_t key      = 0;
+        const bool    is_keyed = cache_shards_ != nullptr && retrieve_cache_key(pixel_color, key);
+        if (is_keyed)
+        {
+            CacheShard& shard = cache_shards_[key % num_cache_shards];
+
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            const auto iter = shard.solutions.find(key);
+            if (iter != shard.solutions.end())
+            {
+                statistics.num_skipped_pixels += 1;
+                return iter->second;
+            }
+        }
+
+        PerPixelOptimizationCounts counts;
+
+        const VecX solution = (linear_solver_ != nullptr) ? linear_solver_->solve(pixel_color, &counts) : use_active_set_ ?
+        solve_per_pixel_optimization_with_active_set(pixel_color, models_, comp_ops_, modes_, has_opaque_background_, &counts) :
+        solve_per_pixel_optimization(pixel_color, models_, comp_ops_, modes_, false, has_opaque_background_, VecX(), VecX(), false, Vec3(), &counts);
+
+        statistics.num_iterations  += counts.num_iterations;
+        statistics.num_evaluations += counts.num_evaluations;
+        statistics.max_iterations   = std::max(statistics.max_iterations, counts.num_iterations);
+        if (!counts.is_converged) { ++ statistics.num_unconverged_pixels; }
+
+        if (is_keyed)
+        {
+            CacheShard& shard = cache_shards_[key % num_cache_shards];
+
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            if (shard.solutions.size() < max_solutions_per_shard) { shard.solutions.emplace(key, solution); }
+        }
+
+        return solution;
+    }
+
+    OptimizationStatistics RowUnmixer::get_statistics() const
+    {
+        OptimizationStatistics statistics;
+        for (const Workspace& workspace : workspaces_)
+        {
+            statistics.num_pixels             += workspace.statistics.num_pixels;
+            statistics.num_skipped_pixels     += workspace.statistics.num_skipped_pixels;
+            statistics.num_iterations         += workspace.statistics.num_iterations;
+            statistics.num_evaluations        += workspace.statistics.num_evaluations;
+            statistics.max_iterations          = std::max(statistics.max_iterations, workspace.statistics.max_iterations);
+            statistics.num_unconverged_pixels += workspace.statistics.num_unconverged_pixels;
+        }
+        return statistics;
+    }
+}
@@ -0,0 +1,203 @@
+#include <unblending/sparse_layer.hpp>
+#include <unblending/tracing.hpp>
+#include <mutex>
+#include <exception>
+#include <algorithm>
+#include <parallel-util.hpp>
+
+namespace unblending
+{
+    using std::vector;
+
+    SparseLayer::SparseLayer(const ColorImage& layer, double alpha_threshold, int tile_size, int target_concurrency) :
+    AbstractImage(layer.width(), layer.height()),
+    tile_size_(tile_size),
+    num_tiles_x_((layer.width() + tile_size - 1) / tile_size),
+    num_tiles_y_((layer.height() + tile_size - 1) / tile_size)
+    {
+        assert(tile_size > 0 && tile_size <= max_span_length);
+
+        UNBLENDING_TRACE_SCOPE("make_sparse_layer", "stage");
+
+        const int num_tiles = num_tiles_x_ * num_tiles_y_;
+
+        // Find the tiles to be stored in parallel
+        vector<char> is_stored(num_tiles, 0);
+        auto scan_tile = [&](int tile_index)
+        {
+            const ImageRegion region = get_tile_region(tile_index % num_tiles_x_, tile_index / num_tiles_x_);
+            for (int y = region.y; y < region.y + region.height; ++ y)
+            {
+                const Eigen::Map<const Eigen::ArrayXd> alphas(layer.get_a().data() + y * width() + region.x, region.width);
+                if ((alphas > alpha_threshold).any()) { is_stored[tile_index] = 1; return; }
+            }
+        };
+        parallelutil::parallel_for(num_tiles, scan_tile, target_concurrency);
+
+        tile_slots_.assign(num_tiles, - 1);
+        for (int tile_index = 0; tile_index < num_tiles; ++ tile_index)
+        {
+            if (!is_stored[tile_index]) { continue; }
+
+            tile_slots_[tile_index] = static_cast<int>(tiles_.size());
+            tiles_.push_back(ColorImage(0, 0));
+        }
+
+        // Copy the stored tiles in parallel
+        auto copy_tile = [&](int tile_index)
+        {
+            const int slot = tile_slots_[tile_index];
+            if (slot < 0) { return; }
+
+            tiles_[slot] = layer.get_region(get_tile_region(tile_index % num_tiles_x_, tile_index / num_tiles_x_));
+        };
+        parallelutil::parallel_for(num_tiles, copy_tile, target_concurrency);
+    }
+
+    ImageRegion SparseLayer::get_tile_region(int tile_x, int tile_y) const
+    {
+        ImageRegion region;
+        region.x      = tile_x * tile_size_;
+        region.y      = tile_y * tile_size_;
+        region.width  = std::min(tile_size_, width()  - region.x);
+        region.height = std::min(tile_size_, height() - region.y);
+        return region;
+    }
+
+    LayerSpan SparseLayer::get_span(int x, int y) const
+    {
+        const ColorImage* tile = get_tile(x / tile_size_, y / tile_size_);
+        if (tile == nullptr) { return LayerSpan{ nullptr, nullptr, nullptr, nullptr }; }
+
+        return make_layer_span(*tile, x % tile_size_, y % tile_size_);
+    }
+
+    std::size_t SparseLayer::get_memory_usage() const
+    {
+        std::size_t num_pixels = 0;
+        for (const ColorImage& tile : tiles_) { num_pixels += static_cast<std::size_t>(tile.width()) * tile.height(); }
+        return num_pixels * 4 * sizeof(double);
+    }
+
+    ColorImage SparseLayer::to_dense_image(int target_concurrency) const
+    {
+        ColorImage image(width(), height());
+        Image* channels[] = { &image.get_r(), &image.get_g(), &image.get_b(), &image.get_a() };
+        for (Image* channel : channels) { channel->fill(0.0); }
+
+        auto copy_tile = [&](int tile_index)
+        {
+            const int         tile_x = tile_index % num_tiles_x_;
+            const int         tile_y = tile_index / num_tiles_x_;
+            const ColorImage* tile   = get_tile(tile_x, tile_y);
+            if (tile == nullptr) { return; }
+
+            const ImageRegion region = get_tile_region(tile_x, tile_y);
+            const Image* tile_channels[] = { &tile->get_r(), &tile->get_g(), &tile->get_b(), &tile->get_a() };
+            for (int i : { 0, 1, 2, 3 }) for (int y = 0; y < region.height; ++ y)
+            {
+                const double* source = tile_channels[i]->data() + y * region.width;
+                std::copy(source, source + region.width, channels[i]->data() + (region.y + y) * width() + region.x);
+            }
+        };
+        parallelutil::parallel_for(num_tiles_x_ * num_tiles_y_, copy_tile, target_concurrency);
+
+        return image;
+    }
+
+    void SparseLayer::convert_row_to_argb32(int y, std::uint32_t* pixels) const
+    {
+        using ArrayXu = Eigen::Array<std::uint32_t, Eigen::Dynamic, 1>;
+
+        for (int x = 0; x < width(); x += tile_size_)
+        {
+            const int       length = std::min(tile_size_, width() - x);
+            const LayerSpan span   = get_span(x, y);
+
+            Eigen::Map<ArrayXu> output(pixels + x, length);
+            if (span.a == nullptr) { output.setZero(); continue; }
+
+            auto quantize = [&](const double* values) -> ArrayXu
+            {
+                return (Eigen::Map<const Eigen::ArrayXd>(values, length).max(0.0).min(1.0) * 255.0).cast<int>().cast<std::uint32_t>();
+            };
+            output = quantize(span.a) * 0x01000000u + quantize(span.r) * 0x00010000u + quantize(span.g) * 0x00000100u + quantize(span.b);
+        }
+    }
+
+    vector<SparseLayer> make_sparse_layers(const vector<ColorImage>& layers, double alpha_threshold, int tile_size, int target_concurrency)
+    {
+        vector<SparseLayer> sparse_layers;
+        for (const ColorImage& layer : layers) { sparse_layers.emplace_back(layer, alpha_threshold, tile_size, target_concurrency); }
+        return sparse_layers;
+    }
+
+    ColorImage composite_layers(const vector<SparseLayer>& layers,
+                                const vector<CompOp>&      comp_ops,
+                                const vector<BlendMode>&   modes,
+                                const int                  target_concurrency)
+    {
+        UNBLENDING_TRACE_SCOPE("composite_sparse_layers", "stage");
+
+        const int number    = static_cast<int>(layers.size());
+        const int width     = layers.front().width();
+        const int height    = layers.front().height();
+        const int tile_size = layers.front().get_tile_size();
+
+        for (const SparseLayer& layer : layers) { assert(layer.width() == width && layer.height() == height && layer.get_tile_size() == tile_size); }
+
+        ColorImage composited_image(width, height);
+
+        auto per_row_process = [&](int y)
+        {
+            vector<LayerSpan> spans(number);
+            for (int x = 0; x < width; x += tile_size)
+            {
+                const int length = std::min(tile_size, width - x);
+                const int offset = y * width + x;
+
+                for (int index = 0; index < number; ++ index) { spans[index] = layers[index].get_span(x, y); }
+
+                composite_layer_spans(spans.data(),
+                                      comp_ops,
+                                      modes,
+                                      length,
+                                      composited_image.get_r().data() + offset,
+                                      composited_image.get_g().data() + offset,
+                                      composited_image.get_b().data() + offset,
+                                      composited_image.get_a().data() + offset);
+            }
+        };
+
+        parallelutil::parallel_for(height, per_row_process, target_concurrency);
+
+        return composited_image;
+    }
+
+    void export_layers(const vector<SparseLayer>& layers,
+                       const std::string&         output_directory_path,
+                       const std::string&         file_name_prefix,
+                       const int                  png_compression_level,
+                       const int                  target_concurrency)
+    {
+        UNBLENDING_TRACE_SCOPE("export_sparse_layers", "stage");
+
+        // Exceptions cannot leave the threads of the parallel loop, so the first one is rethrown after the loop
+        std::mutex         exception_mutex;
+        std::exception_ptr exception;
+
+        auto save_file = [&](int index)
+        {
+            UNBLENDING_TRACE_SCOPE_WITH_ARG("save_layer", "export", index);
+
+            try { layers[index].save(output_directory_path + "/" + file_name_prefix + "_" + std::to_string(index) + ".png", png_compression_level, 1); }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(exception_mutex);
+                if (!exception) { exception = std::current_exception(); }
+            }
+        };
+        parallelutil::queue_based_parallel_for(static_cast<int>(layers.size()), save_file, target_concurrency);
+        if (exception) { std::rethrow_exception(exception); }
+    }
+}
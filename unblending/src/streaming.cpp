@@ -0,0 +1,295 @@
+#include <unblending/streaming.hpp>
+#include <unblending/layer_file.hpp>
+#include <unblending/tracing.hpp>
+#include <cmath>
+#include <cctype>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <algorithm>
+#include <QImage>
+#include <QImageReader>
+#include <timer.hpp>
+
+namespace unblending
+{
+    using std::vector;
+
+    namespace
+    {
+        struct NetpbmHeader
+        {
+            int            width       = 0;
+            int            height      = 0;
+            int            depth       = 0;
+            int            max_value   = 0;
+            std::streamoff data_offset = 0;
+        };
+
+        // Read the header of a binary PPM (P6) or PAM (P7) file; false is returned if the file is not one of them
+        bool read_netpbm_header(std::ifstream& file, NetpbmHeader& header)
+        {
+            char magic[2];
+            if (!file.read(magic, 2) || magic[0] != 'P' || (magic[1] != '6' && magic[1] != '7')) { return false; }
+
+            if (magic[1] == '6')
+            {
+                // Read an integer while skipping whitespaces and comments
+                auto read_value = [&]()
+                {
+                    int c = file.peek();
+                    while (c == '#' || std::isspace(c))
+                    {
+                        if (c == '#') { file.ignore(std::numeric_limits<std::streamsize>::max(), '\n'); }
+                        else { file.get(); }
+                        c = file.peek();
+                    }
+                    int value = 0;
+                    file >> value;
+                    return value;
+                };
+
+                header.width     = read_value();
+                header.height    = read_value();
+                header.max_value = read_value();
+                header.depth     = 3;
+
+                // A single whitespace separates the header and the data
+                file.get();
+            }
+            else
+            {
+                std::string line;
+                std::getline(file, line);
+                while (std::getline(file, line))
+                {
+                    std::istringstream stream(line);
+                    std::string key;
+                    stream >> key;
+
+                    if      (key == "ENDHDR") { break; }
+                    else if (key == "WIDTH")  { stream >> header.width; }
+                    else if (key == "HEIGHT") { stream >> header.height; }
+                    else if (key == "DEPTH")  { stream >> header.depth; }
+                    else if (key == "MAXVAL") { stream >> header.max_value; }
+                }
+            }
+
+            header.data_offset = file.tellg();
+
+            return file && header.width > 0 && header.height > 0 && header.depth >= 1 && header.depth <= 4 && header.max_value >= 1 && header.max_value <= 65535;
+        }
+
+        // Copy rows of the channels of a color image to those of another color image of the same width
+        void copy_rows(const ColorImage& source, int source_y, ColorImage& destination, int destination_y, int num_rows)
+        {
+            assert(source.width() == destination.width());
+
+            const int width = source.width();
+            auto copy_channel = [&](const Image& source_channel, Image& destination_channel)
+            {
+                std::copy(source_channel.data() + source_y * width, source_channel.data() + (source_y + num_rows) * width, destination_channel.data() + destination_y * width);
+            };
+            copy_channel(source.get_r(), destination.get_r());
+            copy_channel(source.get_g(), destination.get_g());
+            copy_channel(source.get_b(), destination.get_b());
+            copy_channel(source.get_a(), destination.get_a());
+        }
+    }
+
+    ImageBandReader::ImageBandReader(const std::string& file_path) : file_path_(file_path), netpbm_file_(file_path, std::ios::binary)
+    {
+        NetpbmHeader header;
+        is_netpbm_ = read_netpbm_header(netpbm_file_, header);
+        if (is_netpbm_)
+        {
+            width_       = header.width;
+            height_      = header.height;
+            depth_       = header.depth;
+            max_value_   = header.max_value;
+            data_offset_ = header.data_offset;
+            return;
+        }
+
+        netpbm_file_.close();
+
+        // Qt cannot resume decoding where the previous band ended (a clip rectangle decodes from the top of the
+        // image each time), so the whole image is decoded once
+        QImageReader reader(QString::fromStdString(file_path_));
+        decoded_image_.reset(new QImage(reader.read().convertToFormat(QImage::Format_RGBA8888)));
+        if (decoded_image_->isNull()) { throw std::runtime_error("ImageBandReader: cannot decode " + file_path_); }
+
+        width_  = decoded_image_->width();
+        height_ = decoded_image_->height();
+    }
+
+    ImageBandReader::~ImageBandReader() = default;
+
+    bool ImageBandReader::is_streamable(const std::string& file_path)
+    {
+        std::ifstream file(file_path, std::ios::binary);
+        NetpbmHeader  header;
+        return read_netpbm_header(file, header);
+    }
+
+    ColorImage ImageBandReader::read_rows(int y_begin, int y_end, int target_concurrency)
+    {
+        assert(0 <= y_begin && y_begin < y_end && y_end <= height());
+
+        UNBLENDING_TRACE_SCOPE("read_rows", "io");
+
+        const int num_rows = y_end - y_begin;
+
+        if (!is_netpbm_) { return ColorImage(decoded_image_->copy(0, y_begin, width_, num_rows), target_concurrency); }
+
+        const int            bytes_per_sample = (max_value_ > 255) ? 2 : 1;
+        const std::streamoff row_bytes        = static_cast<std::streamoff>(width_) * depth_ * bytes_per_sample;
+
+        vector<unsigned char> buffer(row_bytes * num_rows);
+        netpbm_file_.clear();
+        if (!netpbm_file_.seekg(data_offset_ + row_bytes * y_begin) || !netpbm_file_.read(reinterpret_cast<char*>(buffer.data()), buffer.size()))
+        {
+            throw std::runtime_error("ImageBandReader: cannot read rows " + std::to_string(y_begin) + "-" + std::to_string(y_end - 1) + " of " + file_path_ + " (the file may be truncated)");
+        }
+
+        // Samples are stored in the big-endian order
+        auto get_sample = [&](std::size_t index)
+        {
+            const int value = (bytes_per_sample == 2) ? (buffer[2 * index] << 8) | buffer[2 * index + 1] : buffer[index];
+            return static_cast<double>(value) / static_cast<double>(max_value_);
+        };
+
+        const bool has_color = depth_ >= 3;
+        const bool has_alpha = depth_ == 2 || depth_ == 4;
+
+        ColorImage rows(width_, num_rows);
+        for (int y = 0; y < num_rows; ++ y) for (int x = 0; x < width_; ++ x)
+        {
+            const std::size_t index = (static_cast<std::size_t>(y) * width_ + x) * depth_;
+
+            const double r = get_sample(index);
+            const double g = has_color ? get_sample(index + 1) : r;
+            const double b = has_color ? get_sample(index + 2) : r;
+            const double a = has_alpha ? get_sample(index + depth_ - 1) : 1.0;
+
+            rows.set_rgba(x, y, Eigen::Vector3d(r, g, b), a);
+        }
+        return rows;
+    }
+
+    PamWriter::PamWriter(const std::string& file_path, int width, int height) : file_path_(file_path), file_(file_path, std::ios::binary), width_(width), height_(height)
+    {
+        if (!file_) { throw std::runtime_error("PamWriter: cannot open " + file_path_); }
+
+        file_ << "P7\nWIDTH " << width_ << "\nHEIGHT " << height_ << "\nDEPTH 4\nMAXVAL 65535\nTUPLTYPE RGB_ALPHA\nENDHDR\n";
+        if (!file_) { throw std::runtime_error("PamWriter: cannot write into " + file_path_); }
+    }
+
+    void PamWriter::write_rows(const ColorImage& rows)
+    {
+        assert(rows.width() == width_);
+        assert(num_written_rows_ + rows.height() <= height_);
+
+        vector<unsigned char> buffer(static_cast<std::size_t>(rows.width()) * rows.height() * 4 * 2);
+        for (int y = 0; y < rows.height(); ++ y) for (int x = 0; x < rows.width(); ++ x)
+        {
+            const Eigen::Vector4d rgba  = rows.get_rgba(x, y);
+            const std::size_t     index = (static_cast<std::size_t>(y) * rows.width() + x) * 4;
+            for (int i : { 0, 1, 2, 3 })
+            {
+                const int value = static_cast<int>(std::round(crop_value(rgba(i)) * 65535.0));
+                buffer[2 * (index + i) + 0] = static_cast<unsigned char>(value >> 8);
+                buffer[2 * (index + i) + 1] = static_cast<unsigned char>(value & 0xff);
+            }
+        }
+        file_.write(reinterpret_cast<const char*>(buffer.data()), buffer.size());
+
+        num_written_rows_ += rows.height();
+
+        // Flush the last rows so that a failure (e.g., a full disk) is detected here rather than ignored on closing
+        if (is_complete()) { file_.flush(); }
+        if (!file_) { throw std::runtime_error("PamWriter: cannot write into " + file_path_); }
+    }
+
+    void decompose_in_bands(const std::string&       input_image_path,
+                            const vector<LayerInfo>& layer_infos,
+                            const std::string&       output_directory_path,
+                            const std::string&       file_name_prefix,
+                            const int                band_height,
+                            const bool               has_opaque_background,
+                            const bool               force_smooth_background,
+                            const int                target_concurrency,
+                            const bool               use_active_set,
+                            const UnmixingModel      model,
+                            const bool               write_layer_file)
+    {
+        assert(band_height > 0);
+
+        timer::Timer timer("decompose_in_bands");
+        UNBLENDING_TRACE_SCOPE("decompose_in_bands", "stage");
+
+        ImageBandReader reader(input_image_path);
+
+        const int number        = static_cast<int>(layer_infos.size());
+        const int width         = reader.width();
+        const int height        = reader.height();
+        const int radius        = calculate_refinement_radius(width, height);
+        const int num_halo_rows = 2 * radius;
+
+        vector<std::unique_ptr<PamWriter>> writers;
+        std::unique_ptr<LayerFileWriter>   layer_file_writer;
+        if (write_layer_file)
+        {
+            layer_file_writer.reset(new LayerFileWriter(output_directory_path + "/" + file_name_prefix + ".ulf", width, height, layer_infos));
+        }
+        else
+        {
+            for (int index = 0; index < number; ++ index)
+            {
+                writers.emplace_back(new PamWriter(output_directory_path + "/" + file_name_prefix + "_" + std::to_string(index) + ".pam", width, height));
+            }
+        }
+
+        // The unmixed rows of the previous band are carried over since the halo rows of adjacent bands overlap
+        vector<ColorImage> carried_layers;
+        int                carried_begin = 0;
+        int                carried_end   = 0;
+
+        for (int row_begin = 0; row_begin < height; row_begin += band_height)
+        {
+            const int row_end    = std::min(row_begin + band_height, height);
+            const int halo_begin = std::max(row_begin - num_halo_rows, 0);
+            const int halo_end   = std::min(row_end + num_halo_rows, height);
+
+            const ColorImage image_band = reader.read_rows(halo_begin, halo_end, target_concurrency);
+
+            // Unmix only the rows that have not been unmixed yet
+            const int new_begin = std::max(halo_begin, carried_end);
+
+            vector<ColorImage> layer_bands(number, ColorImage(width, halo_end - halo_begin));
+            if (new_begin > halo_begin)
+            {
+                for (int index = 0; index < number; ++ index) { copy_rows(carried_layers[index], halo_begin - carried_begin, layer_bands[index], 0, new_begin - halo_begin); }
+            }
+            if (new_begin < halo_end)
+            {
+                const vector<ColorImage> new_layers = compute_color_unmixing(image_band.get_rows(new_begin - halo_begin, halo_end - halo_begin), layer_infos, has_opaque_background, target_concurrency, use_active_set, model);
+                for (int index = 0; index < number; ++ index) { copy_rows(new_layers[index], 0, layer_bands[index], new_begin - halo_begin, halo_end - new_begin); }
+            }
+
+            const vector<ColorImage> refined_layers = perform_matte_refinement_of_band(image_band, layer_bands, layer_infos, has_opaque_background, force_smooth_background, radius, row_begin - halo_begin, row_end - halo_begin, target_concurrency, nullptr, model);
+
+            for (int index = 0; index < number; ++ index)
+            {
+                if (write_layer_file) { layer_file_writer->write_rows(index, row_begin, refined_layers[index], target_concurrency); }
+                else { writers[index]->write_rows(refined_layers[index]); }
+            }
+
+            carried_layers = std::move(layer_bands);
+            carried_begin  = halo_begin;
+            carried_end    = halo_end;
+        }
+
+        for (const auto& writer : writers) { assert(writer->is_complete()); }
+    }
+}
@@ -0,0 +1,205 @@
+#include <unblending/synthetic_data.hpp>
+#include <unblending/unblending.hpp>
+#include <unblending/color_model.hpp>
+#include <cmath>
+#include <random>
+#include <algorithm>
+#include <Eigen/Cholesky>
+
+namespace unblending
+{
+    using std::vector;
+
+    namespace
+    {
+        // Number of cells of the coarse grids that define the smooth color fields
+        constexpr int grid_size = 4;
+
+        // Parameters of the alpha mattes
+        constexpr int    num_ellipses = 3;
+        constexpr double min_radius   = 0.10; // Relative to the shorter side of the image
+        constexpr double max_radius   = 0.35;
+        constexpr double softness     = 0.20; // Relative width of the soft edges
+
+        // A field of standard normal values that is bilinearly interpolated from a coarse grid. The values are
+        // rescaled by the norm of the interpolation weights so that the variance is one at every pixel.
+        class SmoothNoiseField
+        {
+        public:
+            SmoothNoiseField(std::mt19937& engine) : values_(grid_size + 1, grid_size + 1)
+            {
+                std::normal_distribution<double> distribution(0.0, 1.0);
+                for (int i = 0; i < values_.size(); ++ i) { values_(i) = distribution(engine); }
+            }
+
+            double evaluate(const double u, const double v) const
+            {
+                const double s = u * grid_size;
+                const double t = v * grid_size;
+                const int    i = std::min(static_cast<int>(s), grid_size - 1);
+                const int    j = std::min(static_cast<int>(t), grid_size - 1);
+                const double a = s - i;
+                const double b = t - j;
+
+                const double w_00 = (1.0 - a) * (1.0 - b);
+                const double w_10 = a * (1.0 - b);
+                const double w_01 = (1.0 - a) * b;
+                const double w_11 = a * b;
+
+                const double value = w_00 * values_(i, j) + w_10 * values_(i + 1, j) + w_01 * values_(i, j + 1) + w_11 * values_(i + 1, j + 1);
+                const double norm  = std::sqrt(w_00 * w_00 + w_10 * w_10 + w_01 * w_01 + w_11 * w_11);
+
+                return value / norm;
+            }
+
+        private:
+            Eigen::MatrixXd values_;
+        };
+
+        struct Ellipse
+        {
+            Vec2   center;
+            Vec2   radii;
+            double angle;
+
+            // One inside, zero outside, and smoothly interpolated around the boundary
+            double evaluate(const Vec2& point) const
+            {
+                const Vec2   d = point - center;
+                const Vec2   p = Vec2(std::cos(angle) * d(0) + std::sin(angle) * d(1), - std::sin(angle) * d(0) + std::cos(angle) * d(1));
+                const double r = std::sqrt((p(0) * p(0)) / (radii(0) * radii(0)) + (p(1) * p(1)) / (radii(1) * radii(1)));
+                const double t = crop_value((1.0 - r) / softness);
+
+                return t * t * (3.0 - 2.0 * t);
+            }
+        };
+    }
+
+    SyntheticData generate_synthetic_data(const vector<LayerInfo>& layer_infos,
+                                          const int                width,
+                                          const int                height,
+                                          const unsigned           seed,
+                                          const bool               has_opaque_background)
+    {
+        const int number = static_cast<int>(layer_infos.size());
+
+        assert(number > 0);
+        assert(width > 0 && height > 0);
+
+        std::mt19937 engine(seed);
+        std::uniform_real_distribution<double> uniform(0.0, 1.0);
+
+        const double size = static_cast<double>(std::min(width, height));
+
+        vector<ColorImage> layers;
+        for (int index = 0; index < number; ++ index)
+        {
+            const GaussianColorModel* model = dynamic_cast<const GaussianColorModel*>(layer_infos[index].color_model.get());
+            assert(model != nullptr);
+
+            // Colors: mu + L z, where L L^T = Sigma and z is a smooth noise field for each channel
+            const Mat3 L = model->get_sigma().llt().matrixL();
+            const vector<SmoothNoiseField> fields = { SmoothNoiseField(engine), SmoothNoiseField(engine), SmoothNoiseField(engine) };
+
+            // Alpha: a union of soft ellipses (the background is fully opaque if required)
+            const bool is_opaque = has_opaque_background && index == 0;
+
+            vector<Ellipse> ellipses;
+            for (int i = 0; i < num_ellipses && !is_opaque; ++ i)
+            {
+                const Vec2   center(uniform(engine) * width, uniform(engine) * height);
+                const Vec2   radii(size * (min_radius + (max_radius - min_radius) * uniform(engine)), size * (min_radius + (max_radius - min_radius) * uniform(engine)));
+                const double angle = M_PI * uniform(engine);
+
+                ellipses.push_back(Ellipse{ center, radii, angle });
+            }
+
+            ColorImage layer(width, height);
+            for (int x = 0; x < width; ++ x) for (int y = 0; y < height; ++ y)
+            {
+                const double u = (x + 0.5) / width;
+                const double v = (y + 0.5) / height;
+
+                const Vec3 z(fields[0].evaluate(u, v), fields[1].evaluate(u, v), fields[2].evaluate(u, v));
+                const Vec3 color = crop_vec3(model->get_mu() + L * z);
+
+                double alpha = is_opaque ? 1.0 : 0.0;
+                for (const Ellipse& ellipse : ellipses) { alpha = std::max(alpha, ellipse.evaluate(Vec2(x + 0.5, y + 0.5))); }
+
+                layer.set_rgba(x, y, color, alpha);
+            }
+            layers.push_back(layer);
+        }
+
+        const vector<CompOp>    comp_ops = extract_comp_ops(layer_infos);
+        const vector<BlendMode> modes    = extract_blend_modes(layer_infos);
+
+        // Normalize the alphas when the layers are added up
+        const bool is_all_plus = std::all_of(comp_ops.begin(), comp_ops.end(), [](const CompOp& comp_op) { return comp_op.is_plus(); });
+        if (is_all_plus)
+        {
+            for (int x = 0; x < width; ++ x) for (int y = 0; y < height; ++ y)
+            {
+                double sum = 0.0;
+                for (int index = 0; index < number; ++ index) { sum += layers[index].get_a().get_pixel(x, y); }
+
+                for (int index = 0; index < number; ++ index)
+                {
+                    const double alpha = (sum > 0.0) ? layers[index].get_a().get_pixel(x, y) / sum : 1.0 / number;
+                    layers[index].set_rgba(x, y, layers[index].get_rgb(x, y), alpha);
+                }
+            }
+        }
+
+        return SyntheticData{ composite_layers(layers, comp_ops, modes), layers };
+    }
+
+    LayerRecoveryError compute_layer_recovery_error(const vector<ColorImage>& layers,
+                                                    const vector<ColorImage>& ground_truth_layers)
+    {
+        const int number = static_cast<int>(layers.size());
+
+        assert(number == ground_truth_layers.size());
+        assert(number > 0);
+
+        const int width  = ground_truth_layers.front().width();
+        const int height = ground_truth_layers.front().height();
+
+        LayerRecoveryError error;
+
+        double alpha_squared_error_sum = 0.0;
+        double color_squared_error_sum = 0.0;
+        double weight_sum              = 0.0;
+
+        for (int index = 0; index < number; ++ index)
+        {
+            assert(layers[index].width() == width && layers[index].height() == height);
+
+            double layer_alpha_squared_error_sum = 0.0;
+            double layer_color_squared_error_sum = 0.0;
+            double layer_weight_sum              = 0.0;
+
+            for (int x = 0; x < width; ++ x) for (int y = 0; y < height; ++ y)
+            {
+                const double weight = ground_truth_layers[index].get_a().get_pixel(x, y);
+                const double alpha  = layers[index].get_a().get_pixel(x, y);
+
+                layer_alpha_squared_error_sum += (alpha - weight) * (alpha - weight);
+                layer_color_squared_error_sum += weight * (layers[index].get_rgb(x, y) - ground_truth_layers[index].get_rgb(x, y)).squaredNorm();
+                layer_weight_sum              += weight;
+            }
+
+            error.layer_alpha_rmses.push_back(std::sqrt(layer_alpha_squared_error_sum / (width * height)));
+            error.layer_color_rmses.push_back((layer_weight_sum > 0.0) ? std::sqrt(layer_color_squared_error_sum / (3.0 * layer_weight_sum)) : 0.0);
+
+            alpha_squared_error_sum += layer_alpha_squared_error_sum;
+            color_squared_error_sum += layer_color_squared_error_sum;
+            weight_sum              += layer_weight_sum;
+        }
+
+        error.alpha_rmse = std::sqrt(alpha_squared_error_sum / (number * width * height));
+        error.color_rmse = (weight_sum > 0.0) ? std::sqrt(color_squared_error_sum / (3.0 * weight_sum)) : 0.0;
+
+        return error;
+    }
+}
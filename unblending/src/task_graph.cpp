@@ -0,0 +1,165 @@
+#include <unblending/task_graph.hpp>
+#include <unblending/tracing.hpp>
+#include <mutex>
+#include <thread>
+#include <cassert>
+#include <exception>
+#include <algorithm>
+#include <condition_variable>
+
+namespace unblending
+{
+    using std::vector;
+
+    int TaskGraph::add_task(const std::string&              name,
+                            const std::function<void(int)>& process,
+                            const vector<int>&              dependencies,
+                            const std::function<void()>&    release)
+    {
+        for (const int dependency : dependencies) { assert(0 <= dependency && dependency < tasks_.size()); }
+
+        Task task;
+        task.name         = name;
+        task.process      = process;
+        task.release      = release;
+        task.dependencies = dependencies;
+        tasks_.push_back(task);
+
+        return static_cast<int>(tasks_.size()) - 1;
+    }
+
+    void TaskGraph::request(int task_index)
+    {
+        Task& task = tasks_[task_index];
+        if (task.is_required) { return; }
+
+        task.is_required = true;
+        for (const int dependency : task.dependencies) { request(dependency); }
+    }
+
+    bool TaskGraph::is_required(int task_index) const
+    {
+        return tasks_[task_index].is_required;
+    }
+
+    void TaskGraph::run(int target_concurrency, int max_num_concurrent_tasks)
+    {
+        const int num_tasks = static_cast<int>(tasks_.size());
+
+        // Count the unfinished dependencies and the unfinished dependents of the required tasks
+        vector<int>         num_waiting_dependencies(num_tasks, 0);
+        vector<int>         num_waiting_dependents(num_tasks, 0);
+        vector<vector<int>> dependents(num_tasks);
+        vector<int>         ready_tasks;
+        int                 num_remaining_tasks = 0;
+        for (int index = 0; index < num_tasks; ++ index)
+        {
+            if (!tasks_[index].is_required) { continue; }
+
+            ++ num_remaining_tasks;
+            for (const int dependency : tasks_[index].dependencies)
+            {
+                ++ num_waiting_dependencies[index];
+                ++ num_waiting_dependents[dependency];
+                dependents[dependency].push_back(index);
+            }
+            if (num_waiting_dependencies[index] == 0) { ready_tasks.push_back(index); }
+        }
+
+        // Tasks registered earlier are taken first, so the order is deterministic with a single thread
+        std::reverse(ready_tasks.begin(), ready_tasks.end());
+
+        const int hardware_concurrency = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+        const int num_budget_threads   = (target_concurrency > 0) ? target_concurrency : hardware_concurrency;
+
+        const int num_threads          = std::min({ std::max(1, num_remaining_tasks), num_budget_threads, (max_num_concurrent_tasks > 0) ? max_num_concurrent_tasks : num_budget_threads });
+
+        // Threads of the budget that are not used by the running tasks
+        int num_available_threads = num_budget_threads;
+        int num_running_tasks     = 0;
+
+        std::mutex              mutex;
+        std::condition_variable condition;
+
+        // The first exception thrown by a task, after which no more tasks are started
+        std::exception_ptr exception;
+
+        auto release_task = [&](int index)
+        {
+            if (tasks_[index].release) { tasks_[index].release(); }
+        };
+
+        auto run_worker = [&]()
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (true)
+            {
+                condition.wait(lock, [&]() { return !ready_tasks.empty() || num_remaining_tasks == 0 || exception; });
+                if (num_remaining_tasks == 0 || exception) { return; }
+
+                const int index = ready_tasks.back();
+                ready_tasks.pop_back();
+
+                // Share the available threads with the other ready tasks that can start now (on the idle workers)
+                const int num_startable_tasks = 1 + std::min(static_cast<int>(ready_tasks.size()), num_threads - num_running_tasks - 1);
+                const int num_task_threads    = std::max(1, num_available_threads / num_startable_tasks);
+                num_available_threads -= num_task_threads;
+                ++ num_running_tasks;
+
+                lock.unlock();
+                std::exception_ptr task_exception;
+                try
+                {
+                    UNBLENDING_TRACE_SCOPE_WITH_ARG(tasks_[index].name.c_str(), "task", index);
+                    tasks_[index].process(num_task_threads);
+                }
+                catch (...)
+                {
+                    task_exception = std::current_exception();
+                }
+                lock.lock();
+
+                num_available_threads += num_task_threads;
+                -- num_running_tasks;
+
+                if (task_exception)
+                {
+                    if (!exception) { exception = task_exception; }
+                    condition.notify_all();
+                    return;
+                }
+
+                // The dependencies that are no longer needed are released outside the lock
+                vector<int> released_tasks;
+                for (const int dependency : tasks_[index].dependencies)
+                {
+                    if (-- num_waiting_dependents[dependency] == 0) { released_tasks.push_back(dependency); }
+                }
+                if (num_waiting_dependents[index] == 0) { released_tasks.push_back(index); }
+
+                for (const int dependent : dependents[index])
+                {
+                    if (-- num_waiting_dependencies[dependent] == 0) { ready_tasks.insert(ready_tasks.begin(), dependent); }
+                }
+
+                if (!released_tasks.empty())
+                {
+                    lock.unlock();
+                    for (const int released_task : released_tasks) { release_task(released_task); }
+                    lock.lock();
+                }
+
+                -- num_remaining_tasks;
+                condition.notify_all();
+            }
+        };
+
+        vector<std::thread> threads;
+        for (int thread_index = 1; thread_index < num_threads; ++ thread_index) { threads.emplace_back(run_worker); }
+        run_worker();
+        for (std::thread& thread : threads) { thread.join(); }
+
+        // The tasks that were running when the exception was thrown have finished by now
+        if (exception) { std::rethrow_exception(exception); }
+    }
+}
@@ -0,0 +1,222 @@
+#include <unblending/tracing.hpp>
+
+#ifdef UNBLENDING_WITH_TRACING
+
+#include <mutex>
+#include <chrono>
+#include <memory>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+#include <json11.hpp>
+
+namespace unblending
+{
+    namespace tracing
+    {
+        namespace
+        {
+            struct Event
+            {
+                const char* name;
+                const char* category;
+                int         arg;
+                long long   begin;
+                long long   end;
+            };
+
+            // A ring buffer that is written only by the thread that owns it
+            struct ThreadBuffer
+            {
+                int                track;
+                std::vector<Event> events;
+                std::size_t        num_recorded;
+            };
+
+            // Buffers are returned to the pool when their threads finish and are reused by new threads, so the
+            // number of buffers (i.e., tracks in the trace) is bounded by the maximum number of simultaneous threads.
+            class BufferPool
+            {
+            public:
+                ThreadBuffer* acquire()
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    if (free_buffers_.empty())
+                    {
+                        const int track = static_cast<int>(buffers_.size());
+                        buffers_.push_back(std::unique_ptr<ThreadBuffer>(new ThreadBuffer{ track, std::vector<Event>(capacity_), 0 }));
+                        return buffers_.back().get();
+                    }
+                    ThreadBuffer* buffer = free_buffers_.back();
+                    free_buffers_.pop_back();
+                    return buffer;
+                }
+
+                void release(ThreadBuffer* buffer)
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    free_buffers_.push_back(buffer);
+                }
+
+                void reset(const std::size_t capacity)
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    capacity_ = capacity;
+                    for (auto& buffer : buffers_)
+                    {
+                        buffer->events       = std::vector<Event>(capacity);
+                        buffer->num_recorded = 0;
+                    }
+                }
+
+                template <typename Callable>
+                void for_each(Callable function)
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    for (const auto& buffer : buffers_) { function(*buffer); }
+                }
+
+            private:
+                std::mutex                                 mutex_;
+                std::size_t                                capacity_ = 1 << 14;
+                std::vector<std::unique_ptr<ThreadBuffer>> buffers_;
+                std::vector<ThreadBuffer*>                 free_buffers_;
+            };
+
+            // Intentionally leaked so that it outlives the thread-local handles
+            BufferPool& get_buffer_pool()
+            {
+                static BufferPool* buffer_pool = new BufferPool();
+                return *buffer_pool;
+            }
+
+            struct BufferHandle
+            {
+                ThreadBuffer* buffer = nullptr;
+
+                ~BufferHandle() { if (buffer != nullptr) { get_buffer_pool().release(buffer); } }
+            };
+
+            thread_local BufferHandle buffer_handle;
+
+            std::atomic<long long> start_time(0);
+
+            long long get_current_time_in_nanoseconds()
+            {
+                return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+            }
+        }
+
+        namespace internal
+        {
+            std::atomic<bool> is_tracing(false);
+
+            long long get_timestamp()
+            {
+                return get_current_time_in_nanoseconds() - start_time.load(std::memory_order_relaxed);
+            }
+
+            void record_span(const char* name, const char* category, int arg, long long begin, long long end)
+            {
+                if (buffer_handle.buffer == nullptr) { buffer_handle.buffer = get_buffer_pool().acquire(); }
+
+                ThreadBuffer& buffer = *buffer_handle.buffer;
+                if (buffer.events.empty()) { return; }
+
+                buffer.events[buffer.num_recorded % buffer.events.size()] = Event{ name, category, arg, begin, end };
+                ++ buffer.num_recorded;
+            }
+        }
+
+        bool is_available()
+        {
+            return true;
+        }
+
+        void start_tracing(const std::size_t events_per_thread)
+        {
+            get_buffer_pool().reset(events_per_thread);
+            start_time = get_current_time_in_nanoseconds();
+            internal::is_tracing = true;
+        }
+
+        void stop_tracing()
+        {
+            internal::is_tracing = false;
+        }
+
+        bool export_trace(const std::string& file_path)
+        {
+            using json11::Json;
+
+            std::vector<Json> events_json;
+            std::size_t       num_dropped_events = 0;
+
+            get_buffer_pool().for_each([&](const ThreadBuffer& buffer)
+            {
+                const std::size_t capacity   = buffer.events.size();
+                const std::size_t num_events = std::min(buffer.num_recorded, capacity);
+
+                num_dropped_events += buffer.num_recorded - num_events;
+
+                if (num_events == 0) { return; }
+
+                events_json.push_back(Json::object
+                {
+                    { "name", "thread_name" },
+                    { "ph",   "M" },
+                    { "pid",  1 },
+                    { "tid",  buffer.track },
+                    { "args", Json::object { { "name", "track " + std::to_string(buffer.track) } } }
+                });
+
+                // The oldest event is at the write position once the buffer has wrapped around
+                for (std::size_t i = buffer.num_recorded - num_events; i < buffer.num_recorded; ++ i)
+                {
+                    const Event& event = buffer.events[i % capacity];
+
+                    Json::object event_json
+                    {
+                        { "name", event.name },
+                        { "cat",  event.category },
+                        { "ph",   "X" },
+                        { "ts",   1e-03 * static_cast<double>(event.begin) },
+                        { "dur",  1e-03 * static_cast<double>(event.end - event.begin) },
+                        { "pid",  1 },
+                        { "tid",  buffer.track }
+                    };
+                    if (event.arg >= 0) { event_json["args"] = Json::object { { "index", event.arg } }; }
+
+                    events_json.push_back(event_json);
+                }
+            });
+
+            const Json json = Json::object
+            {
+                { "traceEvents",     events_json },
+                { "displayTimeUnit", "ms" },
+                { "otherData",       Json::object { { "dropped_events", static_cast<double>(num_dropped_events) } } }
+            };
+
+            std::ofstream writing_file(file_path);
+            if (!writing_file) { return false; }
+            writing_file << json.dump();
+            return static_cast<bool>(writing_file);
+        }
+    }
+}
+
+#else
+
+namespace unblending
+{
+    namespace tracing
+    {
+        bool is_available() { return false; }
+        void start_tracing(const std::size_t) {}
+        void stop_tracing() {}
+        bool export_trace(const std::string&) { return false; }
+    }
+}
+
+#endif
@@ -2,8 +2,14 @@
 #include <unblending/image_processing.hpp>
 #include <unblending/color_model.hpp>
 #include <unblending/equations.hpp>
+#include <unblending/optimization.hpp>
+#include <unblending/linear_unmixing.hpp>
+#include <unblending/instrumentation.hpp>
+#include <unblending/tracing.hpp>
 #include <cmath>
 #include <cfloat>
+#include <atomic>
+#include <algorithm>
 #include <iostream>
 #include <thread>
 #include <nlopt-util.hpp>
@@ -21,29 +27,13 @@ namespace unblending
 {
     using std::vector;
     
-    struct OptimizationParameterSet
-    {
-        vector<ColorModelPtr> models;
-        vector<CompOp>        comp_ops;
-        vector<BlendMode>     modes;
-        
-        Vec3   target_color;
-        VecX   lambda;
-        double rho;
-        double sigma;               // Weight for the sparcity term
-        bool   use_sparcity;
-        bool   use_minimum_alpha;
-        bool   use_target_alphas;   // If true, the alternative constraint (Eq. 6) will be used instead of the unity constraint (Eq. 2).
-        VecX   target_alphas;       // This will be used when "use_target_alphas" is true.
-        
-        vector<int> gray_layers;    // A list of gray layer indices. For example, if the second and fourth layers are to be gray, it looks like { 1, 3 }.
-    };
-    
     double objective_function(const vector<double> &x, vector<double>& grad, void* data)
     {
         const int num_layers = static_cast<int>(x.size() / 4);
         
-        const OptimizationParameterSet& set = *static_cast<const OptimizationParameterSet*>(data);
+        OptimizationParameterSet& set = *static_cast<OptimizationParameterSet*>(data);
+        
+        ++ set.num_evaluations;
         
         const VecX alphas = Eigen::Map<const VecX>(&x[0], num_layers);
         const VecX colors = Eigen::Map<const VecX>(&x[num_layers], num_layers * 3);
@@ -131,12 +121,13 @@ namespace unblending
                                       const vector<ColorModelPtr>& models,
                                       const vector<CompOp>&        comp_ops,
                                       const vector<BlendMode>&     modes,
-                                      const bool                   is_for_refinement       = false,
-                                      const bool                   has_opaque_background   = true,
-                                      const VecX&                  initial_colors          = VecX(),
-                                      const VecX&                  target_alphas           = VecX(),
-                                      const bool                   force_smooth_background = false,
-                                      const Vec3&                  target_background_color = Vec3())
+                                      const bool                   is_for_refinement,
+                                      const bool                   has_opaque_background,
+                                      const VecX&                  initial_colors,
+                                      const VecX&                  target_alphas,
+                                      const bool                   force_smooth_background,
+                                      const Vec3&                  target_background_color,
+                                      PerPixelOptimizationCounts*  counts)
     {
         const int num_layers = static_cast<int>(models.size());
         
@@ -245,7 +236,16 @@ namespace unblending
             
             x = x_new;
             
-            if ((is_unchanged && is_satisfied) || count > max_count) break;
+            if ((is_unchanged && is_satisfied) || count > max_count)
+            {
+                if (counts != nullptr)
+                {
+                    counts->num_iterations  += count + 1;
+                    counts->num_evaluations += set.num_evaluations;
+                    counts->is_converged     = is_unchanged && is_satisfied;
+                }
+                break;
+            }
             
             ++ count;
         }
@@ -283,9 +283,153 @@ namespace unblending
         return x;
     }
     
+    // Layers are added to the active set (in the order of closeness) until the reduced problem satisfies the
+    // constraints. The threshold is the same as the one used for reporting failures in the verbose mode.
+    constexpr int    initial_active_set_size = 3;
+    constexpr double active_set_tolerance    = 0.01;
+    
+    VecX solve_per_pixel_optimization_with_active_set(const Vec3&                  target_color,
+                                                      const vector<ColorModelPtr>& models,
+                                                      const vector<CompOp>&        comp_ops,
+                                                      const vector<BlendMode>&     modes,
+                                                      const bool                   has_opaque_background,
+                                                      PerPixelOptimizationCounts*  counts)
+    {
+        const int num_layers = static_cast<int>(models.size());
+        
+        // Sort the layers by the distance from the target color; the background is always kept when it is opaque
+        vector<int>    order(num_layers);
+        vector<double> distances(num_layers);
+        for (int index = 0; index < num_layers; ++ index)
+        {
+            order[index]     = index;
+            distances[index] = (has_opaque_background && index == 0) ? - DBL_MAX : models[index]->calculate_distance(target_color);
+        }
+        std::stable_sort(order.begin(), order.end(), [&](int i, int j) { return distances[i] < distances[j]; });
+        
+        int active_set_size = std::min(initial_active_set_size, num_layers);
+        while (active_set_size < num_layers)
+        {
+            // Keep the original stacking order within the active set
+            vector<int> active_set(order.begin(), order.begin() + active_set_size);
+            std::sort(active_set.begin(), active_set.end());
+            
+            vector<ColorModelPtr> active_models;
+            vector<CompOp>        active_comp_ops;
+            vector<BlendMode>     active_modes;
+            for (int index : active_set)
+            {
+                active_models.push_back(models[index]);
+                active_comp_ops.push_back(comp_ops[index]);
+                active_modes.push_back(modes[index]);
+            }
+            
+            const VecX x_active = solve_per_pixel_optimization(target_color,
+                                                               active_models,
+                                                               active_comp_ops,
+                                                               active_modes,
+                                                               false,
+                                                               has_opaque_background,
+                                                               VecX(),
+                                                               VecX(),
+                                                               false,
+                                                               Vec3(),
+                                                               counts);
+            const VecX g_active = calculate_constraint_vector(x_active,
+                                                              target_color,
+                                                              active_comp_ops,
+                                                              active_modes,
+                                                              false);
+            
+            if (g_active.norm() < active_set_tolerance)
+            {
+                // Excluded layers are pinned to zero alpha with their representative colors
+                VecX x = VecX::Zero(num_layers * 4);
+                for (int index = 0; index < num_layers; ++ index)
+                {
+                    x.segment<3>(num_layers + index * 3) = models[index]->get_representative_color();
+                }
+                for (int i = 0; i < active_set_size; ++ i)
+                {
+                    const int index = active_set[i];
+                    x(index)                             = x_active(i);
+                    x.segment<3>(num_layers + index * 3) = x_active.segment<3>(active_set_size + i * 3);
+                }
+                return x;
+            }
+            
+            active_set_size = std::min(2 * active_set_size, num_layers);
+        }
+        
+        return solve_per_pixel_optimization(target_color, models, comp_ops, modes, false, has_opaque_background, VecX(), VecX(), false, Vec3(), counts);
+    }
+    
+    // Thread-safe accumulator of per-pixel counts into the statistics of a stage
+    class OptimizationCounter
+    {
+    public:
+        void add(const PerPixelOptimizationCounts& counts)
+        {
+            num_iterations_  += counts.num_iterations;
+            num_evaluations_ += counts.num_evaluations;
+            if (!counts.is_converged) { ++ num_unconverged_pixels_; }
+            
+            int max_iterations = max_iterations_.load();
+            while (counts.num_iterations > max_iterations && !max_iterations_.compare_exchange_weak(max_iterations, counts.num_iterations)) {}
+        }
+        
+        void write(OptimizationStatistics& statistics) const
+        {
+            statistics.num_iterations         = num_iterations_;
+            statistics.num_evaluations        = num_evaluations_;
+            statistics.max_iterations         = max_iterations_;
+            statistics.num_unconverged_pixels = num_unconverged_pixels_;
+        }
+        
+    private:
+        std::atomic<long long> num_iterations_{0};
+        std::atomic<long long> num_evaluations_{0};
+        std::atomic<int>       max_iterations_{0};
+        std::atomic<int>       num_unconverged_pixels_{0};
+    };
+    
+    /// \brief Run a per-pixel process over the image tile by tile.
+    /// \details Tiles are assigned to threads dynamically, so regions with expensive pixels do not stall the
+    /// other threads (as a static partition of the pixels would do).
+    template <typename Callable>
+    void parallel_for_tiles(const int   width,
+                            const int   height,
+                            Callable    per_pixel_process,
+                            const char* trace_name,
+                            const int   target_concurrency)
+    {
+        const int num_tiles_x = (width  + solver_tile_size - 1) / solver_tile_size;
+        const int num_tiles_y = (height + solver_tile_size - 1) / solver_tile_size;
+        
+        auto per_tile_process = [&](int tile_index)
+        {
+            UNBLENDING_TRACE_SCOPE_WITH_ARG(trace_name, "tile", tile_index);
+            
+            const int x_begin = (tile_index % num_tiles_x) * solver_tile_size;
+            const int y_begin = (tile_index / num_tiles_x) * solver_tile_size;
+            const int x_end   = std::min(x_begin + solver_tile_size, width);
+            const int y_end   = std::min(y_begin + solver_tile_size, height);
+            
+            for (int y = y_begin; y < y_end; ++ y) for (int x = x_begin; x < x_end; ++ x)
+            {
+                per_pixel_process(x, y);
+            }
+        };
+        
+        parallelutil::queue_based_parallel_for(num_tiles_x * num_tiles_y, per_tile_process, target_concurrency);
+    }
+    
     VecX normalize_alphas(const VecX&           alphas,
-                          const vector<CompOp>& comp_ops)
+                          const vector<CompOp>& comp_ops,
+                          const bool            use_linear_model)
     {
+        if (use_linear_model) { return alphas / alphas.sum(); }
+        
         bool is_all_plus        = true;
         bool is_all_source_over = true;
         for (auto& comp_op : comp_ops)
@@ -307,78 +451,161 @@ namespace unblending
         return VecX::Zero(alphas.rows());
     }
     
-    vector<ColorImage> perform_matte_refinement(const ColorImage&         image,
-                                                const vector<ColorImage>& layers,
-                                                const vector<LayerInfo>&  layer_infos,
-                                                const bool                has_opaque_background,
-                                                const bool                force_smooth_background,
-                                                const int                 target_concurrency)
+    /// \brief Settings of the matte refinement that are shared by all the bands of an image.
+    struct MatteRefinementSetting
     {
-        timer::Timer timer("perform_matte_refinement");
-        
-        const vector<ColorModelPtr> models                  = extract_color_models           (layer_infos);
-        const vector<CompOp>        comp_ops                = extract_comp_ops               (layer_infos);
-        const vector<BlendMode>     modes                   = extract_blend_modes            (layer_infos);
+        vector<ColorModelPtr> models;
+        vector<CompOp>        comp_ops;
+        vector<BlendMode>     modes;
         
-        assert(layers.size() == models.size());
+        bool   has_opaque_background;
+        bool   use_linear_model;
+        bool   smooth_background;
+        int    radius;
+        int    target_concurrency;
+        double skip_tolerance;
         
+        std::shared_ptr<const LinearUnmixingSolver> linear_solver;
+    };
+    
+    MatteRefinementSetting make_matte_refinement_setting(const vector<LayerInfo>& layer_infos,
+                                                         const bool               has_opaque_background,
+                                                         const bool               force_smooth_background,
+                                                         const int                radius,
+                                                         const int                target_concurrency,
+                                                         const double             skip_tolerance,
+                                                         const UnmixingModel      model)
+    {
+        MatteRefinementSetting setting;
+        setting.models                = extract_color_models(layer_infos);
+        setting.comp_ops              = extract_comp_ops    (layer_infos);
+        setting.modes                 = extract_blend_modes (layer_infos);
+        setting.has_opaque_background = has_opaque_background;
+        setting.use_linear_model      = model == UnmixingModel::Linear;
+        setting.smooth_background     = force_smooth_background && !setting.use_linear_model;
+        setting.radius                = radius;
+        setting.target_concurrency    = target_concurrency;
+        setting.skip_tolerance        = skip_tolerance;
+        setting.linear_solver         = setting.use_linear_model ? std::make_shared<const LinearUnmixingSolver>(setting.models) : nullptr;
+        return setting;
+    }
+    
+    /// \brief Perform the matte refinement of a horizontal band of an image.
+    /// \param image The band of the input image, including the halo rows above and below the band.
+    /// \param layers The band of the unmixed layers, including the halo rows.
+    /// \param row_begin The first row of the band (excluding the halo) in the band image.
+    /// \param row_end The end of the rows of the band (excluding the halo) in the band image.
+    /// \param row_offset The offset that maps the rows of the band image to those of the refined layers.
+    void refine_band(const ColorImage&             image,
+                     const vector<ColorImage>&     layers,
+                     const MatteRefinementSetting& setting,
+                     const int                     row_begin,
+                     const int                     row_end,
+                     const int                     row_offset,
+                     vector<ColorImage>&           refined_layers,
+                     OptimizationCounter&          counter,
+                     std::atomic<int>&             num_skipped_pixels)
+    {
         const int number = static_cast<int>(layers.size());
         const int width  = image.width();
         const int height = image.height();
-        const int radius = 60 * std::min(width, height) / 1000;
+        const int radius = setting.radius;
+        
+        const int  target_concurrency = setting.target_concurrency;
+        const bool use_linear_model   = setting.use_linear_model;
+        const bool smooth_background  = setting.smooth_background;
         
         constexpr double epsilon = 1e-04;
         
         // Apply guided filter
         vector<Image> refined_alphas;
-        for (const ColorImage& layer : layers)
         {
-            const Image& alpha         = layer.get_a();
-            const Image  refined_alpha = apply_guided_filter(alpha, image, radius, epsilon);
-            
-            refined_alphas.push_back(refined_alpha);
-        }
-        
-        // Crop alphas into [0, 1]
-        for (int x = 0; x < width; ++ x) for (int y = 0; y < height; ++ y)
-        {
-            for (int i = 0; i < number; ++ i)
+            StageScope scope("perform_matte_refinement/guided_filter");
+            for (const ColorImage& layer : layers)
             {
-                refined_alphas[i].set_pixel(x, y, crop_value(refined_alphas[i].get_pixel(x, y)));
+                const Image& alpha         = layer.get_a();
+                const Image  refined_alpha = apply_guided_filter(alpha, image, radius, epsilon, target_concurrency);
+                
+                refined_alphas.push_back(refined_alpha);
             }
         }
         
-        // Normalize alphas such that the composited alpha becomes one for each pixel
-        for (int x = 0; x < width; ++ x) for (int y = 0; y < height; ++ y)
         {
-            VecX alphas = VecX(number);
-            for (int i = 0; i < number; ++ i)
+            StageScope scope("perform_matte_refinement/normalization");
+            
+            // Crop alphas into [0, 1]
+            for (int x = 0; x < width; ++ x) for (int y = 0; y < height; ++ y)
             {
-                alphas(i) = refined_alphas[i].get_pixel(x, y);
+                for (int i = 0; i < number; ++ i)
+                {
+                    refined_alphas[i].set_pixel(x, y, crop_value(refined_alphas[i].get_pixel(x, y)));
+                }
             }
             
-            alphas = normalize_alphas(alphas, comp_ops);
-            
-            for (int i = 0; i < number; ++ i)
+            // Normalize alphas such that the composited alpha becomes one for each pixel
+            for (int x = 0; x < width; ++ x) for (int y = 0; y < height; ++ y)
             {
-                refined_alphas[i].set_pixel(x, y, alphas(i));
+                VecX alphas = VecX(number);
+                for (int i = 0; i < number; ++ i)
+                {
+                    alphas(i) = refined_alphas[i].get_pixel(x, y);
+                }
+                
+                alphas = normalize_alphas(alphas, setting.comp_ops, use_linear_model);
+                
+                for (int i = 0; i < number; ++ i)
+                {
+                    refined_alphas[i].set_pixel(x, y, alphas(i));
+                }
             }
         }
         
         // Smooth background
         ColorImage smoothed_background(width, height);
-        if (force_smooth_background)
+        if (smooth_background)
         {
-            assert(has_opaque_background);
-            smoothed_background.set_r(apply_guided_filter(layers[0].get_r(), image, radius, epsilon));
-            smoothed_background.set_g(apply_guided_filter(layers[0].get_g(), image, radius, epsilon));
-            smoothed_background.set_b(apply_guided_filter(layers[0].get_b(), image, radius, epsilon));
+            StageScope scope("perform_matte_refinement/smooth_background");
+            
+            assert(setting.has_opaque_background);
+            smoothed_background.set_r(apply_guided_filter(layers[0].get_r(), image, radius, epsilon, target_concurrency));
+            smoothed_background.set_g(apply_guided_filter(layers[0].get_g(), image, radius, epsilon, target_concurrency));
+            smoothed_background.set_b(apply_guided_filter(layers[0].get_b(), image, radius, epsilon, target_concurrency));
         }
         
+        // Check whether the refinement changes the pixel at all; if not, the unmixing solution can be reused
+        auto is_clean_pixel = [&](int x, int y)
+        {
+            if (setting.skip_tolerance < 0.0) { return false; }
+            
+            for (int i = 0; i < number; ++ i)
+            {
+                if (std::abs(refined_alphas[i].get_pixel(x, y) - layers[i].get_a().get_pixel(x, y)) > setting.skip_tolerance) { return false; }
+            }
+            
+            if (smooth_background)
+            {
+                const Vec3 diff = crop_vec3(smoothed_background.get_rgb(x, y)) - layers[0].get_rgb(x, y);
+                if (diff.cwiseAbs().maxCoeff() > setting.skip_tolerance) { return false; }
+            }
+            
+            return true;
+        };
+        
         // Perform optimization
-        vector<ColorImage> refined_layers(number, ColorImage(width, height));
-        auto per_pixel_process = [&](int x, int y)
+        auto per_pixel_process = [&](int x, int band_y)
         {
+            const int y = band_y + row_begin;
+            
+            if (is_clean_pixel(x, y))
+            {
+                for (int index = 0; index < number; ++ index)
+                {
+                    refined_layers[index].set_rgba(x, y + row_offset, layers[index].get_rgba(x, y));
+                }
+                ++ num_skipped_pixels;
+                return;
+            }
+            
             VecX initial_colors(number * 3);
             VecX target_alphas(number);
             for (int i = 0; i < number; ++ i)
@@ -387,30 +614,186 @@ namespace unblending
                 target_alphas(i)                 = refined_alphas[i].get_pixel(x, y);
             }
             
-            if (force_smooth_background)
+            if (smooth_background)
             {
                 initial_colors.segment<3>(0) = crop_vec3(smoothed_background.get_rgb(x, y));
             }
             
+            PerPixelOptimizationCounts counts;
+            
             const Vec3 pixel_color = image.get_rgb(x, y);
-            const VecX solution = solve_per_pixel_optimization(pixel_color,
-                                                               models,
-                                                               comp_ops,
-                                                               modes,
-                                                               true,
-                                                               has_opaque_background,
-                                                               initial_colors,
-                                                               target_alphas,
-                                                               force_smooth_background,
-                                                               crop_vec3(smoothed_background.get_rgb(x, y)));
+            const VecX solution = use_linear_model ?
+            setting.linear_solver->solve_with_fixed_alphas(pixel_color, target_alphas, &counts) :
+            solve_per_pixel_optimization(pixel_color,
+                                         setting.models,
+                                         setting.comp_ops,
+                                         setting.modes,
+                                         true,
+                                         setting.has_opaque_background,
+                                         initial_colors,
+                                         target_alphas,
+                                         smooth_background,
+                                         crop_vec3(smoothed_background.get_rgb(x, y)),
+                                         &counts);
+            
+            counter.add(counts);
             
             for (int index = 0; index < number; ++ index)
             {
-                refined_layers[index].set_rgba(x, y, solution.segment<3>(number + index * 3), solution(index));
+                refined_layers[index].set_rgba(x, y + row_offset, solution.segment<3>(number + index * 3), solution(index));
             }
         };
         
-        parallelutil::parallel_for_2d(width, height, per_pixel_process, target_concurrency);
+        {
+            StageScope scope("perform_matte_refinement/per_pixel_optimization");
+            parallel_for_tiles(width, row_end - row_begin, per_pixel_process, "perform_matte_refinement/tile", target_concurrency);
+        }
+    }
+    
+    /// \brief Calculate the height of the bands in which the matte refinement fits in the memory budget.
+    /// \details The input image and the unmixed and refined layers are kept at full size, and the others (the
+    /// refined alphas, the smoothed background, and the temporaries of the guided filter) are allocated per band.
+    /// Each band needs halo rows of twice the filter radius on both sides so that the guided filter (whose
+    /// output depends on the input within two box-filter radii) gives exactly the same result as for the whole
+    /// image.
+    /// \param is_budget_exceeded Set to true if even the smallest bands do not fit in the budget.
+    /// \return The band height, which is equal to the image height if the whole image fits in the budget.
+    int calculate_band_height(const int         width,
+                              const int         height,
+                              const int         number,
+                              const int         radius,
+                              const std::size_t memory_budget,
+                              bool&             is_budget_exceeded)
+    {
+        is_budget_exceeded = false;
+        
+        if (memory_budget == 0) { return height; }
+        
+        // Number of single-channel images that are alive at the peak of the guided filter
+        constexpr int num_guided_filter_images = 28;
+        
+        const std::size_t row_bytes      = sizeof(double) * width;
+        const std::size_t full_bytes     = row_bytes * height * (4 + 4 * number + 4 * number);
+        const std::size_t band_row_bytes = row_bytes * (4 + 4 * number + number + 4 + num_guided_filter_images);
+        
+        if (full_bytes + band_row_bytes * height <= memory_budget) { return height; }
+        
+        const int num_halo_rows = 4 * radius;
+        const int num_rows      = (memory_budget > full_bytes) ? static_cast<int>((memory_budget - full_bytes) / band_row_bytes) : 0;
+        
+        if (num_rows < num_halo_rows + solver_tile_size)
+        {
+            is_budget_exceeded = true;
+            return solver_tile_size;
+        }
+        
+        return num_rows - num_halo_rows;
+    }
+    
+    vector<ColorImage> perform_matte_refinement(const ColorImage&         image,
+                                                const vector<ColorImage>& layers,
+                                                const vector<LayerInfo>&  layer_infos,
+                                                const bool                has_opaque_background,
+                                                const bool                force_smooth_background,
+                                                const int                 target_concurrency,
+                                                const double              skip_tolerance,
+                                                OptimizationStatistics*   statistics,
+                                                const UnmixingModel       model,
+                                                const std::size_t         memory_budget)
+    {
+        timer::Timer timer("perform_matte_refinement");
+        UNBLENDING_TRACE_SCOPE("perform_matte_refinement", "stage");
+        
+        const int radius = calculate_refinement_radius(image.width(), image.height());
+        
+        const MatteRefinementSetting setting = make_matte_refinement_setting(layer_infos, has_opaque_background, force_smooth_background, radius, target_concurrency, skip_tolerance, model);
+        
+        assert(layers.size() == setting.models.size());
+        
+        const int number = static_cast<int>(layers.size());
+        const int width  = image.width();
+        const int height = image.height();
+        
+        std::atomic<int>     num_skipped_pixels(0);
+        OptimizationCounter  counter;
+        
+        vector<ColorImage> refined_layers(number, ColorImage(width, height));
+        
+        bool      is_budget_exceeded;
+        const int band_height = calculate_band_height(width, height, number, setting.radius, memory_budget, is_budget_exceeded);
+        const int num_bands   = (height + band_height - 1) / band_height;
+        if (band_height >= height)
+        {
+            refine_band(image, layers, setting, 0, height, 0, refined_layers, counter, num_skipped_pixels);
+        }
+        else
+        {
+            const int num_halo_rows = 2 * setting.radius;
+            
+            for (int row_begin = 0; row_begin < height; row_begin += band_height)
+            {
+                const int row_end    = std::min(row_begin + band_height, height);
+                const int halo_begin = std::max(row_begin - num_halo_rows, 0);
+                const int halo_end   = std::min(row_end + num_halo_rows, height);
+                
+                vector<ColorImage> layer_bands;
+                for (const ColorImage& layer : layers) { layer_bands.push_back(layer.get_rows(halo_begin, halo_end)); }
+                
+                refine_band(image.get_rows(halo_begin, halo_end), layer_bands, setting, row_begin - halo_begin, row_end - halo_begin, halo_begin, refined_layers, counter, num_skipped_pixels);
+            }
+        }
+        
+        OptimizationStatistics local_statistics;
+        local_statistics.num_pixels         = width * height;
+        local_statistics.num_skipped_pixels = num_skipped_pixels;
+        local_statistics.num_bands          = num_bands;
+        local_statistics.band_height        = std::min(band_height, height);
+        local_statistics.is_budget_exceeded = is_budget_exceeded;
+        counter.write(local_statistics);
+        
+        if (statistics != nullptr) { *statistics = local_statistics; }
+        
+        return refined_layers;
+    }
+    
+    int calculate_refinement_radius(const int width, const int height)
+    {
+        return 60 * std::min(width, height) / 1000;
+    }
+    
+    vector<ColorImage> perform_matte_refinement_of_band(const ColorImage&         image_band,
+                                                        const vector<ColorImage>& layer_bands,
+                                                        const vector<LayerInfo>&  layer_infos,
+                                                        const bool                has_opaque_background,
+                                                        const bool                force_smooth_background,
+                                                        const int                 radius,
+                                                        const int                 row_begin,
+                                                        const int                 row_end,
+                                                        const int                 target_concurrency,
+                                                        OptimizationStatistics*   statistics,
+                                                        const UnmixingModel       model)
+    {
+        assert(0 <= row_begin && row_begin < row_end && row_end <= image_band.height());
+        
+        const MatteRefinementSetting setting = make_matte_refinement_setting(layer_infos, has_opaque_background, force_smooth_background, radius, target_concurrency, - 1.0, model);
+        
+        assert(layer_bands.size() == setting.models.size());
+        
+        const int number = static_cast<int>(layer_bands.size());
+        const int width  = image_band.width();
+        
+        std::atomic<int>    num_skipped_pixels(0);
+        OptimizationCounter counter;
+        
+        vector<ColorImage> refined_layers(number, ColorImage(width, row_end - row_begin));
+        refine_band(image_band, layer_bands, setting, row_begin, row_end, - row_begin, refined_layers, counter, num_skipped_pixels);
+        
+        if (statistics != nullptr)
+        {
+            statistics->num_pixels         = width * (row_end - row_begin);
+            statistics->num_skipped_pixels = 0;
+            counter.write(*statistics);
+        }
         
         return refined_layers;
     }
@@ -418,29 +801,40 @@ namespace unblending
     vector<ColorImage> compute_color_unmixing(const ColorImage&        image,
                                               const vector<LayerInfo>& layer_infos,
                                               const bool               has_opaque_background,
-                                              const int                target_concurrency)
+                                              const int                target_concurrency,
+                                              const bool               use_active_set,
+                                              const UnmixingModel      model,
+                                              OptimizationStatistics*  statistics)
     {
         timer::Timer timer("compute_color_unmixing");
+        UNBLENDING_TRACE_SCOPE("compute_color_unmixing", "stage");
         
         const vector<ColorModelPtr> models                  = extract_color_models           (layer_infos);
         const vector<CompOp>        comp_ops                = extract_comp_ops               (layer_infos);
         const vector<BlendMode>     modes                   = extract_blend_modes            (layer_infos);
         
+        const bool use_linear_model = model == UnmixingModel::Linear;
+        
+        const std::shared_ptr<const LinearUnmixingSolver> linear_solver = use_linear_model ? std::make_shared<const LinearUnmixingSolver>(models) : nullptr;
+        
         const int width      = image.width();
         const int height     = image.height();
         const int num_layers = static_cast<int>(models.size());
         
         vector<ColorImage> layers(num_layers, ColorImage(width, height));
         
+        OptimizationCounter counter;
+        
         auto per_pixel_process = [&](int x, int y)
         {
+            PerPixelOptimizationCounts counts;
+            
             const Vec3 pixel_color = image.get_rgb(x, y);
-            const VecX solution = solve_per_pixel_optimization(pixel_color,
-                                                               models,
-                                                               comp_ops,
-                                                               modes,
-                                                               false,
-                                                               has_opaque_background);
+            const VecX solution = use_linear_model ? linear_solver->solve(pixel_color, &counts) : use_active_set ?
+            solve_per_pixel_optimization_with_active_set(pixel_color, models, comp_ops, modes, has_opaque_background, &counts) :
+            solve_per_pixel_optimization(pixel_color, models, comp_ops, modes, false, has_opaque_background, VecX(), VecX(), false, Vec3(), &counts);
+            
+            counter.add(counts);
             
             for (int index = 0; index < num_layers; ++ index)
             {
@@ -448,36 +842,18 @@ namespace unblending
             }
         };
         
-        parallelutil::parallel_for_2d(width, height, per_pixel_process, target_concurrency);
-        
-        return layers;
-    }
-    
-    ColorImage composite_layers(const vector<ColorImage>& layers,
-                                const vector<CompOp>&     comp_ops,
-                                const vector<BlendMode>&  modes)
-    {
-        const int number = static_cast<int>(layers.size());
-        const int width  = layers.front().width();
-        const int height = layers.front().height();
-        
-        ColorImage composited_image(width, height);
+        {
+            StageScope scope("compute_color_unmixing/per_pixel_optimization");
+            parallel_for_tiles(width, height, per_pixel_process, "compute_color_unmixing/tile", target_concurrency);
+        }
         
-        for (int x = 0; x < width; ++ x) for (int y = 0; y < height; ++ y)
+        if (statistics != nullptr)
         {
-            VecX alphas(number);
-            VecX colors(number * 3);
-            
-            for (int index = 0; index < number; ++ index)
-            {
-                alphas(index)                = layers[index].get_rgba(x, y)(3);
-                colors.segment<3>(index * 3) = layers[index].get_rgb(x, y);
-            }
-            
-            const Vec4 composited_color = composite_layers(alphas, colors, comp_ops, modes);
-            composited_image.set_rgba(x, y, composited_color);
+            statistics->num_pixels         = width * height;
+            statistics->num_skipped_pixels = 0;
+            counter.write(*statistics);
         }
         
-        return composited_image;
+        return layers;
     }
 }
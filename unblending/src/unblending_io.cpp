@@ -1,8 +1,14 @@
 #include <unblending/unblending.hpp>
+#include <unblending/tracing.hpp>
+#include <mutex>
 #include <fstream>
 #include <iostream>
+#include <exception>
+#include <stdexcept>
+#include <algorithm>
 #include <json11.hpp>
 #include <Eigen/LU>
+#include <parallel-util.hpp>
 
 namespace unblending
 {
@@ -38,6 +44,13 @@ namespace unblending
             }
         }
         
+        bool is_number_array(const Json& json, std::size_t size)
+        {
+            if (!json.is_array() || json.array_items().size() != size) { return false; }
+            for (const Json& item : json.array_items()) { if (!item.is_number()) { return false; } }
+            return true;
+        }
+        
         Mat3 interpret_json_as_mat3(const Json& json)
         {
             Mat3 mat;
@@ -53,6 +66,8 @@ namespace unblending
         
         Vec3 interpret_json_as_vec3(const Json& json)
         {
+            if (!is_number_array(json, 3)) { throw std::runtime_error("LayerInfo parse error: \"primary_color\" should be three numbers"); }
+            
             return (Vec3() << json.array_items()[0].number_value(), json.array_items()[1].number_value(), json.array_items()[2].number_value()).finished();
         }
         
@@ -73,14 +88,13 @@ namespace unblending
             {
                 return Mat3::Identity() * json.number_value();
             }
-            else if (json.is_array() && json.array_items().size() == 9)
+            else if (is_number_array(json, 9))
             {
                 return interpret_json_as_mat3(json);
             }
             else
             {
-                std::cerr << "LayerInfo parse error" << std::endl;
-                exit(1);
+                throw std::runtime_error("LayerInfo parse error: \"color_variance\" should be a number or nine numbers");
             }
         }
         
@@ -136,18 +150,111 @@ namespace unblending
                        const std::string&             file_name_prefix,
                        const bool                     with_alpha_channel,
                        const bool                     with_blend_mode_suffix,
-                       const std::vector<LayerInfo>&  layer_infos)
+                       const std::vector<LayerInfo>&  layer_infos,
+                       const int                      png_compression_level,
+                       const int                      target_concurrency,
+                       const bool                     crop_to_alpha_bounding_box)
     {
         assert((!with_blend_mode_suffix) || layer_infos.size() == layers.size());
         
+        UNBLENDING_TRACE_SCOPE("export_layers", "stage");
+        
+        // Pixels whose alphas are below 1 / 255 are written as fully transparent anyway, so cropping them does not change
+        // the composition. The alpha images are not cropped since they are written as opaque images (see
+        // Image::convert_row_to_argb32), where the cropped pixels would not be distinguishable from the others.
+        vector<ImageRegion> regions;
+        if (crop_to_alpha_bounding_box)
+        {
+            for (const ColorImage& layer : layers)
+            {
+                ImageRegion region = calculate_alpha_bounding_box(layer, 1.0 / 255.0, target_concurrency);
+                if (region.is_empty()) { region.width = region.height = 1; }
+                regions.push_back(region);
+            }
+        }
+        
+        // Collect the files first so that all of them (not only the layers) are encoded concurrently
+        struct ExportJob
+        {
+            int         index;
+            bool        is_alpha;
+            std::string file_name;
+        };
+        
+        vector<ExportJob> jobs;
         for (int index = 0; index < layers.size(); ++ index)
         {
             const std::string suffix = with_blend_mode_suffix ? "_" + retrieve_name(layer_infos[index].blend_mode) : "";
-            layers[index].save(output_directory_path + "/" + file_name_prefix + "_" + std::to_string(index) + suffix + ".png");
+            jobs.push_back({ index, false, file_name_prefix + "_" + std::to_string(index) + suffix + ".png" });
             if (with_alpha_channel)
             {
-                layers[index].get_a().save(output_directory_path + "/" + file_name_prefix + "-alpha_" + std::to_string(index) + ".png");
+                jobs.push_back({ index, true, file_name_prefix + "-alpha_" + std::to_string(index) + ".png" });
+            }
+        }
+        
+        // Exceptions cannot leave the threads of the parallel loop, so the first one is rethrown after the loop
+        std::mutex         exception_mutex;
+        std::exception_ptr exception;
+        
+        // Each file is converted by a single thread since the files themselves are processed in parallel
+        auto save_file = [&](int job_index)
+        {
+            const ExportJob&  job       = jobs[job_index];
+            const ColorImage& layer     = layers[job.index];
+            const std::string file_path = output_directory_path + "/" + job.file_name;
+            
+            UNBLENDING_TRACE_SCOPE_WITH_ARG("save_layer", "export", job.index);
+            
+            try
+            {
+                if (job.is_alpha) { layer.get_a().save(file_path, png_compression_level, 1); }
+                else if (crop_to_alpha_bounding_box) { layer.get_region(regions[job.index]).save(file_path, png_compression_level, 1); }
+                else { layer.save(file_path, png_compression_level, 1); }
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(exception_mutex);
+                if (!exception) { exception = std::current_exception(); }
+            }
+        };
+        parallelutil::queue_based_parallel_for(static_cast<int>(jobs.size()), save_file, target_concurrency);
+        if (exception) { std::rethrow_exception(exception); }
+        
+        // Record the offsets of the cropped files (the alpha images cover the whole canvas)
+        if (crop_to_alpha_bounding_box)
+        {
+            vector<Json> layer_jsons;
+            for (const ExportJob& job : jobs)
+            {
+                ImageRegion region = regions[job.index];
+                if (job.is_alpha)
+                {
+                    region        = ImageRegion();
+                    region.width  = layers[job.index].width();
+                    region.height = layers[job.index].height();
+                }
+                layer_jsons.push_back(Json::object
+                {
+                    { "file",   job.file_name },
+                    { "x",      region.x },
+                    { "y",      region.y },
+                    { "width",  region.width },
+                    { "height", region.height }
+                });
             }
+            
+            const Json json_object = Json::object
+            {
+                { "width",  layers.empty() ? 0 : layers.front().width() },
+                { "height", layers.empty() ? 0 : layers.front().height() },
+                { "files",  layer_jsons }
+            };
+            
+            const std::string file_path = output_directory_path + "/" + file_name_prefix + "_regions.json";
+            std::ofstream     writing_file(file_path);
+            writing_file << json_object.dump();
+            writing_file.close();
+            if (!writing_file) { throw std::runtime_error("cannot write " + file_path); }
         }
     }
     
@@ -164,20 +271,40 @@ namespace unblending
     void export_layer_infos(const std::vector<LayerInfo>& layer_infos,
                             const std::string& output_directory_path)
     {
-        const Json json_object = interpret_layer_infos_as_json(layer_infos);
-        
-        std::ofstream writing_file(output_directory_path + "/layer_infos.json");
-        writing_file << json_object.dump();
+        const std::string file_path = output_directory_path + "/layer_infos.json";
+        std::ofstream     writing_file(file_path);
+        writing_file << serialize_layer_infos(layer_infos);
+        writing_file.close();
+        if (!writing_file) { throw std::runtime_error("cannot write " + file_path); }
     }
     
     std::vector<LayerInfo> import_layer_infos(const std::string& input_file_path)
     {
         std::ifstream reading_file(input_file_path);
+        if (!reading_file) { throw std::runtime_error("cannot read " + input_file_path); }
+        
         const std::string json_text = std::string(std::istreambuf_iterator<char>(reading_file), std::istreambuf_iterator<char>());;
         
+        return parse_layer_infos(json_text);
+    }
+    
+    std::string serialize_layer_infos(const std::vector<LayerInfo>& layer_infos)
+    {
+        const Json json_object = interpret_layer_infos_as_json(layer_infos);
+        
+        return json_object.dump();
+    }
+    
+    std::vector<LayerInfo> parse_layer_infos(const std::string& json_text)
+    {
         std::string err;
         const auto json = Json::parse(json_text, err);
         
+        if (!err.empty()) { throw std::runtime_error("LayerInfo parse error: " + err); }
+        if (!json.is_array() || json.array_items().empty()) { throw std::runtime_error("LayerInfo parse error: layer infos should be a non-empty array"); }
+        
+        const vector<BlendMode> mode_list = get_blend_mode_list();
+        
         std::vector<LayerInfo> layer_infos;
         
         for (const auto& layer_info_json : json.array_items())
@@ -185,6 +312,9 @@ namespace unblending
             const std::string mode_name    = layer_info_json["mode"].string_value();
             const std::string comp_op_name = layer_info_json["comp_op"].string_value();
             
+            const bool is_known_mode = std::any_of(mode_list.begin(), mode_list.end(), [&](BlendMode mode) { return retrieve_name(mode) == mode_name; });
+            if (!is_known_mode) { throw std::runtime_error("LayerInfo parse error: unknown blend mode \"" + mode_name + "\""); }
+            
             const CompOp    comp_op = (comp_op_name == "source-over") ? CompOp::SourceOver() : CompOp::Plus();
             const BlendMode mode    = retrieve_by_name(mode_name);
             
@@ -193,6 +323,8 @@ namespace unblending
             const Vec3 mu    = interpret_json_as_vec3    (model["primary_color" ]);
             const Mat3 sigma = interpret_json_as_variance(model["color_variance"]);
             
+            if (sigma.determinant() == 0.0 || !sigma.allFinite()) { throw std::runtime_error("LayerInfo parse error: \"color_variance\" should be invertible"); }
+            
             layer_infos.push_back(LayerInfo{ comp_op, mode, std::make_shared<GaussianColorModel>(mu, sigma.inverse()) });
         }
         
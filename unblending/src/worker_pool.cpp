@@ -0,0 +1,87 @@
+#include <unblending/worker_pool.hpp>
+#include <algorithm>
+
+namespace unblending
+{
+    WorkerPool::WorkerPool(int num_threads)
+    {
+        const int hardware_concurrency = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+        const int num_total_threads    = (num_threads > 0) ? num_threads : hardware_concurrency;
+
+        for (int thread_index = 1; thread_index < num_total_threads; ++ thread_index)
+        {
+            threads_.emplace_back(&WorkerPool::run_worker, this, thread_index);
+        }
+    }
+
+    WorkerPool::~WorkerPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            is_terminating_ = true;
+        }
+        start_condition_.notify_all();
+
+        for (std::thread& thread : threads_) { thread.join(); }
+    }
+
+    void WorkerPool::parallel_for(int n, const std::function<void(int index, int thread_index)>& process)
+    {
+        if (n <= 0) { return; }
+
+        std::lock_guard<std::mutex> loop_lock(loop_mutex_);
+
+        // Run small loops (or all loops without workers) on the calling thread only
+        if (threads_.empty() || n == 1)
+        {
+            for (int index = 0; index < n; ++ index) { process(index, 0); }
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            process_            = &process;
+            num_indices_        = n;
+            next_index_         = 0;
+            num_active_workers_ = static_cast<int>(threads_.size());
+            ++ generation_;
+        }
+        start_condition_.notify_all();
+
+        process_indices(0);
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        finish_condition_.wait(lock, [&]() { return num_active_workers_ == 0; });
+        process_ = nullptr;
+    }
+
+    void WorkerPool::run_worker(int thread_index)
+    {
+        int last_generation = 0;
+        while (true)
+        {
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                start_condition_.wait(lock, [&]() { return is_terminating_ || generation_ != last_generation; });
+                if (is_terminating_) { return; }
+                last_generation = generation_;
+            }
+
+            process_indices(thread_index);
+
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                -- num_active_workers_;
+            }
+            finish_condition_.notify_one();
+        }
+    }
+
+    void WorkerPool::process_indices(int thread_index)
+    {
+        for (int index = next_index_++; index < num_indices_; index = next_index_++)
+        {
+            (*process_)(index, thread_index);
+        }
+    }
+}